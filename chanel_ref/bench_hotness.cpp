@@ -0,0 +1,72 @@
+#include "hotnesskernels.h"
+
+#include <algorithm>
+#include <random>
+#include <time.h>
+#include <vector>
+
+// pages each kernel runs on at once, as in HotnessTracker::classify()
+#define CHUNK 2048
+
+static const char *ISA_NAMES[] = {"scalar", "avx2", "avx512"};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  size_t pages;
+  int rounds;
+  if (argc != 3 || sscanf(argv[1], "%lu", &pages) != 1 ||
+      sscanf(argv[2], "%d", &rounds) != 1 || rounds <= 0) {
+    printf("USAGE: %s <pages> <rounds>\n", argv[0]);
+    return 1;
+  }
+  // columns of pages sampled over the last 10 minutes, 1% of them hot
+  std::mt19937 random(42);
+  std::vector<uint64_t> pfns(pages);
+  std::vector<float> frequency(pages);
+  std::vector<uint32_t> last(pages);
+  std::vector<uint8_t> hot(pages);
+  for (size_t i = 0; i < pages; i++) {
+    pfns[i] = 0x7f0000000UL + i;
+    frequency[i] = random() % 100 == 0 ? 20 + random() % 1000 : random() % 8;
+    last[i] = random() % 600000;
+  }
+  HotnessKernels::Decay decay = {600000, 1 / 60000.f, 1, 1 / 1000.f};
+  std::vector<uint64_t> out(pages + 1);
+  float scores[CHUNK];
+  for (int isa = HotnessKernels::ISA_SCALAR; isa <= HotnessKernels::ISA_AVX512;
+       isa++) {
+    const HotnessKernels &kernels = HotnessKernels::get((HotnessKernels::Isa)isa);
+    if (kernels.isa != isa) {
+      printf("%-6s  not supported\n", ISA_NAMES[isa]);
+      continue;
+    }
+    double classify = 0, extract = 0;
+    size_t hot_count = 0, extracted = 0;
+    uint64_t histogram[HOTNESS_BUCKETS];
+    for (int round = 0; round < rounds; round++) {
+      std::fill(hot.begin(), hot.end(), 0);
+      memset(histogram, 0, sizeof(histogram));
+      double start = now();
+      hot_count = 0;
+      for (size_t base = 0; base < pages; base += CHUNK) {
+        size_t count = std::min(pages - base, (size_t)CHUNK);
+        kernels.score(&frequency[base], &last[base], count, decay, scores);
+        hot_count += kernels.classify(scores, &hot[base], count, 10, 5);
+        kernels.histogram(scores, count, histogram);
+      }
+      double middle = now();
+      extracted = kernels.extract(hot.data(), pfns.data(), pages, out.data());
+      classify += middle - start;
+      extract += now() - middle;
+    }
+    printf("%-6s  classify %8.2f ms  extract %7.2f ms  hot %lu/%lu\n",
+           ISA_NAMES[isa], classify * 1e3 / rounds, extract * 1e3 / rounds,
+           hot_count, extracted);
+  }
+  return 0;
+}
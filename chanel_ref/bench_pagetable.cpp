@@ -0,0 +1,119 @@
+#include "pagetable.h"
+
+#include <malloc.h>
+#include <random>
+#include <time.h>
+#include <unordered_map>
+#include <vector>
+
+// the map used for page hotness so far
+struct PageInfo {
+  unsigned long address;
+  unsigned int accessCount;
+  time_t lastAccessTime;
+  bool isHot;
+};
+
+const unsigned int HOT_ACCESS_THRESHOLD = 10;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t heapUsed() { return mallinfo2().uordblks; }
+
+// addresses of <accesses> samples over <pages> pages, skewed so that a few
+// pages take most samples, like the sampled accesses of a real workload
+static std::vector<unsigned long> makeTrace(size_t pages, size_t accesses) {
+  std::mt19937_64 random(42);
+  std::vector<unsigned long> bases(pages);
+  // pages of a few big mappings, not contiguous
+  for (size_t i = 0; i < pages; i++)
+    bases[i] = (0x7f0000000000UL + (i / 4096) * (1UL << 30) + (i % 4096) * 4096) |
+               (random() & 0xFFF);
+  std::vector<unsigned long> trace(accesses);
+  std::exponential_distribution<double> skew(8.0);
+  for (size_t i = 0; i < accesses; i++) {
+    // the first access of each page goes in order, then skewed
+    size_t page = i < pages ? i : (size_t)(skew(random) * pages) % pages;
+    trace[i] = bases[page];
+  }
+  return trace;
+}
+
+static void benchMap(const std::vector<unsigned long> &trace, size_t pages) {
+  size_t heap = heapUsed();
+  double start = now();
+  std::unordered_map<unsigned long, PageInfo> map;
+  for (size_t i = 0; i < pages; i++) {
+    unsigned long address = trace[i] & ~0xFFFUL;
+    map[address] = {address, 1, 0, false};
+  }
+  double insert = now();
+  for (size_t i = pages; i < trace.size(); i++) {
+    auto it = map.find(trace[i] & ~0xFFFUL);
+    if (it != map.end())
+      it->second.accessCount++;
+  }
+  double increment = now();
+  size_t hot = 0;
+  for (auto &it : map) {
+    PageInfo &page = it.second;
+    page.isHot = page.accessCount > HOT_ACCESS_THRESHOLD;
+    hot += page.isHot;
+    page.accessCount = 0;
+  }
+  double classify = now();
+  printf("unordered_map  insert %7.1f ns  increment %6.1f ns  classify %5.1f ns"
+         "  memory %6.1f B/page  hot %lu\n",
+         (insert - start) * 1e9 / pages,
+         (increment - insert) * 1e9 / (trace.size() - pages),
+         (classify - increment) * 1e9 / pages,
+         (double)(heapUsed() - heap) / pages, hot);
+}
+
+static void benchTable(const std::vector<unsigned long> &trace, size_t pages) {
+  double start = now();
+  PageTable<PageHeat> table;
+  // the capacity is not known beforehand, let it grow
+  if (table.init(1024) < 0)
+    exit(1);
+  for (size_t i = 0; i < pages; i++)
+    table.insert(trace[i] >> 12)->touch();
+  double insert = now();
+  for (size_t i = pages; i < trace.size(); i++) {
+    PageHeat *page = table.find(trace[i] >> 12);
+    if (page != NULL)
+      page->touch();
+  }
+  double increment = now();
+  size_t hot = 0;
+  table.forEach([&](uint64_t, PageHeat &page) {
+    page.hot = page.count > HOT_ACCESS_THRESHOLD;
+    hot += page.hot;
+    page.count = 0;
+  });
+  double classify = now();
+  printf("PageTable      insert %7.1f ns  increment %6.1f ns  classify %5.1f ns"
+         "  memory %6.1f B/page  hot %lu\n",
+         (insert - start) * 1e9 / pages,
+         (increment - insert) * 1e9 / (trace.size() - pages),
+         (classify - increment) * 1e9 / pages,
+         (double)table.memory() / pages, hot);
+}
+
+int main(int argc, char *argv[]) {
+  size_t pages, accesses;
+  if (argc != 3 || sscanf(argv[1], "%lu", &pages) != 1 ||
+      sscanf(argv[2], "%lu", &accesses) != 1 || pages == 0 ||
+      accesses <= pages) {
+    printf("USAGE: %s <pages> <accesses>\n", argv[0]);
+    return 1;
+  }
+  std::vector<unsigned long> trace = makeTrace(pages, accesses);
+  benchMap(trace, pages);
+  benchTable(trace, pages);
+  return 0;
+}
@@ -1,17 +1,17 @@
 #include "channel.h"
 
+#include "eventcatalog.h"
+
 #include <linux/perf_event.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
-#define WAKEUP_EVENTS 1
 #define INIT_SAMPLE_PERIOD 100000
 #define PAGE_SIZE 4096
-#define RING_BUFFER_PAGES 4
-#define MMAP_SIZE ((1 + RING_BUFFER_PAGES) * PAGE_SIZE)
-#define READ_MEMORY_BARRIER() __builtin_ia32_lfence()
+#define MMAP_SIZE(ring_pages) ((1 + (ring_pages)) * PAGE_SIZE)
 
 // wrapper of perf_event_open() syscall
 static int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu,
@@ -19,41 +19,140 @@ static int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu,
   return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
 }
 
-Channel::Channel() { m_fd = -1; }
+Channel::Channel() {
+  m_fd = -1;
+  m_aux_fd = -1;
+}
 
 Channel::~Channel() { unbind(); }
 
-int Channel::bind(pid_t pid, Type type) {
+int Channel::bind(pid_t pid, Type type) { return bind(pid, type, Options()); }
+
+int Channel::bind(pid_t pid, Type type, const Options &options) {
+  return bindEvent(pid, -1, type, options, NULL);
+}
+
+int Channel::bindCpu(int cpu, Type type, const Options &options,
+                     const PidFilter *filter) {
+  if (cpu < 0 || filter == NULL)
+    ERROR({}, -EINVAL, false, "invalid cpu %d or filter %p", cpu, filter);
+  return bindEvent(-1, cpu, type, options, filter);
+}
+
+int Channel::bindEvent(pid_t pid, int cpu, Type type, const Options &options,
+                       const PidFilter *filter) {
   if (m_fd >= 0)
     ERROR({}, -EINVAL, false, "this Channel has already bound");
+  size_t pages = options.ring_pages;
+  if (pages == 0 || (pages & (pages - 1)) != 0)
+    ERROR({}, -EINVAL, false, "ring_pages %lu is not a power of 2", pages);
+  if (options.wakeup_value == 0)
+    ERROR({}, -EINVAL, false, "wakeup_value is zero");
+  uint64_t fields = options.fields;
+  for (uint64_t field : OPTIONAL_FIELDS)
+    fields &= ~field;
+  if (fields != 0)
+    ERROR({}, -EINVAL, false, "unknown fields %lx", fields);
+  EventCatalog::Encoding encoding;
+  int ret = EventCatalog::instance().lookup(type, options.load_latency,
+                                            &encoding);
+  if (ret < 0)
+    ERROR({}, ret, false, "no encoding of type %d on this cpu", (int)type);
+  m_pid = pid;
+  m_cpu = cpu;
+  m_filter = filter;
+  m_type = type;
+  m_event_type = encoding.type;
+  m_config = encoding.config;
+  m_config1 = encoding.config1;
+  m_aux_config = encoding.aux_config;
+  m_options = options;
+  m_exits.clear();
+  m_decoder = 0;
+  for (size_t i = 0; i < OPTIONAL_FIELD_COUNT; i++)
+    if (options.fields & OPTIONAL_FIELDS[i])
+      m_decoder |= 1UL << i;
+  ret = openEvent(options.wakeup_value, &m_fd, &m_aux_fd, &m_id, &m_buffer);
+  if (ret < 0)
+    ERROR({}, ret, false, "openEvent(%u) failed", options.wakeup_value);
+  m_wakeup = options.wakeup_value;
+  m_ring.attach(m_buffer, PAGE_SIZE * m_options.ring_pages);
+  m_ring.resetStats();
+  m_period = 0;
+  m_rate_time = 0;
+  m_rate_bytes = 0;
+  measureRate();
+  return 0;
+}
+
+int Channel::openEvent(uint32_t wakeup, int *fd_out, int *aux_fd_out,
+                       uint64_t *id_out, void **buffer_out) {
   struct perf_event_attr attr;
+  // some events (e.g. load latency on Sapphire Rapids) only count in a group
+  // led by an auxiliary event, which is counted but never sampled
+  int aux_fd = -1;
+  if (m_aux_config != 0) {
+    memset(&attr, 0, sizeof(struct perf_event_attr));
+    attr.type = m_event_type;
+    attr.config = m_aux_config;
+    attr.size = sizeof(struct perf_event_attr);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    aux_fd = perf_event_open(&attr, m_pid, m_cpu, -1, 0);
+    if (aux_fd < 0) {
+      int ret = -errno;
+      ERROR({}, ret, true,
+            "perf_event_open(&aux_attr, %d, %d, -1, 0) failed: ", m_pid,
+            m_cpu);
+    }
+  }
   memset(&attr, 0, sizeof(struct perf_event_attr));
-  attr.type = PERF_TYPE_RAW;
-  attr.config = (uint64_t)type;
+  attr.type = m_event_type;
+  attr.config = m_config;
+  attr.config1 = m_config1;
   attr.size = sizeof(struct perf_event_attr);
   attr.sample_period = INIT_SAMPLE_PERIOD;
-  // sample id, pid, tid, address and cpu
-  attr.sample_type = PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_TID |
-                     PERF_SAMPLE_ADDR | PERF_SAMPLE_CPU;
+  attr.sample_type = BASE_SAMPLE_TYPE | m_options.fields;
   attr.disabled = 1;
   attr.exclude_kernel = 1;
   attr.precise_ip = 3;
-  attr.wakeup_events = WAKEUP_EVENTS;
+  // a cpu-wide event sees every process, ask for exits to clean them up
+  if (m_cpu >= 0)
+    attr.task = 1;
+  if (m_options.wakeup == WAKEUP_EVENTS) {
+    attr.wakeup_events = wakeup;
+  } else {
+    attr.watermark = 1;
+    attr.wakeup_watermark = wakeup;
+  }
   // open perf event
-  int fd = perf_event_open(&attr, pid, -1, -1, 0);
+  int fd = perf_event_open(&attr, m_pid, m_cpu, aux_fd, 0);
   if (fd < 0) {
     int ret = -errno;
-    ERROR({}, ret, true, "perf_event_open(&attr, %d, -1, -1, 0) failed: ", pid);
+    ERROR(
+        {
+          if (aux_fd >= 0)
+            close(aux_fd);
+        },
+        ret, true, "perf_event_open(&attr, %d, %d, %d, 0) failed: ", m_pid,
+        m_cpu, aux_fd);
   }
   // create ring buffer
+  size_t mmap_size = MMAP_SIZE(m_options.ring_pages);
   void *buffer =
-      mmap(NULL, MMAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   if (buffer == MAP_FAILED) {
     int ret = -errno;
-    ERROR(close(fd), ret, true,
-          "mmap(NULL, %u, PROT_READ | PROT_WRITE, MAP_SHARED, %d, 0)"
-          " failed: ",
-          MMAP_SIZE, fd);
+    ERROR(
+        {
+          close(fd);
+          if (aux_fd >= 0)
+            close(aux_fd);
+        },
+        ret, true,
+        "mmap(NULL, %lu, PROT_READ | PROT_WRITE, MAP_SHARED, %d, 0)"
+        " failed: ",
+        mmap_size, fd);
   }
   // get id
   uint64_t id;
@@ -62,28 +161,79 @@ int Channel::bind(pid_t pid, Type type) {
     int ret = -errno;
     ERROR(
         {
-          munmap(buffer, MMAP_SIZE);
+          munmap(buffer, mmap_size);
           close(fd);
+          if (aux_fd >= 0)
+            close(aux_fd);
         },
         ret, true, "ioctl(%d, PERF_EVENT_IOC_ID, &id) failed: ", fd);
   }
-  m_pid = pid;
-  m_type = type;
-  m_fd = fd;
-  m_id = id;
-  m_buffer = buffer;
-  m_period = 0;
+  *fd_out = fd;
+  *aux_fd_out = aux_fd;
+  *id_out = id;
+  *buffer_out = buffer;
   return 0;
 }
 
+void Channel::closeEvent(int fd, int aux_fd, void *buffer) {
+  int ret = munmap(buffer, MMAP_SIZE(m_options.ring_pages));
+  assert(ret == 0);
+  ret = close(fd);
+  assert(ret == 0);
+  if (aux_fd >= 0) {
+    ret = close(aux_fd);
+    assert(ret == 0);
+  }
+}
+
 void Channel::unbind() {
   if (m_fd < 0)
     return;
-  int ret = munmap(m_buffer, MMAP_SIZE);
-  assert(ret == 0);
-  ret = close(m_fd);
-  assert(ret == 0);
+  m_ring.detach();
+  closeEvent(m_fd, m_aux_fd, m_buffer);
   m_fd = -1;
+  m_aux_fd = -1;
+}
+
+int Channel::setWakeup(uint32_t wakeup) {
+  if (m_fd < 0)
+    ERROR({}, -EINVAL, false, "this Channel has not bound yet");
+  if (wakeup == 0)
+    ERROR({}, -EINVAL, false, "param <wakeup> is zero");
+  if (wakeup == m_wakeup)
+    return 0;
+  // the wakeup threshold cannot be changed on an opened event, so open a new
+  // one and enable it; the old one is closed once the new one is enabled
+  int fd, aux_fd;
+  uint64_t id;
+  void *buffer;
+  int ret = openEvent(wakeup, &fd, &aux_fd, &id, &buffer);
+  if (ret < 0)
+    ERROR({}, ret, false, "openEvent(%u) failed", wakeup);
+  if (m_period != 0) {
+    ret = ioctl(fd, PERF_EVENT_IOC_PERIOD, &m_period);
+    if (ret < 0) {
+      ret = -errno;
+      ERROR({ closeEvent(fd, aux_fd, buffer); }, ret, true,
+            "ioctl(%d, PERF_EVENT_IOC_PERIOD, &(%lu)) failed: ", fd, m_period);
+    }
+    int group_fd = aux_fd >= 0 ? aux_fd : fd;
+    ret = ioctl(group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    if (ret < 0) {
+      ret = -errno;
+      ERROR({ closeEvent(fd, aux_fd, buffer); }, ret, true,
+            "ioctl(%d, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) failed: ",
+            group_fd);
+    }
+  }
+  closeEvent(m_fd, m_aux_fd, m_buffer);
+  m_fd = fd;
+  m_aux_fd = aux_fd;
+  m_id = id;
+  m_buffer = buffer;
+  m_wakeup = wakeup;
+  m_ring.attach(buffer, PAGE_SIZE * m_options.ring_pages);
+  return 0;
 }
 
 int Channel::setPeriod(unsigned long period) {
@@ -92,13 +242,16 @@ int Channel::setPeriod(unsigned long period) {
   if (period == m_period)
     return 0;
   int ret;
+  // a group is enabled and disabled as a whole through its leader
+  int group_fd = m_aux_fd >= 0 ? m_aux_fd : m_fd;
   // disable channel
   if (period == 0) {
-    ret = ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+    ret = ioctl(group_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
     if (ret < 0) {
       ret = -errno;
       ERROR({}, ret, true,
-            "ioctl(%d, PERF_EVENT_IOC_DISABLE, 0) failed: ", m_fd);
+            "ioctl(%d, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP) failed: ",
+            group_fd);
     }
     m_period = 0;
     return 0;
@@ -112,65 +265,118 @@ int Channel::setPeriod(unsigned long period) {
   }
   // if channel was disabled, enable it
   if (m_period == 0) {
-    ret = ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+    ret = ioctl(group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
     if (ret < 0) {
       ret = -errno;
       ERROR({}, ret, true,
-            "ioctl(%d, PERF_EVENT_IOC_ENABLE, 0) failed: ", m_fd);
+            "ioctl(%d, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) failed: ",
+            group_fd);
     }
   }
   m_period = period;
   return 0;
 }
 
-// see man page for perf_event_open()
-struct perf_sample {
-  struct perf_event_header header;
-  uint64_t id;
-  uint32_t pid, tid;
-  uint64_t address;
-  uint32_t cpu, ret;
-};
+#ifndef PERF_MEM_LVLNUM_UNC
+#define PERF_MEM_LVLNUM_UNC 0x08
+#endif
+#ifndef PERF_MEM_LVLNUM_CXL
+#define PERF_MEM_LVLNUM_CXL 0x09
+#endif
 
-int Channel::readSample(Sample *sample) {
-  if (m_fd < 0)
-    ERROR({}, -EINVAL, false, "this Channel has not bound yet");
-  // the header
-  auto *meta = (struct perf_event_mmap_page *)m_buffer;
-  uint64_t tail = meta->data_tail;
-  uint64_t head = meta->data_head;
-  READ_MEMORY_BARRIER();
-  assert(tail <= head);
-  if (tail == head)
-    return -EAGAIN;
-  bool available = false;
-  while (tail < head) {
-    // the data_head and data_tail never wrap, they are logical
-    uint64_t position = tail % (PAGE_SIZE * RING_BUFFER_PAGES);
-    auto *entry =
-        (struct perf_sample *)((char *)m_buffer + PAGE_SIZE + position);
-    tail += entry->header.size;
-    // read the record
-    if (entry->header.type == PERF_RECORD_SAMPLE && entry->id == m_id &&
-        // this line is to filter the wrong pid caused by kernel bug
-        entry->pid == m_pid) {
-      sample->type = m_type;
-      sample->cpu = entry->cpu;
-      sample->pid = entry->pid;
-      sample->tid = entry->tid;
-      sample->address = entry->address;
-      available = true;
-      break;
+Channel::MemLevel Channel::decodeLevel(uint64_t data_src) {
+  // indexed by PERF_MEM_LVLNUM_*
+  static const MemLevel LEVELS[16] = {
+      MEM_UNKNOWN, MEM_L1,      MEM_L2,      MEM_L3,      MEM_L3,
+      MEM_UNKNOWN, MEM_UNKNOWN, MEM_UNKNOWN, MEM_UNCACHED, MEM_CXL,
+      MEM_IO,      MEM_L3,      MEM_LFB,     MEM_LOCAL_DRAM, MEM_PMEM,
+      MEM_UNKNOWN,
+  };
+  union perf_mem_data_src src;
+  src.val = data_src;
+  uint32_t lvl_num = src.mem_lvl_num;
+  if (lvl_num != 0 && lvl_num != PERF_MEM_LVLNUM_NA) {
+    MemLevel level = LEVELS[lvl_num];
+    if (src.mem_remote) {
+      if (level == MEM_LOCAL_DRAM)
+        return MEM_REMOTE_DRAM;
+      if (level == MEM_L3)
+        return MEM_REMOTE_CACHE;
     }
+    return level;
   }
-  assert(tail <= head);
-  // update data_tail to notify kernel write new data
-  meta->data_tail = tail;
-  return available ? 0 : -EAGAIN;
+  // older kernels only fill the PERF_MEM_LVL_* bits
+  uint32_t lvl = src.mem_lvl;
+  if (lvl & PERF_MEM_LVL_L1)
+    return MEM_L1;
+  if (lvl & PERF_MEM_LVL_LFB)
+    return MEM_LFB;
+  if (lvl & PERF_MEM_LVL_L2)
+    return MEM_L2;
+  if (lvl & PERF_MEM_LVL_L3)
+    return MEM_L3;
+  if (lvl & PERF_MEM_LVL_LOC_RAM)
+    return MEM_LOCAL_DRAM;
+  if (lvl & (PERF_MEM_LVL_REM_RAM1 | PERF_MEM_LVL_REM_RAM2))
+    return MEM_REMOTE_DRAM;
+  if (lvl & (PERF_MEM_LVL_REM_CCE1 | PERF_MEM_LVL_REM_CCE2))
+    return MEM_REMOTE_CACHE;
+  if (lvl & PERF_MEM_LVL_IO)
+    return MEM_IO;
+  if (lvl & PERF_MEM_LVL_UNC)
+    return MEM_UNCACHED;
+  return MEM_UNKNOWN;
+}
+
+int Channel::readSample(Sample *sample) {
+  ssize_t ret = readSamples(sample, 1);
+  if (ret < 0)
+    return (int)ret;
+  return ret > 0 ? 0 : -EAGAIN;
+}
+
+ssize_t Channel::readSamples(Sample *samples, size_t count) {
+  size_t n = 0;
+  return visitSamples<Sample>(
+      count, [&](const Sample &sample) { samples[n++] = sample; });
+}
+
+ssize_t Channel::readSamples(ExtSample *samples, size_t count) {
+  size_t n = 0;
+  return visitSamples<ExtSample>(
+      count, [&](const ExtSample &sample) { samples[n++] = sample; });
+}
+
+size_t Channel::readExits(pid_t *pids, size_t count) {
+  size_t n = count < m_exits.size() ? count : m_exits.size();
+  memcpy(pids, m_exits.data(), n * sizeof(pid_t));
+  m_exits.erase(m_exits.begin(), m_exits.begin() + n);
+  return n;
 }
 
 pid_t Channel::getPid() { return m_pid; }
 
+int Channel::getCpu() { return m_cpu; }
+
 Channel::Type Channel::getType() { return m_type; }
 
-int Channel::getPerfFd() { return m_fd; }
\ No newline at end of file
+int Channel::getPerfFd() { return m_fd; }
+
+unsigned long Channel::getPeriod() { return m_period; }
+
+uint32_t Channel::getWakeup() { return m_wakeup; }
+
+double Channel::measureRate() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+  uint64_t bytes = m_ring.getStats().bytes;
+  double rate = 0;
+  if (m_rate_time != 0 && now > m_rate_time)
+    rate = (double)(bytes - m_rate_bytes) * 1e9 / (now - m_rate_time);
+  m_rate_time = now;
+  m_rate_bytes = bytes;
+  return rate;
+}
+
+const RingBuffer::Stats &Channel::getStats() { return m_ring.getStats(); }
\ No newline at end of file
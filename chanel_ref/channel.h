@@ -2,14 +2,25 @@
 #define CHANNEL_H
 
 #include "common.h"
+#include "pidfilter.h"
+#include "ringbuffer.h"
+#include "sampledecoder.h"
 
+#include <array>
 #include <unistd.h>
+#include <utility>
+#include <vector>
 
 class Channel {
 public:
+  /* Logical events, see EventCatalog for their encodings on each cpu.
+   */
   enum Type {
-    CHANNEL_LOAD = 0x01D3,  // sample load instructions
-    CHANNEL_STORE = 0x01D3, // sample store instructions
+    CHANNEL_LOAD = 1,         // loads slower than Options::load_latency
+    CHANNEL_STORE,            // all stores
+    CHANNEL_LOAD_LOCAL_DRAM,  // loads that missed L3 and hit local DRAM
+    CHANNEL_LOAD_REMOTE_DRAM, // loads that missed L3 and hit remote DRAM
+    CHANNEL_LOAD_STLB_MISS,   // loads that missed the STLB
   };
 
   struct Sample {
@@ -20,6 +31,58 @@ public:
     uint64_t address; // the virtual address in this process to be accessed
   };
 
+  /* Optional fields of a sample, see Options::fields.
+   */
+  enum Field : uint64_t {
+    FIELD_IP = PERF_SAMPLE_IP,               // the instruction
+    FIELD_TIME = PERF_SAMPLE_TIME,           // the timestamp
+    FIELD_WEIGHT = PERF_SAMPLE_WEIGHT,       // the cost, i.e. the latency
+    FIELD_DATA_SRC = PERF_SAMPLE_DATA_SRC,   // where the data came from
+    FIELD_PHYS_ADDR = PERF_SAMPLE_PHYS_ADDR, // the physical address
+  };
+
+  /* Where the data of a sample was found, decoded from FIELD_DATA_SRC.
+   */
+  enum MemLevel : uint8_t {
+    MEM_UNKNOWN,      // not available
+    MEM_L1,           // L1 cache
+    MEM_LFB,          // line fill buffer, i.e. a pending miss
+    MEM_L2,           // L2 cache
+    MEM_L3,           // L3 cache (or L4) of this socket
+    MEM_REMOTE_CACHE, // a cache of another socket
+    MEM_LOCAL_DRAM,   // DRAM of this socket
+    MEM_REMOTE_DRAM,  // DRAM of another socket
+    MEM_CXL,          // memory behind a CXL device
+    MEM_PMEM,         // persistent memory
+    MEM_IO,           // I/O memory
+    MEM_UNCACHED,     // uncached memory
+  };
+
+  /* A sample with the optional fields, those not requested are zero.
+   */
+  struct ExtSample : Sample {
+    uint64_t ip;           // FIELD_IP, the instruction that accessed
+    uint64_t time;         // FIELD_TIME, in ns of the perf clock
+    uint64_t phys_address; // FIELD_PHYS_ADDR, 0 if not resolved
+    uint64_t data_src;     // FIELD_DATA_SRC, as union perf_mem_data_src
+    uint32_t weight;       // FIELD_WEIGHT, the latency in cycles
+    MemLevel level;        // FIELD_DATA_SRC, decoded
+  };
+
+  enum Wakeup {
+    WAKEUP_EVENTS,    // wake up pollers every <wakeup_value> samples
+    WAKEUP_WATERMARK, // wake up pollers every <wakeup_value> bytes
+    WAKEUP_ADAPTIVE,  // as WAKEUP_WATERMARK, the owner adjusts it by rate
+  };
+
+  struct Options {
+    size_t ring_pages = 4;             // pages of ring buffer, a power of 2
+    Wakeup wakeup = WAKEUP_EVENTS;     // policy to wake up pollers
+    uint32_t wakeup_value = 1;         // initial events or bytes to wake up
+    uint16_t load_latency = 30;        // threshold of CHANNEL_LOAD, in cycles
+    uint64_t fields = 0;               // Field to sample, or-ed
+  };
+
   Channel();
 
   ~Channel();
@@ -27,12 +90,34 @@ public:
   /* Initialize the Channel.
    *      pid:    the process to be sampled
    *      type:   type of instructions to be sampled
-   * RETURN: 0 if OK, or a negative error code
+   * RETURN: 0 if OK, -ENOTSUP if this cpu cannot sample <type>, or a
+   * negative error code
    * NOTE: after calling bind(), the Channel remains disabled until setPeriod()
    * is called.
    */
   int bind(pid_t pid, Type type);
 
+  /* Initialize the Channel with the given ring buffer and wakeup policy.
+   *      pid:     the process to be sampled
+   *      type:    type of instructions to be sampled
+   *      options: size of ring buffer and the wakeup policy
+   * RETURN: 0 if OK, or a negative error code
+   */
+  int bind(pid_t pid, Type type, const Options &options);
+
+  /* Initialize the Channel to sample every process on one cpu.
+   *      cpu:     the cpu to be sampled
+   *      type:    type of instructions to be sampled
+   *      options: size of ring buffer and the wakeup policy
+   *      filter:  only samples of these processes are read, it must outlive
+   *               the Channel
+   * RETURN: 0 if OK, or a negative error code
+   * NOTE: it needs CAP_PERFMON (or perf_event_paranoid <= 0). Exits of the
+   * processes in <filter> are reported through readExits().
+   */
+  int bindCpu(int cpu, Type type, const Options &options,
+              const PidFilter *filter);
+
   /* De-initialize the Channel.
    * NOTE: after calling unbind(), the Channel go back to uninitialized.
    */
@@ -48,17 +133,89 @@ public:
    */
   int setPeriod(unsigned long period);
 
+  /* Get the sample period.
+   * RETURN: the period, 0 if disabled.
+   */
+  unsigned long getPeriod();
+
+  /* Set the wakeup threshold, in events or bytes according to the policy.
+   *      wakeup: the new threshold
+   * RETURN: 0 if OK, or a negative error code
+   * NOTE: the kernel cannot change it on an opened event, so the event is
+   * reopened and the file descriptor changes. Drain the Channel first,
+   * records left in the old ring buffer are dropped. If the new event cannot
+   * be opened or enabled, the old one is kept as it was.
+   */
+  int setWakeup(uint32_t wakeup);
+
+  /* Get the current wakeup threshold.
+   * RETURN: the threshold, or a meaningless value if uninitialized.
+   */
+  uint32_t getWakeup();
+
+  /* Measure how fast the kernel fills the ring buffer of this Channel.
+   * RETURN: bytes consumed per second since the previous call (or since
+   * bind() for the first call).
+   */
+  double measureRate();
+
   /* Read a sample from this Channel.
    *      sample: the buffer to receive the sample
    * RETURN: 0 if OK, -EAGAIN if not available, or a negative error code
    */
   int readSample(Sample *sample);
 
+  /* Read a batch of samples from this Channel.
+   *      samples: the buffer to receive the samples
+   *      count:   the capacity of <samples>
+   * RETURN: the number of samples read (0 if none available), or a negative
+   * error code
+   * NOTE: all records between data_tail and data_head are decoded in one pass
+   * and data_tail is published only once. If <samples> fills up before the
+   * ring buffer is drained, the rest is left for the next call.
+   */
+  ssize_t readSamples(Sample *samples, size_t count);
+
+  /* Read a batch of samples with the fields in Options::fields.
+   * The same as the above otherwise.
+   */
+  ssize_t readSamples(ExtSample *samples, size_t count);
+
+  /* Visit samples in place, without copying them out.
+   *      count:   the max count of samples to visit
+   *      visitor: called as visitor(const S &sample) for each sample, S is
+   *               Sample or ExtSample
+   * RETURN: the number of samples visited, or a negative error code
+   * NOTE: the decode loop is instantiated for <visitor>, so it is inlined
+   * there. The ring buffer is released to the kernel only after the walk,
+   * keep <visitor> short.
+   */
+  template <typename S, typename Visitor>
+  ssize_t visitSamples(size_t count, Visitor &&visitor);
+
+  /* Decode a FIELD_DATA_SRC into where the data was found.
+   */
+  static MemLevel decodeLevel(uint64_t data_src);
+
+  /* Read the processes that exited, seen while reading samples.
+   *      pids:  the buffer to receive the pids
+   *      count: the capacity of <pids>
+   * RETURN: the number of pids read
+   * NOTE: only Channels bound by bindCpu() report exits, a Channel bound to
+   * a process gets EPOLLHUP instead.
+   */
+  size_t readExits(pid_t *pids, size_t count);
+
   /* Get the pid of target process.
    * RETURN: pid, or a meaningless value if uninitialized.
    */
   pid_t getPid();
 
+  /* Get the cpu to sample.
+   * RETURN: cpu, or -1 if bound to a process.
+   */
+  int getCpu();
+
   /* Get the type to sample.
    * RETURN: type, or a meaningless value if uninitialized.
    */
@@ -71,13 +228,185 @@ public:
    */
   int getPerfFd();
 
+  /* Get the accounting of the ring buffer of this Channel, i.e. how many
+   * samples the kernel dropped and how often the event was throttled.
+   * RETURN: the counters accumulated since the last bind().
+   */
+  const RingBuffer::Stats &getStats();
+
 private:
-  pid_t m_pid;            // pid of target process
+  int bindEvent(pid_t pid, int cpu, Type type, const Options &options,
+                const PidFilter *filter);
+
+  // open a disabled event with <wakeup> and map its ring buffer, without
+  // touching the event of this Channel
+  int openEvent(uint32_t wakeup, int *fd, int *aux_fd, uint64_t *id,
+                void **buffer);
+
+  void closeEvent(int fd, int aux_fd, void *buffer);
+
+  // sample id, pid, tid, address and cpu, sampled by every Channel
+  static constexpr uint64_t BASE_SAMPLE_TYPE =
+      PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_TID | PERF_SAMPLE_ADDR |
+      PERF_SAMPLE_CPU;
+
+  // the fields of Options::fields, a decoder is instantiated for each subset
+  static constexpr uint64_t OPTIONAL_FIELDS[] = {
+      FIELD_IP, FIELD_TIME, FIELD_WEIGHT, FIELD_DATA_SRC, FIELD_PHYS_ADDR,
+  };
+  static constexpr size_t OPTIONAL_FIELD_COUNT =
+      sizeof(OPTIONAL_FIELDS) / sizeof(uint64_t);
+
+  // the sample_type of the subset of OPTIONAL_FIELDS given by <index>
+  static constexpr uint64_t sampleType(size_t index) {
+    uint64_t sample_type = BASE_SAMPLE_TYPE;
+    for (size_t i = 0; i < OPTIONAL_FIELD_COUNT; i++)
+      if (index & (1UL << i))
+        sample_type |= OPTIONAL_FIELDS[i];
+    return sample_type;
+  }
+
+  template <typename Visitor>
+  using Decoder = ssize_t (Channel::*)(size_t, Visitor &);
+
+  template <typename S, typename Visitor>
+  static Decoder<Visitor> selectDecoder(size_t index);
+
+  template <uint64_t SampleType, typename S, typename Visitor>
+  ssize_t decodeSamples(size_t count, Visitor &visitor);
+
+  template <uint64_t SampleType>
+  static void decode(const void *record, Sample *sample, Type type);
+
+  template <uint64_t SampleType>
+  static void decode(const void *record, ExtSample *sample, Type type);
+
+
+private:
+  pid_t m_pid;            // pid of target process, or -1
+  int m_cpu;              // cpu to sample, or -1
+  const PidFilter *m_filter; // processes to read samples of if m_pid is -1
+  std::vector<pid_t> m_exits; // exited processes not read yet
   Type m_type;            // type
+  uint64_t m_config;      // raw encoding of <m_type> on this cpu
+  uint64_t m_config1;     // raw encoding of <m_type>, e.g. the load latency
+  uint32_t m_event_type;  // perf_event_attr::type of <m_type>
+  uint64_t m_aux_config;  // encoding of the group leader <m_type> needs, or 0
   int m_fd;               // file descriptor from perf_event_open()
+  int m_aux_fd;           // file descriptor of the group leader, or -1
   uint64_t m_id;          // sample id of each record
+  size_t m_decoder;       // the subset of OPTIONAL_FIELDS, see sampleType()
   void *m_buffer;         // ring buffer and its header
+  RingBuffer m_ring;      // reader of <m_buffer>
   unsigned long m_period; // sample_period
+  Options m_options;      // ring buffer size and wakeup policy
+  uint32_t m_wakeup;      // current wakeup threshold
+  uint64_t m_rate_time;   // time of the last measureRate()
+  uint64_t m_rate_bytes;  // bytes consumed at the last measureRate()
 };
 
-#endif
\ No newline at end of file
+template <typename S, typename Visitor>
+ssize_t Channel::visitSamples(size_t count, Visitor &&visitor) {
+  if (m_fd < 0)
+    ERROR({}, -EINVAL, false, "this Channel has not bound yet");
+  // one indirect call for the whole walk, none for each sample
+  Decoder<Visitor> decoder = selectDecoder<S, Visitor>(m_decoder);
+  return (this->*decoder)(count, visitor);
+}
+
+template <typename S, typename Visitor>
+Channel::Decoder<Visitor> Channel::selectDecoder(size_t index) {
+  static constexpr auto DECODERS = []<size_t... I>(std::index_sequence<I...>) {
+    return std::array<Decoder<Visitor>, sizeof...(I)>{
+        &Channel::decodeSamples<sampleType(I), S, Visitor>...};
+  }(std::make_index_sequence<1UL << OPTIONAL_FIELD_COUNT>());
+  return DECODERS[index];
+}
+
+template <uint64_t SampleType, typename S, typename Visitor>
+ssize_t Channel::decodeSamples(size_t count, Visitor &visitor) {
+  using Decoder = SampleDecoder<SampleType>;
+  size_t n = 0;
+  S sample;
+  if (m_pid >= 0) {
+    m_ring.drain([&](const struct perf_event_header *header) {
+      if (n == count)
+        return false;
+      if (header->type == PERF_RECORD_SAMPLE &&
+          Decoder::template get<PERF_SAMPLE_IDENTIFIER>(header) == m_id &&
+          // this line is to filter the wrong pid caused by kernel bug
+          Decoder::pid(header) == (uint32_t)m_pid) {
+        decode<SampleType>(header, &sample, m_type);
+        visitor((const S &)sample);
+        n++;
+      }
+      return true;
+    });
+    return n;
+  }
+  // a cpu-wide Channel, keep the samples of monitored processes only
+  PidFilter::Reader filter(*m_filter);
+  m_ring.drain([&](const struct perf_event_header *header) {
+    if (n == count)
+      return false;
+    if (header->type == PERF_RECORD_SAMPLE) {
+      if (Decoder::template get<PERF_SAMPLE_IDENTIFIER>(header) == m_id &&
+          filter.contains(Decoder::pid(header))) {
+        decode<SampleType>(header, &sample, m_type);
+        visitor((const S &)sample);
+        n++;
+      }
+    } else if (header->type == PERF_RECORD_EXIT) {
+      // see man page for perf_event_open()
+      struct perf_exit {
+        struct perf_event_header header;
+        uint32_t pid, ppid;
+        uint32_t tid, ptid;
+        uint64_t time;
+      };
+      auto *entry = (const struct perf_exit *)header;
+      // the exit of the main thread is the exit of the process
+      if (entry->pid == entry->tid && filter.contains(entry->pid))
+        m_exits.push_back(entry->pid);
+    }
+    return true;
+  });
+  return n;
+}
+
+template <uint64_t SampleType>
+inline void Channel::decode(const void *record, Sample *sample, Type type) {
+  using Decoder = SampleDecoder<SampleType>;
+  sample->type = type;
+  sample->cpu = Decoder::cpu(record);
+  sample->pid = Decoder::pid(record);
+  sample->tid = Decoder::tid(record);
+  sample->address = Decoder::template get<PERF_SAMPLE_ADDR>(record);
+}
+
+template <uint64_t SampleType>
+inline void Channel::decode(const void *record, ExtSample *sample,
+                            Type type) {
+  using Decoder = SampleDecoder<SampleType>;
+  decode<SampleType>(record, (Sample *)sample, type);
+  sample->ip = 0;
+  sample->time = 0;
+  sample->phys_address = 0;
+  sample->data_src = 0;
+  sample->weight = 0;
+  sample->level = MEM_UNKNOWN;
+  if constexpr (Decoder::has(PERF_SAMPLE_IP))
+    sample->ip = Decoder::template get<PERF_SAMPLE_IP>(record);
+  if constexpr (Decoder::has(PERF_SAMPLE_TIME))
+    sample->time = Decoder::template get<PERF_SAMPLE_TIME>(record);
+  if constexpr (Decoder::has(PERF_SAMPLE_PHYS_ADDR))
+    sample->phys_address = Decoder::template get<PERF_SAMPLE_PHYS_ADDR>(record);
+  if constexpr (Decoder::has(PERF_SAMPLE_WEIGHT))
+    sample->weight = Decoder::template get<PERF_SAMPLE_WEIGHT>(record);
+  if constexpr (Decoder::has(PERF_SAMPLE_DATA_SRC)) {
+    sample->data_src = Decoder::template get<PERF_SAMPLE_DATA_SRC>(record);
+    sample->level = decodeLevel(sample->data_src);
+  }
+}
+
+#endif
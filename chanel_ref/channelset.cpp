@@ -1,15 +1,42 @@
 #include "channelset.h"
 
+#include "topology.h"
+
 #include <list>
 #include <sys/epoll.h>
+#include <time.h>
 
-#define EPOLL_BATCH_SIZE 64
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
 
-ChannelSet::ChannelSet() { m_epollfd = -1; }
+// how often the watermark of adaptive Channels is re-evaluated
+#define ADAPTIVE_INTERVAL_MS 1000
+// the wakeups per second an adaptive Channel aims at
+#define ADAPTIVE_WAKEUP_RATE 100
+// the smallest watermark of an adaptive Channel, in bytes
+#define ADAPTIVE_MIN_WATERMARK 256
+// how often the period controller runs
+#define CONTROL_INTERVAL_MS 1000
+
+ChannelSet::ChannelSet() {
+  m_epollfd = -1;
+  m_cpu_channels = NULL;
+  m_cpu_count = 0;
+  m_controlled = false;
+}
 
 ChannelSet::~ChannelSet() { deinit(); }
 
 int ChannelSet::init(std::set<Channel::Type> &types) {
+  return init(types, Channel::Options());
+}
+
+int ChannelSet::init(std::set<Channel::Type> &types,
+                     const Channel::Options &options, Mode mode,
+                     const std::set<int> *cpus) {
   if (m_epollfd >= 0)
     ERROR({}, -EINVAL, false, "this ChannelSet has been initialized already");
   if (types.size() == 0)
@@ -21,28 +48,46 @@ int ChannelSet::init(std::set<Channel::Type> &types) {
   }
   m_types.insert(m_types.begin(), types.begin(), types.end());
   m_period = 0;
+  m_options = options;
+  m_adapt_time = now_ms();
+  m_mode = mode;
   m_epollfd = fd;
+  if (mode == MODE_PER_CPU) {
+    int ret = createCpuChannels(cpus);
+    if (ret < 0)
+      ERROR(deinit(), ret, false, "createCpuChannels(%p) failed", cpus);
+  }
   return 0;
 }
 
 void ChannelSet::deinit() {
   if (m_epollfd < 0)
     return;
-  m_types.clear();
   for (auto it = m_entries.begin(); it != m_entries.end(); ++it)
-    destroyChannels(it->channels);
+    destroyEntry(*it);
   m_entries.clear();
+  if (m_cpu_channels != NULL)
+    destroyChannels(m_cpu_channels, m_cpu_count * m_types.size());
+  m_cpu_channels = NULL;
+  m_cpu_count = 0;
+  m_types.clear();
+  m_controlled = false;
   close(m_epollfd);
   m_epollfd = -1;
 }
 
 int ChannelSet::createChannels(Channel **pchannels, pid_t pid) {
+  // cpu-wide Channels only need to keep samples of <pid>
+  if (m_mode == MODE_PER_CPU) {
+    (*pchannels) = NULL;
+    return m_filter.insert(pid);
+  }
   size_t count = m_types.size();
   auto *channels = new Channel[count];
   for (size_t i = 0; i < count; i++) {
     Channel *channel = channels + i;
     Channel::Type type = m_types[i];
-    int ret = channel->bind(pid, type);
+    int ret = channel->bind(pid, type, m_options);
     if (ret < 0)
       ERROR(destroyChannels(channels, i), ret, false,
             "channels[%lu].bind(%d, %d) failed", i, pid, type);
@@ -50,23 +95,70 @@ int ChannelSet::createChannels(Channel **pchannels, pid_t pid) {
     if (ret < 0)
       ERROR(destroyChannels(channels, i), ret, false,
             "channels[%lu].setPeriod(%lu) failed", i, m_period);
-    // add channel to epoll
-    struct epoll_event event;
-    // if any sample available, EPOLLIN is sent, if process exits, EPOLLHUP is
-    // sent.
-    event.events = EPOLLIN | EPOLLHUP;
-    // we can get Channal after epoll_wait()
-    event.data.ptr = channel;
-    int fd = channel->getPerfFd();
-    ret = epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &event);
-    if (ret)
-      ERROR(destroyChannels(channels, i), ret, true,
-            "epoll_ctl(%d, EPOLL_CTL_ADD, %d, &evt) failed: ", m_epollfd, fd);
+    ret = addToEpoll(channel);
+    if (ret < 0)
+      ERROR(destroyChannels(channels, i), ret, false,
+            "addToEpoll(channels[%lu]) failed", i);
   }
   (*pchannels) = channels;
   return 0;
 }
 
+int ChannelSet::createCpuChannels(const std::set<int> *cpu_set) {
+  std::vector<int> cpus;
+  int ret = 0;
+  if (cpu_set != NULL)
+    cpus.assign(cpu_set->begin(), cpu_set->end());
+  else
+    ret = Topology::readCpuList("/sys/devices/system/cpu/online", cpus);
+  if (ret < 0)
+    ERROR({}, ret, false, "Topology::readCpuList(...) failed");
+  if (cpus.empty())
+    ERROR({}, -EINVAL, false, "no cpu to sample");
+  size_t count = m_types.size();
+  auto *channels = new Channel[cpus.size() * count];
+  for (size_t i = 0; i < cpus.size() * count; i++) {
+    Channel *channel = channels + i;
+    int cpu = cpus[i / count];
+    Channel::Type type = m_types[i % count];
+    ret = channel->bindCpu(cpu, type, m_options, &m_filter);
+    if (ret < 0)
+      ERROR(destroyChannels(channels, i), ret, false,
+            "channels[%lu].bindCpu(%d, %d, ...) failed", i, cpu, type);
+    ret = addToEpoll(channel);
+    if (ret < 0)
+      ERROR(destroyChannels(channels, i), ret, false,
+            "addToEpoll(channels[%lu]) failed", i);
+  }
+  m_cpu_channels = channels;
+  m_cpu_count = cpus.size();
+  return 0;
+}
+
+int ChannelSet::addToEpoll(Channel *channel) {
+  struct epoll_event event;
+  // if any sample available, EPOLLIN is sent, if process exits, EPOLLHUP is
+  // sent.
+  event.events = EPOLLIN | EPOLLHUP;
+  // we can get Channal after epoll_wait()
+  event.data.ptr = channel;
+  int fd = channel->getPerfFd();
+  int ret = epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &event);
+  if (ret) {
+    ret = -errno;
+    ERROR({}, ret, true, "epoll_ctl(%d, EPOLL_CTL_ADD, %d, &evt) failed: ",
+          m_epollfd, fd);
+  }
+  return 0;
+}
+
+void ChannelSet::destroyEntry(const Entry &entry) {
+  if (entry.channels != NULL)
+    destroyChannels(entry.channels);
+  else
+    m_filter.erase(entry.pid);
+}
+
 void ChannelSet::destroyChannels(Channel *channels, ssize_t epoll_count) {
   // channels that added to epoll should be deleted
   size_t count = epoll_count >= 0 ? epoll_count : m_types.size();
@@ -74,6 +166,7 @@ void ChannelSet::destroyChannels(Channel *channels, ssize_t epoll_count) {
     Channel *channel = channels + i;
     int ret = epoll_ctl(m_epollfd, EPOLL_CTL_DEL, channel->getPerfFd(), NULL);
     assert(ret == 0);
+    m_controller.forget(channel);
   }
   delete[] channels;
 }
@@ -103,7 +196,7 @@ int ChannelSet::remove(pid_t pid) {
   // not existed
   if (it == m_entries.end())
     return 0;
-  destroyChannels(it->channels);
+  destroyEntry(*it);
   m_entries.erase(it);
   return 0;
 }
@@ -137,7 +230,7 @@ int ChannelSet::update(std::set<pid_t> &pids) {
     fake.pid = (*it);
     auto found = m_entries.find(fake);
     assert(found != m_entries.end());
-    destroyChannels(found->channels);
+    destroyEntry(*found);
     m_entries.erase(found);
   }
   // add new pids in <pids>
@@ -159,69 +252,217 @@ int ChannelSet::setPeriod(unsigned long period) {
   size_t count = m_types.size();
   for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
     Channel *channels = it->channels;
-    for (size_t i = 0; i < count; i++) {
+    for (size_t i = 0; channels != NULL && i < count; i++) {
       int ret = channels[i].setPeriod(period);
       if (ret < 0)
         ERROR({}, ret, false, "channels[%lu].setPeriod(%lu) failed", i, period);
     }
   }
+  for (size_t i = 0; i < m_cpu_count * count; i++) {
+    int ret = m_cpu_channels[i].setPeriod(period);
+    if (ret < 0)
+      ERROR({}, ret, false, "cpu_channels[%lu].setPeriod(%lu) failed", i,
+            period);
+  }
   m_period = period;
   return 0;
 }
 
+int ChannelSet::setController(const PeriodController::Config *config) {
+  if (m_epollfd < 0)
+    ERROR({}, -EINVAL, false, "this ChannelSet has not been initialized yet");
+  if (config == NULL) {
+    m_controlled = false;
+    return 0;
+  }
+  int ret = m_controller.init(*config);
+  if (ret < 0)
+    ERROR({}, ret, false, "m_controller.init(config) failed");
+  m_controlled = true;
+  m_control_time = now_ms();
+  return 0;
+}
+
+int ChannelSet::getPeriod(pid_t pid, Channel::Type type,
+                          unsigned long *period) {
+  if (m_epollfd < 0)
+    ERROR({}, -EINVAL, false, "this ChannelSet has not been initialized yet");
+  Entry entry;
+  entry.pid = pid;
+  auto it = m_entries.find(entry);
+  if (it == m_entries.end())
+    return -ENOENT;
+  size_t count = m_types.size();
+  for (size_t i = 0; i < count; i++) {
+    if (m_types[i] != type)
+      continue;
+    if (it->channels != NULL) {
+      (*period) = it->channels[i].getPeriod();
+      return 0;
+    }
+    unsigned long sum = 0;
+    for (size_t cpu = 0; cpu < m_cpu_count; cpu++)
+      sum += m_cpu_channels[cpu * count + i].getPeriod();
+    (*period) = sum / m_cpu_count;
+    return 0;
+  }
+  return -ENOENT;
+}
+
+int ChannelSet::controlPeriods() {
+  size_t count = m_types.size();
+  size_t channels = m_cpu_count * count;
+  for (auto it = m_entries.begin(); it != m_entries.end(); ++it)
+    if (it->channels != NULL)
+      channels += count;
+  for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+    for (size_t i = 0; it->channels != NULL && i < count; i++) {
+      int ret = m_controller.control(it->channels + i, channels);
+      if (ret < 0)
+        ERROR({}, ret, false, "m_controller.control(channels[%lu], %lu) failed",
+              i, channels);
+    }
+  }
+  for (size_t i = 0; i < m_cpu_count * count; i++) {
+    int ret = m_controller.control(m_cpu_channels + i, channels);
+    if (ret < 0)
+      ERROR({}, ret, false,
+            "m_controller.control(cpu_channels[%lu], %lu) failed", i, channels);
+  }
+  m_control_time = now_ms();
+  return 0;
+}
+
+int ChannelSet::getStats(pid_t pid, RingBuffer::Stats *stats) {
+  if (m_epollfd < 0)
+    ERROR({}, -EINVAL, false, "this ChannelSet has not been initialized yet");
+  Entry entry;
+  entry.pid = pid;
+  auto it = m_entries.find(entry);
+  if (it == m_entries.end())
+    return -ENOENT;
+  Channel *channels = it->channels;
+  size_t count = m_types.size();
+  if (channels == NULL) {
+    channels = m_cpu_channels;
+    count *= m_cpu_count;
+  }
+  memset(stats, 0, sizeof(*stats));
+  for (size_t i = 0; i < count; i++) {
+    const RingBuffer::Stats &s = channels[i].getStats();
+    stats->records += s.records;
+    stats->bytes += s.bytes;
+    stats->lost += s.lost;
+    stats->lost_records += s.lost_records;
+    stats->throttles += s.throttles;
+    stats->unthrottles += s.unthrottles;
+    stats->throttled_ns += s.throttled_ns;
+    stats->skipped += s.skipped;
+  }
+  return 0;
+}
+
 ssize_t ChannelSet::pollSamples(int timeout, void *privdata,
                                 void (*on_sample)(void *privdata,
                                                   Channel::Sample *sample),
                                 void (*on_exit)(void *privdata, pid_t pid)) {
+  return pollBatches(
+      timeout,
+      [&](Channel::Sample *samples, size_t count) {
+        if (on_sample)
+          for (size_t i = 0; i < count; i++)
+            on_sample(privdata, samples + i);
+      },
+      [&](pid_t pid) {
+        if (on_exit)
+          on_exit(privdata, pid);
+      });
+}
+
+ssize_t ChannelSet::pollSamples(int timeout, void *privdata,
+                                void (*on_sample)(void *privdata,
+                                                  Channel::ExtSample *sample),
+                                void (*on_exit)(void *privdata, pid_t pid)) {
+  return pollBatches(
+      timeout,
+      [&](Channel::ExtSample *samples, size_t count) {
+        if (on_sample)
+          for (size_t i = 0; i < count; i++)
+            on_sample(privdata, samples + i);
+      },
+      [&](pid_t pid) {
+        if (on_exit)
+          on_exit(privdata, pid);
+      });
+}
+
+int ChannelSet::waitChannels(int timeout, struct epoll_event *events) {
   if (m_epollfd < 0)
     ERROR({}, -EINVAL, false, "this ChannelSet has not been initialized yet");
-  // poll available channels
-  struct epoll_event events[EPOLL_BATCH_SIZE];
   int ret = epoll_wait(m_epollfd, events, EPOLL_BATCH_SIZE, timeout);
   if (ret < 0) {
     ret = -errno;
     ERROR({}, ret, true, "epoll_wait(%d, events, %d, %d) failed: ", m_epollfd,
           EPOLL_BATCH_SIZE, timeout);
   }
-  // count of active channel
-  int channel_count = ret;
-  // count of available samples
-  ssize_t sample_count = 0;
-  // exited processes
-  std::set<pid_t> exit_pids;
-  // for each active channel
-  for (int i = 0; i < channel_count; i++) {
-    auto reason = events[i].events;
-    auto *channel = (Channel *)events[i].data.ptr;
-    // process exits
-    if (reason & EPOLLHUP) {
-      exit_pids.insert(channel->getPid());
-      break;
-    }
-    // process has new samples
-    assert(reason == EPOLLIN);
-    // read all available samples
-    while (true) {
-      Channel::Sample sample;
-      ret = channel->readSample(&sample);
-      if (ret == -EAGAIN)
-        break;
-      if (ret < 0)
-        ERROR({}, ret, false, "channel->readSample(&sample) failed");
-      if (on_sample)
-        on_sample(privdata, &sample);
-      sample_count++;
-    }
-  }
-  for (auto it = exit_pids.begin(); it != exit_pids.end(); ++it) {
-    Entry entry;
-    entry.pid = (*it);
-    auto found = m_entries.find(entry);
-    assert(found != m_entries.end());
-    destroyChannels(found->channels);
-    m_entries.erase(found);
-    if (on_exit)
-      on_exit(privdata, entry.pid);
-  }
-  return sample_count;
-}
\ No newline at end of file
+  return ret;
+}
+
+void ChannelSet::collectExits(Channel *channel, std::set<pid_t> &exit_pids) {
+  pid_t pids[EPOLL_BATCH_SIZE];
+  size_t n;
+  while ((n = channel->readExits(pids, EPOLL_BATCH_SIZE)) > 0)
+    exit_pids.insert(pids, pids + n);
+}
+
+bool ChannelSet::removeExited(pid_t pid) {
+  Entry entry;
+  entry.pid = pid;
+  auto found = m_entries.find(entry);
+  // a cpu-wide Channel may report a process removed meanwhile
+  if (found == m_entries.end())
+    return false;
+  destroyEntry(*found);
+  m_entries.erase(found);
+  return true;
+}
+
+// RETURN: whether the watermarks are due for adaptWakeups(), if so a new
+// interval starts now
+bool ChannelSet::adaptDue() {
+  if (m_options.wakeup != Channel::WAKEUP_ADAPTIVE)
+    return false;
+  uint64_t now = now_ms();
+  if (now - m_adapt_time < ADAPTIVE_INTERVAL_MS)
+    return false;
+  m_adapt_time = now;
+  return true;
+}
+
+bool ChannelSet::controlDue() {
+  return m_controlled && now_ms() - m_control_time >= CONTROL_INTERVAL_MS;
+}
+
+int ChannelSet::adaptWakeup(Channel *channel) {
+  // a watermark above half of the ring buffer risks losing samples
+  uint32_t max_watermark = m_options.ring_pages * 4096 / 2;
+  double rate = channel->measureRate();
+  uint32_t watermark = ADAPTIVE_MIN_WATERMARK;
+  while (watermark < max_watermark && watermark * ADAPTIVE_WAKEUP_RATE < rate)
+    watermark *= 2;
+  uint32_t current = channel->getWakeup();
+  if (watermark < current * 2 && watermark * 2 > current)
+    return 0;
+  // the perf fd changes, so re-register it
+  int ret = epoll_ctl(m_epollfd, EPOLL_CTL_DEL, channel->getPerfFd(), NULL);
+  assert(ret == 0);
+  // if it cannot be reopened, the old event is kept and registered again
+  int wakeup_ret = channel->setWakeup(watermark);
+  ret = addToEpoll(channel);
+  if (ret < 0)
+    ERROR({}, ret, false, "addToEpoll(channel) failed");
+  // a process that is exiting is cleaned up by the EPOLLHUP of its old event
+  if (wakeup_ret < 0 && wakeup_ret != -ESRCH)
+    ERROR({}, wakeup_ret, false, "setWakeup(%u) failed", watermark);
+  return 0;
+}
@@ -3,14 +3,26 @@
 
 #include "common.h"
 #include "channel.h"
+#include "periodcontroller.h"
 
 #include <set>
+#include <sys/epoll.h>
+#include <type_traits>
 #include <vector>
 
+#define EPOLL_BATCH_SIZE 64
+#define SAMPLE_BATCH_SIZE 256
+
 class ChannelSet
 {
 public:
 
+    enum Mode
+    {
+        MODE_PER_PROCESS,   // Channels for each process, cost scales with processes
+        MODE_PER_CPU,       // Channels for each cpu filtered by pid, cost scales with cpus
+    };
+
     ChannelSet();
 
     ~ChannelSet();
@@ -20,6 +32,25 @@ public:
      * RETURN: 0 if ok, or a negative error code
      */
     int init(std::set<Channel::Type>& types);
+
+    /* Initialize the ChannelSet with the given ring buffer and wakeup policy.
+     *      types: set of Channel::Type to sample
+     *      options: size of ring buffer and wakeup policy of every Channel
+     *      mode: whether to open Channels for each process or for each cpu
+     *      cpus: with MODE_PER_CPU, the cpus to sample, or NULL for every online cpu
+     * RETURN: 0 if ok, or a negative error code
+     * NOTE: With Channel::WAKEUP_ADAPTIVE, pollSamples() re-measures the rate of every
+     *      Channel each ADAPTIVE_INTERVAL_MS and picks a byte watermark that wakes it up
+     *      about ADAPTIVE_WAKEUP_RATE times per second, reopening Channels whose
+     *      watermark is off by more than 2x. Channels are also flushed on every such
+     *      interval, so a large watermark never delays samples for longer than that,
+     *      as long as pollSamples() is called with a finite timeout.
+     *      With MODE_PER_CPU, one Channel per online cpu and type samples every process
+     *      and add()/remove()/update() only edit the set of pids whose samples are kept.
+     *      Exits are then detected through PERF_RECORD_EXIT instead of EPOLLHUP.
+     */
+    int init(std::set<Channel::Type>& types, const Channel::Options& options,
+        Mode mode = MODE_PER_PROCESS, const std::set<int>* cpus = NULL);
     
     /* Uninitialize the ChannelSet.
      */
@@ -53,6 +84,35 @@ public:
      */
     int setPeriod(unsigned long period);
 
+    /* Let a closed-loop controller adjust the period of each Channel.
+     *      config: the targets and limits of the controller, or NULL to stop it
+     * RETURN: 0 if ok, or a negative error code
+     * NOTE: pollSamples() runs the controller every CONTROL_INTERVAL_MS, starting from
+     *      the period given to setPeriod(). A later setPeriod() resets every Channel, and
+     *      the controller goes on from there.
+     */
+    int setController(const PeriodController::Config* config);
+
+    /* Get the effective period of a process.
+     *      pid: the pid of the process
+     *      type: the Channel::Type of the Channel
+     *      period: the buffer to receive the period
+     * RETURN: 0 if ok, or a negative error code (-ENOENT if <pid> or <type> is unknown)
+     * NOTE: With MODE_PER_CPU, Channels are shared by all processes, the period is the
+     *      mean over cpus.
+     */
+    int getPeriod(pid_t pid, Channel::Type type, unsigned long* period);
+
+    /* Get the ring buffer accounting of a process, summed over its Channels.
+     *      pid: the pid of the process
+     *      stats: the buffer to receive the counters
+     * RETURN: 0 if ok, or a negative error code (-ENOENT if <pid> is not in this ChannelSet)
+     * NOTE: use stats.lost and stats.throttled_ns to correct the sample counts of <pid>.
+     *      With MODE_PER_CPU, Channels are shared by all processes, so the counters
+     *      are those of the whole system.
+     */
+    int getStats(pid_t pid, RingBuffer::Stats* stats);
+
     /* Poll samples from Channels.
      *      timeout: the number of milliseconds to block.
      *          -1 causes to block indefinitely until any sample is available,
@@ -67,12 +127,43 @@ public:
         void (*on_sample)(void* privdata, Channel::Sample* sample),
         void (*on_exit)(void* privdata, pid_t pid));
 
+    /* Poll samples with the fields in Channel::Options::fields.
+     * The same as the above otherwise.
+     */
+    ssize_t pollSamples(int timeout, void* privdata,
+        void (*on_sample)(void* privdata, Channel::ExtSample* sample),
+        void (*on_exit)(void* privdata, pid_t pid));
+
+    /* Poll samples from Channels into visitors, which are inlined into the decode loop.
+     *      timeout: the same as the above
+     *      on_sample: called as on_sample(const Channel::Sample& sample) for each sample,
+     *          or with a const Channel::ExtSample& if it does not accept a Channel::Sample
+     *      on_exit: called as on_exit(pid_t pid) for each exited process
+     * RETURN: the count of samples handled, or a negative error code
+     * NOTE: no copy and no indirect call is made for each sample. <on_sample> runs while
+     *      the ring buffer is held, keep it short.
+     */
+    template <typename Visitor, typename ExitVisitor>
+    ssize_t pollSamples(int timeout, Visitor&& on_sample, ExitVisitor&& on_exit);
+
+    /* Poll samples from Channels into visitors, a batch at a time.
+     *      timeout: the same as the above
+     *      on_batch: called as on_batch(Channel::Sample* samples, size_t count) with at most
+     *          SAMPLE_BATCH_SIZE samples, or with a Channel::ExtSample* if it does not
+     *          accept a Channel::Sample*
+     *      on_exit: called as on_exit(pid_t pid) for each exited process
+     * RETURN: the count of samples handled, or a negative error code
+     * NOTE: the ring buffer is released before each call to <on_batch>.
+     */
+    template <typename BatchVisitor, typename ExitVisitor>
+    ssize_t pollBatches(int timeout, BatchVisitor&& on_batch, ExitVisitor&& on_exit);
+
 private:
 
     struct Entry
     {
         pid_t pid;              // pid of this process
-        Channel* channels;      // Channels for this process
+        Channel* channels;      // Channels for this process, NULL with MODE_PER_CPU
 
         bool operator <(const Entry& entry) const
         {
@@ -84,11 +175,161 @@ private:
 
     void destroyChannels(Channel* channels, ssize_t epoll_count = -1);
 
+    void destroyEntry(const Entry& entry);
+
+    int createCpuChannels(const std::set<int>* cpus);
+
+    int addToEpoll(Channel* channel);
+
+    template <typename Drain, typename ExitVisitor>
+    ssize_t poll(int timeout, Drain& drain, ExitVisitor& on_exit);
+
+    template <typename Drain>
+    ssize_t adaptWakeups(Drain& drain);
+
+    int waitChannels(int timeout, struct epoll_event* events);
+
+    void collectExits(Channel* channel, std::set<pid_t>& exit_pids);
+
+    bool removeExited(pid_t pid);
+
+    bool adaptDue();
+
+    bool controlDue();
+
+    int adaptWakeup(Channel* channel);
+
+    int controlPeriods();
+
 private:
     std::vector<Channel::Type> m_types; // types to sample (of Channels for each process)
     std::set<Entry> m_entries;          // set of processes and its Channels
     unsigned long m_period;             // the sample_period of all Channels
+    Channel::Options m_options;         // ring buffer and wakeup policy of all Channels
+    uint64_t m_adapt_time;              // time of the last adaptWakeups(), in ms
+    PeriodController m_controller;      // controller of the period of each Channel
+    bool m_controlled;                  // whether <m_controller> is enabled
+    uint64_t m_control_time;            // time of the last controlPeriods(), in ms
+    Mode m_mode;                        // Channels for each process or for each cpu
+    Channel* m_cpu_channels;            // Channels for each cpu (MODE_PER_CPU)
+    size_t m_cpu_count;                 // count of cpus in <m_cpu_channels>
+    PidFilter m_filter;                 // processes sampled by <m_cpu_channels>
     int m_epollfd;                      // the file descriptor from epoll_create()
 };
 
+template <typename Visitor, typename ExitVisitor>
+ssize_t ChannelSet::pollSamples(int timeout, Visitor&& on_sample, ExitVisitor&& on_exit)
+{
+    using Sample = std::conditional_t<
+        std::is_invocable_v<Visitor&, const Channel::Sample&>,
+        Channel::Sample, Channel::ExtSample>;
+    auto drain = [&](Channel* channel) {
+        return channel->visitSamples<Sample>(SIZE_MAX, on_sample);
+    };
+    return poll(timeout, drain, on_exit);
+}
+
+template <typename BatchVisitor, typename ExitVisitor>
+ssize_t ChannelSet::pollBatches(int timeout, BatchVisitor&& on_batch, ExitVisitor&& on_exit)
+{
+    using Sample = std::conditional_t<
+        std::is_invocable_v<BatchVisitor&, Channel::Sample*, size_t>,
+        Channel::Sample, Channel::ExtSample>;
+    auto drain = [&](Channel* channel) -> ssize_t {
+        ssize_t sample_count = 0;
+        // read all available samples, a batch at a time
+        while (true) {
+            Sample samples[SAMPLE_BATCH_SIZE];
+            ssize_t count = channel->readSamples(samples, SAMPLE_BATCH_SIZE);
+            if (count < 0)
+                ERROR({}, count, false, "channel->readSamples(samples, %d) failed",
+                    SAMPLE_BATCH_SIZE);
+            if (count == 0)
+                break;
+            on_batch(samples, (size_t)count);
+            sample_count += count;
+        }
+        return sample_count;
+    };
+    return poll(timeout, drain, on_exit);
+}
+
+template <typename Drain, typename ExitVisitor>
+ssize_t ChannelSet::poll(int timeout, Drain& drain, ExitVisitor& on_exit)
+{
+    // poll available channels
+    struct epoll_event events[EPOLL_BATCH_SIZE];
+    int ret = waitChannels(timeout, events);
+    if (ret < 0)
+        ERROR({}, ret, false, "waitChannels(%d, events) failed", timeout);
+    // count of active channel
+    int channel_count = ret;
+    // count of available samples
+    ssize_t sample_count = 0;
+    // exited processes
+    std::set<pid_t> exit_pids;
+    // for each active channel
+    for (int i = 0; i < channel_count; i++) {
+        auto reason = events[i].events;
+        auto* channel = (Channel*)events[i].data.ptr;
+        // process exits
+        if (reason & EPOLLHUP) {
+            exit_pids.insert(channel->getPid());
+            break;
+        }
+        // process has new samples
+        assert(reason == EPOLLIN);
+        ssize_t count = drain(channel);
+        if (count < 0)
+            ERROR({}, count, false, "drain(channel) failed");
+        sample_count += count;
+        // cpu-wide Channels report exits of monitored processes while reading
+        if (channel->getCpu() >= 0)
+            collectExits(channel, exit_pids);
+    }
+    if (adaptDue()) {
+        ssize_t count = adaptWakeups(drain);
+        if (count < 0)
+            ERROR({}, count, false, "adaptWakeups(drain) failed");
+        sample_count += count;
+    }
+    if (controlDue()) {
+        ret = controlPeriods();
+        if (ret < 0)
+            ERROR({}, ret, false, "controlPeriods() failed");
+    }
+    for (auto it = exit_pids.begin(); it != exit_pids.end(); ++it)
+        if (removeExited(*it))
+            on_exit(*it);
+    return sample_count;
+}
+
+template <typename Drain>
+ssize_t ChannelSet::adaptWakeups(Drain& drain)
+{
+    size_t count = m_types.size();
+    ssize_t sample_count = 0;
+    auto adapt = [&](Channel* channel) -> ssize_t {
+        // flush samples below the watermark, they must not wait any longer
+        ssize_t ret = drain(channel);
+        if (ret < 0)
+            ERROR({}, ret, false, "drain(channel) failed");
+        sample_count += ret;
+        return adaptWakeup(channel);
+    };
+    for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+        for (size_t i = 0; it->channels != NULL && i < count; i++) {
+            ssize_t ret = adapt(it->channels + i);
+            if (ret < 0)
+                ERROR({}, ret, false, "adapt(channels[%lu]) failed", i);
+        }
+    }
+    for (size_t i = 0; i < m_cpu_count * count; i++) {
+        ssize_t ret = adapt(m_cpu_channels + i);
+        if (ret < 0)
+            ERROR({}, ret, false, "adapt(cpu_channels[%lu]) failed", i);
+    }
+    return sample_count;
+}
+
 #endif
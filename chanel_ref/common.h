@@ -18,6 +18,15 @@
     return (ret);                                                              \
   })
 
+// same report as ERROR(), for an error the caller gets past
+#define WARN(show_errstr, msgs...)                                             \
+  ({                                                                           \
+    const char *_errstr = (show_errstr) ? strerror(errno) : "";                \
+    fprintf(stderr, "[<%s> @ %s: %d]: ", __FUNCTION__, __FILE__, __LINE__);    \
+    fprintf(stderr, ##msgs);                                                   \
+    fprintf(stderr, "%s\n", _errstr);                                          \
+  })
+
 #ifndef likely
 #define likely(x) __builtin_expect(!!(x), 1)
 #endif
@@ -0,0 +1,235 @@
+#include "eventcatalog.h"
+
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#define SYSFS_PMU_PATH "/sys/bus/event_source/devices"
+
+struct Model {
+  uint32_t model;             // family 6 model number
+  EventCatalog::Arch arch;    // microarchitecture of the cores
+  bool server;                // whether it is a server part
+};
+
+// family 6 models of the supported Intel cores
+static const Model MODELS[] = {
+    {0x4E, EventCatalog::ARCH_SKYLAKE, false},        // Skylake-U/Y
+    {0x5E, EventCatalog::ARCH_SKYLAKE, false},        // Skylake-H/S
+    {0x55, EventCatalog::ARCH_SKYLAKE, true},         // Skylake-SP, Cascade Lake
+    {0x8E, EventCatalog::ARCH_SKYLAKE, false},        // Kaby Lake-U/Y
+    {0x9E, EventCatalog::ARCH_SKYLAKE, false},        // Kaby/Coffee Lake
+    {0xA5, EventCatalog::ARCH_SKYLAKE, false},        // Comet Lake
+    {0xA6, EventCatalog::ARCH_SKYLAKE, false},        // Comet Lake-U
+    {0x7D, EventCatalog::ARCH_ICELAKE, false},        // Ice Lake-Y
+    {0x7E, EventCatalog::ARCH_ICELAKE, false},        // Ice Lake-U
+    {0x6A, EventCatalog::ARCH_ICELAKE, true},         // Ice Lake-SP
+    {0x6C, EventCatalog::ARCH_ICELAKE, true},         // Ice Lake-D
+    {0x8C, EventCatalog::ARCH_ICELAKE, false},        // Tiger Lake-U
+    {0x8D, EventCatalog::ARCH_ICELAKE, false},        // Tiger Lake-H
+    {0xA7, EventCatalog::ARCH_ICELAKE, false},        // Rocket Lake
+    {0x8F, EventCatalog::ARCH_SAPPHIRERAPIDS, true},  // Sapphire Rapids
+    {0xCF, EventCatalog::ARCH_SAPPHIRERAPIDS, true},  // Emerald Rapids
+    {0xAD, EventCatalog::ARCH_SAPPHIRERAPIDS, true},  // Granite Rapids-X
+    {0xAE, EventCatalog::ARCH_SAPPHIRERAPIDS, true},  // Granite Rapids-D
+};
+
+// MEM_TRANS_RETIRED.LOAD_LATENCY, the threshold goes to config1
+#define EVENT_LOAD_LATENCY 0x01CD
+// MEM_INST_RETIRED.ALL_STORES, up to Ice Lake
+#define EVENT_ALL_STORES 0x82D0
+// MEM_TRANS_RETIRED.STORE_SAMPLE, from Sapphire Rapids on
+#define EVENT_STORE_SAMPLE 0x02CD
+// MEM_LOAD_L3_MISS_RETIRED.LOCAL_DRAM
+#define EVENT_LOCAL_DRAM 0x01D3
+// MEM_LOAD_L3_MISS_RETIRED.REMOTE_DRAM
+#define EVENT_REMOTE_DRAM 0x02D3
+// MEM_INST_RETIRED.STLB_MISS_LOADS
+#define EVENT_STLB_MISS_LOADS 0x11D0
+// mem-loads-aux, the leader that load latency events need since Golden Cove
+#define EVENT_LOADS_AUX 0x8203
+
+EventCatalog::EventCatalog() {
+  m_arch = ARCH_UNKNOWN;
+  m_model = 0;
+  m_server = false;
+}
+
+int EventCatalog::init() {
+  m_arch = ARCH_UNKNOWN;
+  m_model = 0;
+  m_server = false;
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx))
+    return 0;
+  // "GenuineIntel"
+  if (ebx != 0x756E6547 || edx != 0x49656E69 || ecx != 0x6C65746E)
+    return 0;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return 0;
+  uint32_t family = (eax >> 8) & 0xF;
+  if (family != 6)
+    return 0;
+  m_model = ((eax >> 4) & 0xF) | (((eax >> 16) & 0xF) << 4);
+  for (size_t i = 0; i < sizeof(MODELS) / sizeof(MODELS[0]); i++) {
+    if (MODELS[i].model == m_model) {
+      m_arch = MODELS[i].arch;
+      m_server = MODELS[i].server;
+      break;
+    }
+  }
+#endif
+  return 0;
+}
+
+int EventCatalog::lookup(Channel::Type type, uint16_t load_latency,
+                         Encoding *encoding) const {
+  if (m_arch == ARCH_UNKNOWN)
+    return lookupSysfs(type, load_latency, encoding);
+  encoding->type = PERF_TYPE_RAW;
+  encoding->config1 = 0;
+  encoding->aux_config = 0;
+  switch (type) {
+  case Channel::CHANNEL_LOAD:
+    encoding->config = EVENT_LOAD_LATENCY;
+    encoding->config1 = load_latency;
+    if (m_arch == ARCH_SAPPHIRERAPIDS)
+      encoding->aux_config = EVENT_LOADS_AUX;
+    return 0;
+  case Channel::CHANNEL_STORE:
+    encoding->config = m_arch == ARCH_SAPPHIRERAPIDS ? EVENT_STORE_SAMPLE
+                                                     : EVENT_ALL_STORES;
+    return 0;
+  case Channel::CHANNEL_LOAD_LOCAL_DRAM:
+    encoding->config = EVENT_LOCAL_DRAM;
+    return 0;
+  case Channel::CHANNEL_LOAD_REMOTE_DRAM:
+    if (!m_server)
+      return -ENOTSUP;
+    encoding->config = EVENT_REMOTE_DRAM;
+    return 0;
+  case Channel::CHANNEL_LOAD_STLB_MISS:
+    encoding->config = EVENT_STLB_MISS_LOADS;
+    return 0;
+  }
+  ERROR({}, -EINVAL, false, "unknown type %d", (int)type);
+}
+
+int EventCatalog::lookupSysfs(Channel::Type type, uint16_t load_latency,
+                              Encoding *encoding) const {
+  const char *alias;
+  if (type == Channel::CHANNEL_LOAD)
+    alias = "mem-loads";
+  else if (type == Channel::CHANNEL_STORE)
+    alias = "mem-stores";
+  else
+    return -ENOTSUP;
+  // hybrid cpus name the PMU of the big cores cpu_core
+  static const char *PMUS[] = {"cpu", "cpu_core"};
+  for (const char *pmu : PMUS) {
+    int ret = parseAlias(pmu, alias, load_latency, encoding);
+    if (ret == -ENOENT)
+      continue;
+    if (ret < 0)
+      ERROR({}, ret, false, "parseAlias(%s, %s, %u, encoding) failed", pmu,
+            alias, load_latency);
+    encoding->aux_config = 0;
+    if (type == Channel::CHANNEL_LOAD) {
+      Encoding aux;
+      ret = parseAlias(pmu, "mem-loads-aux", load_latency, &aux);
+      if (ret == 0)
+        encoding->aux_config = aux.config;
+      else if (ret != -ENOENT)
+        ERROR({}, ret, false, "parseAlias(%s, mem-loads-aux, %u, &aux) failed",
+              pmu, load_latency);
+    }
+    return 0;
+  }
+  return -ENOTSUP;
+}
+
+// read the first line of a sysfs file, without the newline
+static int readLine(const char *path, char *line, size_t size) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+    return -errno;
+  char *ret = fgets(line, size, file);
+  fclose(file);
+  if (ret == NULL)
+    return -EIO;
+  line[strcspn(line, "\n")] = '\0';
+  return 0;
+}
+
+int EventCatalog::parseAlias(const char *pmu, const char *alias,
+                             uint16_t load_latency, Encoding *encoding) {
+  char path[256];
+  char line[256];
+  snprintf(path, sizeof(path), SYSFS_PMU_PATH "/%s/events/%s", pmu, alias);
+  int ret = readLine(path, line, sizeof(line));
+  if (ret < 0)
+    return ret;
+  snprintf(path, sizeof(path), SYSFS_PMU_PATH "/%s/type", pmu);
+  char type[32];
+  ret = readLine(path, type, sizeof(type));
+  if (ret < 0)
+    ERROR({}, ret, false, "failed to read %s", path);
+  encoding->type = strtoul(type, NULL, 10);
+  encoding->config = 0;
+  encoding->config1 = 0;
+  // the alias is like "event=0xcd,umask=0x1,ldlat=3"
+  char *save = NULL;
+  for (char *term = strtok_r(line, ",", &save); term != NULL;
+       term = strtok_r(NULL, ",", &save)) {
+    char *equal = strchr(term, '=');
+    uint64_t value = 1;
+    if (equal != NULL) {
+      *equal = '\0';
+      value = strtoull(equal + 1, NULL, 0);
+    }
+    if (strcmp(term, "ldlat") == 0)
+      value = load_latency;
+    // the format of a term is like "config:0-7" or "config1:0-15"
+    char format[64];
+    snprintf(path, sizeof(path), SYSFS_PMU_PATH "/%s/format/%s", pmu, term);
+    ret = readLine(path, format, sizeof(format));
+    if (ret < 0)
+      ERROR({}, ret, false, "failed to read %s", path);
+    char *colon = strchr(format, ':');
+    if (colon == NULL)
+      ERROR({}, -EINVAL, false, "invalid format \"%s\" of %s", format, term);
+    *colon = '\0';
+    unsigned low, high;
+    int count = sscanf(colon + 1, "%u-%u", &low, &high);
+    if (count == 1)
+      high = low;
+    else if (count != 2 || low > high || high > 63)
+      ERROR({}, -EINVAL, false, "invalid format \"%s\" of %s", colon + 1, term);
+    uint64_t mask = high - low == 63 ? ~0UL : ((1UL << (high - low + 1)) - 1);
+    if (strcmp(format, "config") == 0)
+      encoding->config |= (value & mask) << low;
+    else if (strcmp(format, "config1") == 0)
+      encoding->config1 |= (value & mask) << low;
+    else
+      ERROR({}, -ENOTSUP, false, "unsupported format \"%s\" of %s", format,
+            term);
+  }
+  return 0;
+}
+
+EventCatalog::Arch EventCatalog::getArch() const { return m_arch; }
+
+uint32_t EventCatalog::getModel() const { return m_model; }
+
+bool EventCatalog::isServer() const { return m_server; }
+
+const EventCatalog &EventCatalog::instance() {
+  static const EventCatalog catalog = [] {
+    EventCatalog catalog;
+    catalog.init();
+    return catalog;
+  }();
+  return catalog;
+}
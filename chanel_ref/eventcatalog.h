@@ -0,0 +1,76 @@
+#ifndef EVENTCATALOG_H
+#define EVENTCATALOG_H
+
+#include "common.h"
+#include "channel.h"
+
+/* Raw encodings of the logical Channel::Type on this machine.
+ * The cpu is identified by CPUID and looked up in a table of known Intel
+ * cores. On a cpu that is not in the table, the catalog falls back to the
+ * event aliases the kernel exports in sysfs (mem-loads, mem-stores), which
+ * cover CHANNEL_LOAD and CHANNEL_STORE only.
+ */
+class EventCatalog {
+public:
+  enum Arch {
+    ARCH_UNKNOWN,          // not in the table, sysfs aliases only
+    ARCH_SKYLAKE,          // Skylake, Cascade Lake, Kaby/Coffee/Comet Lake
+    ARCH_ICELAKE,          // Ice Lake, Tiger Lake, Rocket Lake
+    ARCH_SAPPHIRERAPIDS,   // Sapphire Rapids, Emerald Rapids, Granite Rapids
+  };
+
+  struct Encoding {
+    uint32_t type;       // perf_event_attr::type
+    uint64_t config;     // perf_event_attr::config
+    uint64_t config1;    // perf_event_attr::config1, e.g. the load latency
+    uint64_t aux_config; // config of the group leader it needs, 0 for none
+  };
+
+  EventCatalog();
+
+  /* Identify the cpu of this machine.
+   * RETURN: 0 if OK, or a negative error code
+   * NOTE: an unknown cpu is not an error, see lookup().
+   */
+  int init();
+
+  /* Get the encoding of a logical event.
+   *      type:         the logical event
+   *      load_latency: the threshold in cycles of CHANNEL_LOAD
+   *      encoding:     the buffer to receive the encoding
+   * RETURN: 0 if OK, -ENOTSUP if this cpu cannot sample <type>, or a negative
+   * error code
+   */
+  int lookup(Channel::Type type, uint16_t load_latency,
+             Encoding *encoding) const;
+
+  /* Get the microarchitecture found by init().
+   */
+  Arch getArch() const;
+
+  /* Get the family 6 model number found by init(), 0 if not an Intel cpu.
+   */
+  uint32_t getModel() const;
+
+  /* Check whether the cpu is a server part, i.e. it may see remote DRAM.
+   */
+  bool isServer() const;
+
+  /* Get the catalog of this machine, initialized on the first call.
+   */
+  static const EventCatalog &instance();
+
+private:
+  int lookupSysfs(Channel::Type type, uint16_t load_latency,
+                  Encoding *encoding) const;
+
+  static int parseAlias(const char *pmu, const char *alias,
+                        uint16_t load_latency, Encoding *encoding);
+
+private:
+  Arch m_arch;      // microarchitecture of the cores
+  uint32_t m_model; // family 6 model number, or 0
+  bool m_server;    // whether it is a server part
+};
+
+#endif
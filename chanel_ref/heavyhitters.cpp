@@ -0,0 +1,191 @@
+#include "heavyhitters.h"
+
+#include <algorithm>
+#include <math.h>
+
+HeavyHitters::HeavyHitters() {
+  m_width = 0;
+  m_depth = 0;
+  m_shift = 0;
+  m_seeds = NULL;
+  m_counters = NULL;
+  m_total = 0;
+  m_k = 0;
+}
+
+HeavyHitters::~HeavyHitters() {
+  free(m_seeds);
+  free(m_counters);
+}
+
+int HeavyHitters::init(const Config &config) {
+  if (m_counters != NULL)
+    ERROR({}, -EINVAL, false, "this HeavyHitters has been initialized already");
+  if (config.epsilon <= 0 || config.epsilon >= 1 || config.delta <= 0 ||
+      config.delta >= 1 || config.k == 0 || config.k > UINT32_MAX)
+    ERROR({}, -EINVAL, false, "invalid epsilon %f, delta %f or k %lu",
+          config.epsilon, config.delta, config.k);
+  size_t depth = ceil(log(1 / config.delta));
+  if (depth > HEAVY_HITTERS_MAX_DEPTH)
+    ERROR({}, -EINVAL, false, "delta %f needs more than %d rows", config.delta,
+          HEAVY_HITTERS_MAX_DEPTH);
+  size_t width = 1;
+  int bits = 0;
+  while (width < M_E / config.epsilon) {
+    width *= 2;
+    bits++;
+  }
+  m_seeds = (uint64_t *)malloc(depth * sizeof(uint64_t));
+  m_counters = (uint32_t *)calloc(depth * width, sizeof(uint32_t));
+  if (m_seeds == NULL || m_counters == NULL)
+    ERROR({ free(m_seeds); free(m_counters); m_seeds = NULL; m_counters = NULL; },
+          -ENOMEM, false, "failed to allocate %lu x %lu counters", depth, width);
+  // the index stays below half full, so tombstones of evicted pages make it
+  // rehash in place instead of growing
+  int ret = m_index.init(config.k * 2);
+  if (ret < 0)
+    ERROR({ free(m_seeds); free(m_counters); m_seeds = NULL; m_counters = NULL; },
+          ret, false, "m_index.init(%lu) failed", config.k * 2);
+  // splitmix64, any odd multipliers do
+  uint64_t state = 0x9E3779B97F4A7C15UL;
+  for (size_t row = 0; row < depth; row++) {
+    state += 0x9E3779B97F4A7C15UL;
+    uint64_t seed = state;
+    seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9UL;
+    seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBUL;
+    m_seeds[row] = (seed ^ (seed >> 31)) | 1;
+  }
+  m_width = width;
+  m_depth = depth;
+  m_shift = 64 - bits;
+  m_k = config.k;
+  m_entries.reserve(m_k);
+  m_heap.reserve(m_k);
+  m_position.reserve(m_k);
+  return 0;
+}
+
+int HeavyHitters::record(uint64_t pfn, uint32_t weight) {
+  m_total += weight;
+  uint32_t *counters[HEAVY_HITTERS_MAX_DEPTH];
+  uint32_t estimate = UINT32_MAX;
+  for (size_t row = 0; row < m_depth; row++) {
+    counters[row] = m_counters + row * m_width + slotOf(row, pfn);
+    estimate = std::min(estimate, *counters[row]);
+  }
+  // conservative update, counters above the new estimate are already right
+  estimate = std::min<uint64_t>((uint64_t)estimate + weight, UINT32_MAX);
+  for (size_t row = 0; row < m_depth; row++)
+    *counters[row] = std::max(*counters[row], estimate);
+
+  uint32_t *index = m_index.find(pfn);
+  if (index != NULL) {
+    Entry &entry = m_entries[*index];
+    entry.count = std::min<uint64_t>((uint64_t)entry.count + weight, UINT32_MAX);
+    siftDown(m_position[*index]);
+    return 0;
+  }
+  if (m_entries.size() < m_k) {
+    uint32_t *slot = m_index.insert(pfn);
+    if (slot == NULL)
+      ERROR({}, -ENOMEM, false, "failed to insert page %lx", pfn);
+    *slot = m_entries.size();
+    m_entries.push_back({pfn, estimate});
+    m_position.push_back(m_heap.size());
+    m_heap.push_back(*slot);
+    siftUp(m_heap.size() - 1);
+    return 1;
+  }
+  // replace the coldest page of the summary
+  uint32_t coldest = m_heap[0];
+  if (estimate <= m_entries[coldest].count)
+    return 0;
+  m_index.erase(m_entries[coldest].pfn);
+  uint32_t *slot = m_index.insert(pfn);
+  if (slot == NULL)
+    ERROR({}, -ENOMEM, false, "failed to insert page %lx", pfn);
+  *slot = coldest;
+  m_entries[coldest] = {pfn, estimate};
+  siftDown(0);
+  return 1;
+}
+
+uint32_t HeavyHitters::estimate(uint64_t pfn) const {
+  const uint32_t *index = m_index.find(pfn);
+  if (index != NULL)
+    return m_entries[*index].count;
+  uint32_t estimate = UINT32_MAX;
+  for (size_t row = 0; row < m_depth; row++)
+    estimate = std::min(estimate, m_counters[row * m_width + slotOf(row, pfn)]);
+  return m_depth > 0 ? estimate : 0;
+}
+
+void HeavyHitters::top(std::vector<Entry> *entries, size_t count) const {
+  *entries = m_entries;
+  count = std::min(count, entries->size());
+  std::partial_sort(entries->begin(), entries->begin() + count, entries->end(),
+                    [](const Entry &a, const Entry &b) { return a.count > b.count; });
+  entries->resize(count);
+}
+
+void HeavyHitters::hotPages(std::vector<uint64_t> *pages) const {
+  pages->resize(m_entries.size());
+  for (size_t i = 0; i < m_entries.size(); i++)
+    (*pages)[i] = m_entries[i].pfn;
+}
+
+void HeavyHitters::decay() {
+  for (size_t i = 0; i < m_depth * m_width; i++)
+    m_counters[i] >>= 1;
+  // halving keeps the order, so the heap stays a heap
+  for (Entry &entry : m_entries)
+    entry.count >>= 1;
+  m_total >>= 1;
+}
+
+uint64_t HeavyHitters::total() const { return m_total; }
+
+size_t HeavyHitters::memory() const {
+  return m_depth * (m_width * sizeof(uint32_t) + sizeof(uint64_t)) +
+         m_entries.capacity() * sizeof(Entry) +
+         m_heap.capacity() * sizeof(uint32_t) +
+         m_position.capacity() * sizeof(uint32_t) + m_index.memory();
+}
+
+size_t HeavyHitters::slotOf(size_t row, uint64_t pfn) const {
+  // multiply-shift hashing, m_shift is 64 for a single counter
+  uint64_t hash = pfn * m_seeds[row];
+  return m_shift < 64 ? hash >> m_shift : 0;
+}
+
+void HeavyHitters::siftDown(size_t position) {
+  size_t size = m_heap.size();
+  while (true) {
+    size_t child = position * 2 + 1;
+    if (child >= size)
+      return;
+    if (child + 1 < size && m_entries[m_heap[child + 1]].count <
+                                m_entries[m_heap[child]].count)
+      child++;
+    if (m_entries[m_heap[position]].count <= m_entries[m_heap[child]].count)
+      return;
+    swapHeap(position, child);
+    position = child;
+  }
+}
+
+void HeavyHitters::siftUp(size_t position) {
+  while (position > 0) {
+    size_t parent = (position - 1) / 2;
+    if (m_entries[m_heap[parent]].count <= m_entries[m_heap[position]].count)
+      return;
+    swapHeap(position, parent);
+    position = parent;
+  }
+}
+
+void HeavyHitters::swapHeap(size_t a, size_t b) {
+  std::swap(m_heap[a], m_heap[b]);
+  m_position[m_heap[a]] = a;
+  m_position[m_heap[b]] = b;
+}
@@ -0,0 +1,112 @@
+#ifndef HEAVYHITTERS_H
+#define HEAVYHITTERS_H
+
+#include "common.h"
+#include "pagetable.h"
+
+#include <vector>
+
+// rows of the sketch at most, i.e. delta >= e^-16
+#define HEAVY_HITTERS_MAX_DEPTH 16
+
+/* The hottest pages in fixed memory, whatever the footprint of the target.
+ * A count-min sketch of <depth> rows of <width> counters estimates the count
+ * of any page, and a space-saving summary keeps the <k> pages of the highest
+ * counts. A page enters the summary when its estimate beats the coldest page
+ * of it, which it replaces, and it is counted exactly from then on.
+ * Error bounds, with N the sum of weights recorded (halved by decay()):
+ *  - estimates never undercount, and overcount by at most epsilon * N with
+ *    probability 1 - delta (width = e / epsilon, depth = ln(1 / delta));
+ *  - counts of the summary are such estimates plus exact counts since, so the
+ *    same bounds hold for them;
+ *  - a page of more than epsilon * N + N / k samples is in the summary with
+ *    probability 1 - delta.
+ * Counters are updated conservatively (only those at the minimum grow), which
+ * keeps the overcount well below the bound in practice.
+ */
+class HeavyHitters {
+public:
+  struct Config {
+    double epsilon = 1e-4; // overcount bound, relative to the total weight
+    double delta = 0.01;   // probability that the bound does not hold
+    size_t k = 65536;      // count of pages of the summary
+  };
+
+  struct Entry {
+    uint64_t pfn;   // page frame number
+    uint32_t count; // its count, see above for the error
+  };
+
+  HeavyHitters();
+
+  ~HeavyHitters();
+
+  /* Initialize the sketch and the summary, their memory is fixed here.
+   *      config: error bounds and size of the summary
+   * RETURN: 0 if OK, or a negative error code
+   */
+  int init(const Config &config);
+
+  /* Account samples of a page.
+   *      pfn:    page frame number (address >> 12)
+   *      weight: count of samples
+   * RETURN: 1 if the page entered the summary, 0 if not, or a negative error
+   * code
+   */
+  int record(uint64_t pfn, uint32_t weight = 1);
+
+  /* Get the count of a page, from the summary if it is there, or else the
+   * estimate of the sketch.
+   */
+  uint32_t estimate(uint64_t pfn) const;
+
+  /* Get the hottest pages of the summary.
+   *      entries: the vector to receive them, hottest first
+   *      count:   count of pages wanted, at most k
+   */
+  void top(std::vector<Entry> *entries, size_t count) const;
+
+  /* Get the page frame numbers of the summary, the same as
+   * HotnessTracker::hotPages().
+   */
+  void hotPages(std::vector<uint64_t> *pages) const;
+
+  /* Halve every counter, so that old samples weigh less than new ones.
+   */
+  void decay();
+
+  /* Get the sum of weights recorded, halved by decay().
+   */
+  uint64_t total() const;
+
+  /* Get the bytes allocated.
+   */
+  size_t memory() const;
+
+  HeavyHitters(const HeavyHitters &) = delete;
+  HeavyHitters &operator=(const HeavyHitters &) = delete;
+
+private:
+  size_t slotOf(size_t row, uint64_t pfn) const;
+
+  void siftDown(size_t position);
+
+  void siftUp(size_t position);
+
+  void swapHeap(size_t a, size_t b);
+
+private:
+  size_t m_width;            // counters of a row, a power of 2
+  size_t m_depth;            // count of rows
+  int m_shift;               // 64 - log2(m_width)
+  uint64_t *m_seeds;         // odd multiplier of the hash of each row
+  uint32_t *m_counters;      // <m_depth> rows of <m_width> counters
+  uint64_t m_total;          // sum of weights
+  size_t m_k;                // capacity of the summary
+  std::vector<Entry> m_entries;     // the summary
+  std::vector<uint32_t> m_heap;     // indices of <m_entries>, a min-heap
+  std::vector<uint32_t> m_position; // position in <m_heap> of each entry
+  PageTable<uint32_t> m_index;      // index in <m_entries> of each page
+};
+
+#endif
@@ -0,0 +1,430 @@
+#include "hotnesskernels.h"
+
+#include <algorithm>
+#include <math.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define AVX2_TARGET __attribute__((target("avx2,fma,bmi2")))
+#define AVX512_TARGET __attribute__((target("avx512f,avx2,fma,bmi2")))
+#endif
+
+// 2^f for f in [-0.5, 0.5], Taylor series of degree 6, error below 1e-7
+#define EXP2_C1 0.69314718f
+#define EXP2_C2 0.24022651f
+#define EXP2_C3 0.05550411f
+#define EXP2_C4 0.00961813f
+#define EXP2_C5 0.00133336f
+#define EXP2_C6 0.00015404f
+
+// 2^x for x <= 0, flushed to 2^-126 below
+static inline float exp2Scalar(float x) {
+  x = x < -126 ? -126 : x;
+  float i = __builtin_rintf(x);
+  float f = x - i;
+  float p = EXP2_C6;
+  p = p * f + EXP2_C5;
+  p = p * f + EXP2_C4;
+  p = p * f + EXP2_C3;
+  p = p * f + EXP2_C2;
+  p = p * f + EXP2_C1;
+  p = p * f + 1;
+  uint32_t bits = (uint32_t)((int32_t)i + 127) << 23;
+  float scale;
+  memcpy(&scale, &bits, sizeof(scale));
+  return p * scale;
+}
+
+static void scoreScalar(const float *frequency, const uint32_t *last,
+                        size_t count, const HotnessKernels::Decay &decay,
+                        float *scores) {
+  for (size_t i = 0; i < count; i++) {
+    float age = last[i] < decay.now ? decay.now - last[i] : 0;
+    scores[i] = frequency[i] * exp2Scalar(-age * decay.rate) +
+                decay.recency_weight * exp2Scalar(-age * decay.recency_rate);
+  }
+}
+
+static size_t classifyScalar(const float *scores, uint8_t *hot, size_t count,
+                             float hot_threshold, float cold_threshold) {
+  size_t hot_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    float threshold = hot[i] ? cold_threshold : hot_threshold;
+    hot[i] = scores[i] >= threshold;
+    hot_count += hot[i];
+  }
+  return hot_count;
+}
+
+static void histogramScalar(const float *scores, size_t count,
+                            uint64_t *buckets) {
+  for (size_t i = 0; i < count; i++)
+    buckets[HotnessKernels::bucketOf(scores[i])]++;
+}
+
+static size_t extractScalar(const uint8_t *hot, const uint64_t *pfns,
+                            size_t count, uint64_t *out) {
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++) {
+    // branchless, hot pages are rare and unpredictable
+    out[n] = pfns[i];
+    n += hot[i];
+  }
+  return n;
+}
+
+static size_t collectScalar(const float *scores, size_t count, float low,
+                            float high, float *out) {
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++) {
+    out[n] = scores[i];
+    n += scores[i] >= low && scores[i] < high;
+  }
+  return n;
+}
+
+static void sumScalar(const float *scores, const uint8_t *hot, size_t count,
+                      double *total, double *selected) {
+  float all = 0, hot_sum = 0;
+  for (size_t i = 0; i < count; i++) {
+    all += scores[i];
+    hot_sum += hot[i] ? scores[i] : 0;
+  }
+  *total += all;
+  *selected += hot_sum;
+}
+
+// count the buckets of vector-computed indices, 4 tables so that increments
+// of the same bucket in a row do not wait for each other
+static void countBuckets(const uint8_t *indices, size_t count,
+                         uint64_t *buckets) {
+  uint32_t tables[4][HOTNESS_BUCKETS] = {};
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    tables[0][indices[i]]++;
+    tables[1][indices[i + 1]]++;
+    tables[2][indices[i + 2]]++;
+    tables[3][indices[i + 3]]++;
+  }
+  for (; i < count; i++)
+    tables[0][indices[i]]++;
+  for (int b = 0; b < HOTNESS_BUCKETS; b++)
+    buckets[b] += tables[0][b] + tables[1][b] + tables[2][b] + tables[3][b];
+}
+
+// the vector kernels count buckets of this many scores at once, so that the
+// counts of countBuckets() do not overflow
+#define HISTOGRAM_BLOCK 4096
+
+#if defined(__x86_64__)
+
+AVX2_TARGET static inline __m256 exp2Avx2(__m256 x) {
+  x = _mm256_max_ps(x, _mm256_set1_ps(-126));
+  __m256 i = _mm256_round_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256 f = _mm256_sub_ps(x, i);
+  __m256 p = _mm256_set1_ps(EXP2_C6);
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(EXP2_C5));
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(EXP2_C4));
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(EXP2_C3));
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(EXP2_C2));
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(EXP2_C1));
+  p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1));
+  __m256i bits = _mm256_slli_epi32(
+      _mm256_add_epi32(_mm256_cvtps_epi32(i), _mm256_set1_epi32(127)), 23);
+  return _mm256_mul_ps(p, _mm256_castsi256_ps(bits));
+}
+
+AVX2_TARGET static void scoreAvx2(const float *frequency, const uint32_t *last,
+                                  size_t count,
+                                  const HotnessKernels::Decay &decay,
+                                  float *scores) {
+  __m256i now = _mm256_set1_epi32(decay.now);
+  __m256 rate = _mm256_set1_ps(-decay.rate);
+  __m256 recency_rate = _mm256_set1_ps(-decay.recency_rate);
+  __m256 recency_weight = _mm256_set1_ps(decay.recency_weight);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i times = _mm256_loadu_si256((const __m256i *)(last + i));
+    // ages fit in 31 bits, so the signed conversion is exact
+    __m256 age = _mm256_cvtepi32_ps(
+        _mm256_sub_epi32(now, _mm256_min_epu32(times, now)));
+    __m256 score = _mm256_mul_ps(_mm256_loadu_ps(frequency + i),
+                                 exp2Avx2(_mm256_mul_ps(age, rate)));
+    score = _mm256_fmadd_ps(recency_weight,
+                            exp2Avx2(_mm256_mul_ps(age, recency_rate)), score);
+    _mm256_storeu_ps(scores + i, score);
+  }
+  scoreScalar(frequency + i, last + i, count - i, decay, scores + i);
+}
+
+AVX2_TARGET static size_t classifyAvx2(const float *scores, uint8_t *hot,
+                                       size_t count, float hot_threshold,
+                                       float cold_threshold) {
+  __m256 hot_thresholds = _mm256_set1_ps(hot_threshold);
+  __m256 cold_thresholds = _mm256_set1_ps(cold_threshold);
+  size_t hot_count = 0;
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i flags = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(hot + i)));
+    __m256 was_hot = _mm256_castsi256_ps(
+        _mm256_cmpgt_epi32(flags, _mm256_setzero_si256()));
+    __m256 threshold = _mm256_blendv_ps(hot_thresholds, cold_thresholds, was_hot);
+    uint32_t mask = _mm256_movemask_ps(
+        _mm256_cmp_ps(_mm256_loadu_ps(scores + i), threshold, _CMP_GE_OQ));
+    // one byte of 0 or 1 for each bit of <mask>
+    uint64_t bytes = _pdep_u64(mask, 0x0101010101010101UL);
+    memcpy(hot + i, &bytes, sizeof(bytes));
+    hot_count += __builtin_popcount(mask);
+  }
+  return hot_count + classifyScalar(scores + i, hot + i, count - i,
+                                    hot_threshold, cold_threshold);
+}
+
+AVX2_TARGET static void histogramAvx2(const float *scores, size_t count,
+                                      uint64_t *buckets) {
+  uint8_t indices[HISTOGRAM_BLOCK];
+  __m256i bias = _mm256_set1_epi32(HOTNESS_BUCKET_BIAS - 127);
+  __m256i top = _mm256_set1_epi32(HOTNESS_BUCKETS - 1);
+  for (size_t start = 0; start < count; start += HISTOGRAM_BLOCK) {
+    size_t block = std::min(count - start, (size_t)HISTOGRAM_BLOCK);
+    size_t i = 0;
+    for (; i + 8 <= block; i += 8) {
+      __m256i bits = _mm256_loadu_si256((const __m256i *)(scores + start + i));
+      __m256i bucket = _mm256_add_epi32(_mm256_srli_epi32(bits, 23), bias);
+      bucket = _mm256_min_epi32(_mm256_max_epi32(bucket, _mm256_setzero_si256()), top);
+      // 32-bit lanes to bytes, the bytes of each 128-bit half are in order
+      __m256i packed = _mm256_packs_epi32(bucket, bucket);
+      packed = _mm256_packus_epi16(packed, packed);
+      uint32_t low = _mm256_extract_epi32(packed, 0);
+      uint32_t high = _mm256_extract_epi32(packed, 4);
+      memcpy(indices + i, &low, sizeof(low));
+      memcpy(indices + i + 4, &high, sizeof(high));
+    }
+    for (; i < block; i++)
+      indices[i] = HotnessKernels::bucketOf(scores[start + i]);
+    countBuckets(indices, block, buckets);
+  }
+}
+
+AVX2_TARGET static size_t collectAvx2(const float *scores, size_t count,
+                                      float low, float high, float *out) {
+  __m256 lows = _mm256_set1_ps(low);
+  __m256 highs = _mm256_set1_ps(high);
+  size_t n = 0;
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 score = _mm256_loadu_ps(scores + i);
+    uint32_t mask = _mm256_movemask_ps(
+        _mm256_and_ps(_mm256_cmp_ps(score, lows, _CMP_GE_OQ),
+                      _mm256_cmp_ps(score, highs, _CMP_LT_OQ)));
+    for (; mask != 0; mask &= mask - 1)
+      out[n++] = scores[i + __builtin_ctz(mask)];
+  }
+  return n + collectScalar(scores + i, count - i, low, high, out + n);
+}
+
+AVX2_TARGET static void sumAvx2(const float *scores, const uint8_t *hot,
+                                size_t count, double *total, double *selected) {
+  __m256 all = _mm256_setzero_ps();
+  __m256 hot_sum = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 score = _mm256_loadu_ps(scores + i);
+    __m256i flags = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(hot + i)));
+    __m256 is_hot = _mm256_castsi256_ps(
+        _mm256_cmpgt_epi32(flags, _mm256_setzero_si256()));
+    all = _mm256_add_ps(all, score);
+    hot_sum = _mm256_add_ps(hot_sum, _mm256_and_ps(score, is_hot));
+  }
+  float lanes[8], hot_lanes[8];
+  _mm256_storeu_ps(lanes, all);
+  _mm256_storeu_ps(hot_lanes, hot_sum);
+  for (int lane = 0; lane < 8; lane++) {
+    *total += lanes[lane];
+    *selected += hot_lanes[lane];
+  }
+  sumScalar(scores + i, hot + i, count - i, total, selected);
+}
+
+AVX2_TARGET static size_t extractAvx2(const uint8_t *hot, const uint64_t *pfns,
+                                      size_t count, uint64_t *out) {
+  size_t n = 0;
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    __m256i flags = _mm256_loadu_si256((const __m256i *)(hot + i));
+    uint32_t mask = _mm256_movemask_epi8(
+        _mm256_cmpgt_epi8(flags, _mm256_setzero_si256()));
+    // hot pages are rare, skip 32 cold ones at once
+    for (; mask != 0; mask &= mask - 1)
+      out[n++] = pfns[i + __builtin_ctz(mask)];
+  }
+  return n + extractScalar(hot + i, pfns + i, count - i, out + n);
+}
+
+// GCC 12 takes the undefined source of unmasked AVX-512 intrinsics for an
+// uninitialized variable
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+
+AVX512_TARGET static inline __m512 exp2Avx512(__m512 x) {
+  x = _mm512_max_ps(x, _mm512_set1_ps(-126));
+  __m512 i = _mm512_roundscale_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m512 f = _mm512_sub_ps(x, i);
+  __m512 p = _mm512_set1_ps(EXP2_C6);
+  p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(EXP2_C5));
+  p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(EXP2_C4));
+  p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(EXP2_C3));
+  p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(EXP2_C2));
+  p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(EXP2_C1));
+  p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(1));
+  // p * 2^i, exact since i is an integer
+  return _mm512_scalef_ps(p, i);
+}
+
+AVX512_TARGET static void scoreAvx512(const float *frequency,
+                                      const uint32_t *last, size_t count,
+                                      const HotnessKernels::Decay &decay,
+                                      float *scores) {
+  __m512i now = _mm512_set1_epi32(decay.now);
+  __m512 rate = _mm512_set1_ps(-decay.rate);
+  __m512 recency_rate = _mm512_set1_ps(-decay.recency_rate);
+  __m512 recency_weight = _mm512_set1_ps(decay.recency_weight);
+  size_t i = 0;
+  for (; i < count; i += 16) {
+    // the tail is done with masked loads and stores
+    __mmask16 valid = count - i >= 16 ? 0xFFFF : (1U << (count - i)) - 1;
+    __m512i times = _mm512_maskz_loadu_epi32(valid, last + i);
+    __m512 age = _mm512_cvtepi32_ps(
+        _mm512_sub_epi32(now, _mm512_min_epu32(times, now)));
+    __m512 score = _mm512_mul_ps(_mm512_maskz_loadu_ps(valid, frequency + i),
+                                 exp2Avx512(_mm512_mul_ps(age, rate)));
+    score = _mm512_fmadd_ps(recency_weight,
+                            exp2Avx512(_mm512_mul_ps(age, recency_rate)), score);
+    _mm512_mask_storeu_ps(scores + i, valid, score);
+  }
+}
+
+AVX512_TARGET static size_t classifyAvx512(const float *scores, uint8_t *hot,
+                                           size_t count, float hot_threshold,
+                                           float cold_threshold) {
+  __m512 hot_thresholds = _mm512_set1_ps(hot_threshold);
+  __m512 cold_thresholds = _mm512_set1_ps(cold_threshold);
+  size_t hot_count = 0;
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512i flags = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(hot + i)));
+    __mmask16 was_hot = _mm512_test_epi32_mask(flags, flags);
+    __m512 threshold = _mm512_mask_blend_ps(was_hot, hot_thresholds, cold_thresholds);
+    __mmask16 is_hot =
+        _mm512_cmp_ps_mask(_mm512_loadu_ps(scores + i), threshold, _CMP_GE_OQ);
+    _mm_storeu_si128((__m128i *)(hot + i),
+                     _mm512_cvtepi32_epi8(_mm512_maskz_set1_epi32(is_hot, 1)));
+    hot_count += __builtin_popcount(is_hot);
+  }
+  return hot_count + classifyScalar(scores + i, hot + i, count - i,
+                                    hot_threshold, cold_threshold);
+}
+
+AVX512_TARGET static void histogramAvx512(const float *scores, size_t count,
+                                          uint64_t *buckets) {
+  uint8_t indices[HISTOGRAM_BLOCK];
+  __m512i bias = _mm512_set1_epi32(HOTNESS_BUCKET_BIAS - 127);
+  __m512i top = _mm512_set1_epi32(HOTNESS_BUCKETS - 1);
+  for (size_t start = 0; start < count; start += HISTOGRAM_BLOCK) {
+    size_t block = std::min(count - start, (size_t)HISTOGRAM_BLOCK);
+    size_t i = 0;
+    for (; i + 16 <= block; i += 16) {
+      __m512i bits = _mm512_loadu_si512(scores + start + i);
+      __m512i bucket = _mm512_add_epi32(_mm512_srli_epi32(bits, 23), bias);
+      bucket = _mm512_min_epi32(_mm512_max_epi32(bucket, _mm512_setzero_si512()), top);
+      _mm_storeu_si128((__m128i *)(indices + i), _mm512_cvtepi32_epi8(bucket));
+    }
+    for (; i < block; i++)
+      indices[i] = HotnessKernels::bucketOf(scores[start + i]);
+    countBuckets(indices, block, buckets);
+  }
+}
+
+AVX512_TARGET static size_t collectAvx512(const float *scores, size_t count,
+                                          float low, float high, float *out) {
+  __m512 lows = _mm512_set1_ps(low);
+  __m512 highs = _mm512_set1_ps(high);
+  size_t n = 0;
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512 score = _mm512_loadu_ps(scores + i);
+    __mmask16 mask = _mm512_cmp_ps_mask(score, lows, _CMP_GE_OQ) &
+                     _mm512_cmp_ps_mask(score, highs, _CMP_LT_OQ);
+    _mm512_mask_compressstoreu_ps(out + n, mask, score);
+    n += __builtin_popcount(mask);
+  }
+  return n + collectScalar(scores + i, count - i, low, high, out + n);
+}
+
+AVX512_TARGET static void sumAvx512(const float *scores, const uint8_t *hot,
+                                    size_t count, double *total,
+                                    double *selected) {
+  __m512 all = _mm512_setzero_ps();
+  __m512 hot_sum = _mm512_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512 score = _mm512_loadu_ps(scores + i);
+    __m512i flags = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(hot + i)));
+    all = _mm512_add_ps(all, score);
+    hot_sum = _mm512_mask_add_ps(hot_sum, _mm512_test_epi32_mask(flags, flags),
+                                 hot_sum, score);
+  }
+  *total += _mm512_reduce_add_ps(all);
+  *selected += _mm512_reduce_add_ps(hot_sum);
+  sumScalar(scores + i, hot + i, count - i, total, selected);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+static const HotnessKernels KERNELS[] = {
+    {scoreScalar, classifyScalar, histogramScalar, extractScalar, collectScalar,
+     sumScalar, HotnessKernels::ISA_SCALAR},
+#if defined(__x86_64__)
+    {scoreAvx2, classifyAvx2, histogramAvx2, extractAvx2, collectAvx2, sumAvx2,
+     HotnessKernels::ISA_AVX2},
+    // compress stores lose to skipping bits of a byte mask on sparse hot pages
+    {scoreAvx512, classifyAvx512, histogramAvx512, extractAvx2, collectAvx512,
+     sumAvx512, HotnessKernels::ISA_AVX512},
+#endif
+};
+
+// the best instruction set of this cpu
+static HotnessKernels::Isa supportedIsa() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("fma") ||
+      !__builtin_cpu_supports("bmi2"))
+    return HotnessKernels::ISA_SCALAR;
+  if (__builtin_cpu_supports("avx512f"))
+    return HotnessKernels::ISA_AVX512;
+  return HotnessKernels::ISA_AVX2;
+#endif
+  return HotnessKernels::ISA_SCALAR;
+}
+
+const HotnessKernels &HotnessKernels::get(Isa isa) {
+  static const Isa supported = supportedIsa();
+  return KERNELS[std::min(isa, supported)];
+}
+
+const HotnessKernels &HotnessKernels::best() { return get(ISA_AVX512); }
+
+float HotnessKernels::bucketFloor(size_t bucket) {
+  return bucket == 0 ? 0 : ldexpf(1, (int)bucket - HOTNESS_BUCKET_BIAS);
+}
+
+float HotnessKernels::exp2(float x) { return exp2Scalar(x); }
+
+size_t HotnessKernels::bucketOf(float score) {
+  uint32_t bits;
+  memcpy(&bits, &score, sizeof(bits));
+  int32_t bucket = (int32_t)((bits >> 23) & 0xFF) - 127 + HOTNESS_BUCKET_BIAS;
+  return bucket < 0 ? 0 : bucket >= HOTNESS_BUCKETS ? HOTNESS_BUCKETS - 1 : bucket;
+}
@@ -0,0 +1,98 @@
+#ifndef HOTNESSKERNELS_H
+#define HOTNESSKERNELS_H
+
+#include "common.h"
+
+#include <stddef.h>
+
+// buckets of histogram(), by the binary exponent of the score
+#define HOTNESS_BUCKETS 32
+// bucket 0 holds scores below 2^(1 - HOTNESS_BUCKET_BIAS)
+#define HOTNESS_BUCKET_BIAS 8
+
+/* Kernels over the columns of HotnessTracker, in a scalar, an AVX2 and an
+ * AVX-512 flavor, the best one the cpu supports is picked at run time.
+ * Every flavor computes 2^x with the same polynomial, so they agree with each
+ * other up to rounding.
+ */
+struct HotnessKernels {
+  enum Isa {
+    ISA_SCALAR, // any cpu
+    ISA_AVX2,   // AVX2, FMA and BMI2
+    ISA_AVX512, // AVX-512F, besides those of ISA_AVX2
+  };
+
+  struct Decay {
+    uint32_t now;         // the time to decay to, in ms
+    float rate;           // 1 / half-life of the frequency
+    float recency_weight; // recency bonus right after a sample
+    float recency_rate;   // 1 / half-life of the recency bonus
+  };
+
+  /* Compute the score of pages as of <decay.now>.
+   *      frequency: decayed count of samples of each page as of <last>
+   *      last:      time of the last sample of each page, in ms
+   *      count:     count of pages
+   *      decay:     the time and the rates
+   *      scores:    the buffer to receive <count> scores
+   */
+  void (*score)(const float *frequency, const uint32_t *last, size_t count,
+                const Decay &decay, float *scores);
+
+  /* Update the hot flags (0 or 1) of pages from their scores, a hot page
+   * stays hot down to <cold_threshold>, a cold one needs <hot_threshold>.
+   * RETURN: count of hot pages after the update
+   */
+  size_t (*classify)(const float *scores, uint8_t *hot, size_t count,
+                     float hot_threshold, float cold_threshold);
+
+  /* Add the count of pages of each bucket to <buckets>, a page goes to the
+   * bucket of floor(log2(score)) + HOTNESS_BUCKET_BIAS, clamped.
+   */
+  void (*histogram)(const float *scores, size_t count, uint64_t *buckets);
+
+  /* Copy the page frame numbers of hot pages to <out>.
+   * RETURN: count of hot pages
+   * NOTE: <out> may be written one past the hot pages, up to <count>.
+   */
+  size_t (*extract)(const uint8_t *hot, const uint64_t *pfns, size_t count,
+                    uint64_t *out);
+
+  /* Copy the scores in [<low>, <high>) to <out>.
+   * RETURN: count of scores copied
+   * NOTE: <out> may be written one past the scores copied, up to <count>.
+   */
+  size_t (*collect)(const float *scores, size_t count, float low, float high,
+                    float *out);
+
+  /* Add the sum of scores to <total>, and that of hot pages to <selected>.
+   */
+  void (*sum)(const float *scores, const uint8_t *hot, size_t count,
+              double *total, double *selected);
+
+  Isa isa; // the instruction set of the kernels
+
+  /* Get the kernels of an instruction set, or of the best one this cpu
+   * supports below it.
+   */
+  static const HotnessKernels &get(Isa isa);
+
+  /* Get the kernels of the best instruction set this cpu supports.
+   */
+  static const HotnessKernels &best();
+
+  /* Get the bucket of a score, the same as histogram() does.
+   */
+  static size_t bucketOf(float score);
+
+  /* Get the lowest score of a bucket, 0 for bucket 0.
+   */
+  static float bucketFloor(size_t bucket);
+
+  /* Get 2^x for x <= 0 with the polynomial of the kernels, for a page
+   * decayed on its own to agree with score().
+   */
+  static float exp2(float x);
+};
+
+#endif
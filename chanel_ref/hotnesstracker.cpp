@@ -0,0 +1,387 @@
+#include "hotnesstracker.h"
+
+#include <algorithm>
+#include <functional>
+#include <math.h>
+
+// times are kept below 2^31 ms (about 24 days), the kernels convert ages to
+// float as signed integers
+#define MAX_ELAPSED_MS 0x7FFFFFFFU
+// pages classify() runs each kernel on at once
+#define CLASSIFY_CHUNK 2048
+// bits of the masks of nodes and threads of a page
+#define SHARER_BITS 32
+
+HotnessTracker::HotnessTracker() {
+  m_rate = 0;
+  m_recency_rate = 0;
+  m_origin = UINT64_MAX;
+  m_kernels = &HotnessKernels::best();
+  m_cursor = 0;
+  m_hot_count = 0;
+}
+
+int HotnessTracker::init(const Config &config, size_t capacity) {
+  if (config.half_life_ms <= 0 || config.recency_half_life_ms <= 0)
+    ERROR({}, -EINVAL, false, "invalid half-life %f or %f", config.half_life_ms,
+          config.recency_half_life_ms);
+  if (config.cold_threshold > config.hot_threshold ||
+      config.forget_score > config.cold_threshold)
+    ERROR({}, -EINVAL, false,
+          "thresholds must be forget_score %f <= cold %f <= hot %f",
+          config.forget_score, config.cold_threshold, config.hot_threshold);
+  if (config.store_weight <= 0)
+    ERROR({}, -EINVAL, false, "invalid store_weight %f", config.store_weight);
+  int ret = m_index.init(capacity);
+  if (ret < 0)
+    ERROR({}, ret, false, "m_index.init(%lu) failed", capacity);
+  m_pfns.reserve(capacity);
+  m_frequency.reserve(capacity);
+  m_stores.reserve(capacity);
+  m_last.reserve(capacity);
+  m_hot.reserve(capacity);
+  m_tenant.reserve(capacity);
+  m_nodes.reserve(capacity);
+  m_threads.reserve(capacity);
+  m_past_nodes.reserve(capacity);
+  m_past_threads.reserve(capacity);
+  m_config = config;
+  m_rate = 1 / config.half_life_ms;
+  m_recency_rate = 1 / config.recency_half_life_ms;
+  return 0;
+}
+
+int HotnessTracker::record(uint64_t pfn, uint64_t time, float weight,
+                           uint16_t tenant, Access access, int node,
+                           uint32_t tid) {
+  if (m_origin == UINT64_MAX)
+    m_origin = time;
+  uint32_t now = elapsed(time);
+  uint32_t *index = m_index.find(pfn);
+  if (index == NULL) {
+    index = m_index.insert(pfn);
+    if (index == NULL)
+      ERROR({}, -ENOMEM, false, "failed to insert page %lx", pfn);
+    *index = m_pfns.size();
+    m_pfns.push_back(pfn);
+    m_frequency.push_back(0);
+    m_stores.push_back(0);
+    m_last.push_back(now);
+    m_hot.push_back(0);
+    m_tenant.push_back(tenant);
+    m_nodes.push_back(0);
+    m_threads.push_back(0);
+    m_past_nodes.push_back(0);
+    m_past_threads.push_back(0);
+  }
+  size_t i = *index;
+  m_tenant[i] = tenant;
+  if (node >= 0)
+    m_nodes[i] |= 1U << (node % SHARER_BITS);
+  if (tid != 0) {
+    // the finalizer of murmur3, linear counting needs tids placed at random
+    tid ^= tid >> 16;
+    tid *= 0x85EBCA6BU;
+    tid ^= tid >> 13;
+    tid *= 0xC2B2AE35U;
+    tid ^= tid >> 16;
+    m_threads[i] |= 1U << (tid % SHARER_BITS);
+  }
+  if (now > m_last[i]) {
+    float decay = HotnessKernels::exp2(-(float)(now - m_last[i]) * m_rate);
+    m_frequency[i] *= decay;
+    m_stores[i] *= decay;
+    m_last[i] = now;
+  }
+  if (access == ACCESS_STORE) {
+    m_stores[i] += weight;
+    weight *= m_config.store_weight;
+  }
+  m_frequency[i] += weight;
+  // the recency bonus is full right after a sample
+  if (m_hot[i] ||
+      m_frequency[i] + m_config.recency_weight < m_config.hot_threshold)
+    return 0;
+  m_hot[i] = 1;
+  m_hot_count++;
+  return 1;
+}
+
+int HotnessTracker::query(uint64_t pfn, uint64_t time, Page *page) const {
+  const uint32_t *index = m_index.find(pfn);
+  if (index == NULL)
+    return -ENOENT;
+  score(*index, elapsed(time), page);
+  return 0;
+}
+
+size_t HotnessTracker::classify(uint64_t time, uint64_t *histogram) {
+  HotnessKernels::Decay decay = decayTo(time);
+  if (histogram != NULL)
+    memset(histogram, 0, HOTNESS_BUCKETS * sizeof(uint64_t));
+  // scores of a chunk stay in L1 between the kernels
+  float scores[CLASSIFY_CHUNK];
+  size_t hot_count = 0;
+  for (size_t start = 0; start < m_pfns.size(); start += CLASSIFY_CHUNK) {
+    size_t count = std::min(m_pfns.size() - start, (size_t)CLASSIFY_CHUNK);
+    m_kernels->score(&m_frequency[start], &m_last[start], count, decay, scores);
+    hot_count += m_kernels->classify(scores, &m_hot[start], count,
+                                     m_config.hot_threshold,
+                                     m_config.cold_threshold);
+    if (histogram != NULL)
+      m_kernels->histogram(scores, count, histogram);
+  }
+  m_hot_count = hot_count;
+  return hot_count;
+}
+
+size_t HotnessTracker::select(uint64_t time, size_t capacity,
+                              Selection *selection) {
+  return selectHot(time, &capacity, 1, false, selection);
+}
+
+size_t HotnessTracker::select(uint64_t time, const size_t *capacities,
+                              size_t tenants, Selection *selections) {
+  return selectHot(time, capacities, tenants, true, selections);
+}
+
+void HotnessTracker::hotPages(std::vector<uint64_t> *pages) const {
+  // the scalar kernel writes one past the last hot page
+  pages->resize(m_hot_count + 1);
+  size_t count = m_kernels->extract(m_hot.data(), m_pfns.data(), m_pfns.size(),
+                                    pages->data());
+  pages->resize(count);
+}
+
+void HotnessTracker::sharedPages(std::vector<uint64_t> *pages) const {
+  pages->clear();
+  for (size_t i = 0; i < m_pfns.size(); i++) {
+    uint32_t mask = m_nodes[i] | m_past_nodes[i];
+    // more than one bit set
+    if (m_hot[i] && (mask & (mask - 1)) != 0)
+      pages->push_back(m_pfns[i]);
+  }
+}
+
+void HotnessTracker::remotePages(int home, std::vector<uint64_t> *pages,
+                                 std::vector<int> *nodes) const {
+  pages->clear();
+  if (nodes != NULL)
+    nodes->clear();
+  uint32_t home_bit = home >= 0 ? 1U << (home % SHARER_BITS) : 0;
+  for (size_t i = 0; i < m_pfns.size(); i++) {
+    uint32_t mask = m_nodes[i] | m_past_nodes[i];
+    if (!m_hot[i] || mask == 0 || (mask & (mask - 1)) != 0 || mask == home_bit)
+      continue;
+    pages->push_back(m_pfns[i]);
+    if (nodes != NULL)
+      nodes->push_back(__builtin_ctz(mask));
+  }
+}
+
+size_t HotnessTracker::size() const { return m_pfns.size(); }
+
+size_t HotnessTracker::hotCount() const { return m_hot_count; }
+
+size_t HotnessTracker::memory() const {
+  return m_index.memory() + m_pfns.capacity() * sizeof(uint64_t) +
+         (m_frequency.capacity() + m_stores.capacity()) * sizeof(float) +
+         m_last.capacity() * sizeof(uint32_t) + m_hot.capacity() +
+         m_tenant.capacity() * sizeof(uint16_t) +
+         (m_nodes.capacity() + m_threads.capacity() +
+          m_past_nodes.capacity() + m_past_threads.capacity()) *
+             sizeof(uint32_t);
+}
+
+// the lowest score above a bucket
+static float bucketCeiling(size_t bucket) {
+  return bucket + 1 < HOTNESS_BUCKETS ? HotnessKernels::bucketFloor(bucket + 1)
+                                      : INFINITY;
+}
+
+uint32_t HotnessTracker::elapsed(uint64_t time) const {
+  if (m_origin == UINT64_MAX || time <= m_origin)
+    return 0;
+  return std::min<uint64_t>(time - m_origin, MAX_ELAPSED_MS);
+}
+
+void HotnessTracker::score(size_t index, uint32_t now, Page *page) const {
+  float age = now > m_last[index] ? now - m_last[index] : 0;
+  // the polynomial of the kernels, so that query() agrees with classify()
+  float decay = HotnessKernels::exp2(-age * m_rate);
+  page->frequency = m_frequency[index] * decay;
+  page->stores = m_stores[index] * decay;
+  // rounding may leave a little below 0 on write-only pages
+  page->loads = std::max(
+      page->frequency - m_config.store_weight * page->stores, 0.0f);
+  page->write_ratio = page->loads + page->stores > 0
+                          ? page->stores / (page->loads + page->stores)
+                          : 0;
+  page->recency = m_config.recency_weight *
+                  HotnessKernels::exp2(-age * m_recency_rate);
+  page->score = page->frequency + page->recency;
+  page->hot = m_hot[index];
+  page->nodes = m_nodes[index] | m_past_nodes[index];
+  // linear counting: n = -m ln(zeros / m), capped when no bit is left
+  int zeros = SHARER_BITS -
+              __builtin_popcount(m_threads[index] | m_past_threads[index]);
+  page->threads = SHARER_BITS * logf((float)SHARER_BITS / std::max(zeros, 1));
+}
+
+HotnessKernels::Decay HotnessTracker::decayTo(uint64_t time) const {
+  return {elapsed(time), m_rate, m_config.recency_weight, m_recency_rate};
+}
+
+size_t HotnessTracker::selectHot(uint64_t time, const size_t *capacities,
+                                 size_t tenants, bool by_tenant,
+                                 Selection *selections) {
+  HotnessKernels::Decay decay = decayTo(time);
+  float scores[CLASSIFY_CHUNK];
+  // count the pages of each score bucket of each tenant
+  std::vector<uint64_t> histograms(tenants * HOTNESS_BUCKETS, 0);
+  for (size_t start = 0; start < m_pfns.size(); start += CLASSIFY_CHUNK) {
+    size_t count = std::min(m_pfns.size() - start, (size_t)CLASSIFY_CHUNK);
+    m_kernels->score(&m_frequency[start], &m_last[start], count, decay, scores);
+    if (!by_tenant) {
+      m_kernels->histogram(scores, count, histograms.data());
+      continue;
+    }
+    for (size_t i = 0; i < count; i++) {
+      size_t tenant = m_tenant[start + i];
+      if (tenant < tenants)
+        histograms[tenant * HOTNESS_BUCKETS +
+                   HotnessKernels::bucketOf(scores[i])]++;
+    }
+  }
+  // walk down the buckets to the one the capacity runs out in, its pages
+  // compete for the <wanted> places left
+  std::vector<float> cutoffs(tenants, 0);
+  std::vector<size_t> buckets(tenants, HOTNESS_BUCKETS);
+  std::vector<size_t> wanted(tenants, 0);
+  std::vector<std::vector<float>> candidates(tenants);
+  bool selecting = false;
+  for (size_t tenant = 0; tenant < tenants; tenant++) {
+    const uint64_t *histogram = &histograms[tenant * HOTNESS_BUCKETS];
+    size_t above = 0;
+    for (size_t bucket = HOTNESS_BUCKETS; bucket-- > 0;) {
+      if (above + histogram[bucket] > capacities[tenant]) {
+        buckets[tenant] = bucket;
+        wanted[tenant] = capacities[tenant] - above;
+        candidates[tenant].reserve(histogram[bucket]);
+        selecting = true;
+        break;
+      }
+      above += histogram[bucket];
+    }
+  }
+  if (selecting) {
+    for (size_t start = 0; start < m_pfns.size(); start += CLASSIFY_CHUNK) {
+      size_t count = std::min(m_pfns.size() - start, (size_t)CLASSIFY_CHUNK);
+      m_kernels->score(&m_frequency[start], &m_last[start], count, decay,
+                       scores);
+      if (!by_tenant) {
+        std::vector<float> &found = candidates[0];
+        size_t size = found.size();
+        found.resize(size + count);
+        size = size + m_kernels->collect(scores, count,
+                                         HotnessKernels::bucketFloor(buckets[0]),
+                                         bucketCeiling(buckets[0]),
+                                         &found[size]);
+        found.resize(size);
+        continue;
+      }
+      for (size_t i = 0; i < count; i++) {
+        size_t tenant = m_tenant[start + i];
+        if (tenant < tenants && buckets[tenant] < HOTNESS_BUCKETS &&
+            HotnessKernels::bucketOf(scores[i]) == buckets[tenant])
+          candidates[tenant].push_back(scores[i]);
+      }
+    }
+  }
+  for (size_t tenant = 0; tenant < tenants; tenant++) {
+    if (buckets[tenant] == HOTNESS_BUCKETS)
+      continue; // everything fits
+    std::vector<float> &found = candidates[tenant];
+    if (wanted[tenant] == 0) {
+      cutoffs[tenant] = bucketCeiling(buckets[tenant]);
+      continue;
+    }
+    std::nth_element(found.begin(), found.begin() + wanted[tenant] - 1,
+                     found.end(), std::greater<float>());
+    float cutoff = found[wanted[tenant] - 1];
+    size_t taken = std::count_if(found.begin(), found.end(),
+                                 [&](float score) { return score >= cutoff; });
+    // ties would overflow the capacity, leave them all
+    cutoffs[tenant] = taken <= wanted[tenant] ? cutoff
+                                              : nextafterf(cutoff, INFINITY);
+    std::vector<float>().swap(found);
+  }
+  // mark the pages and sum their scores
+  std::vector<Selection> results(tenants);
+  for (size_t tenant = 0; tenant < tenants; tenant++)
+    results[tenant] = {cutoffs[tenant], 0, 0, 0, 0};
+  for (size_t start = 0; start < m_pfns.size(); start += CLASSIFY_CHUNK) {
+    size_t count = std::min(m_pfns.size() - start, (size_t)CLASSIFY_CHUNK);
+    m_kernels->score(&m_frequency[start], &m_last[start], count, decay, scores);
+    if (!by_tenant) {
+      results[0].pages += m_kernels->classify(scores, &m_hot[start], count,
+                                              cutoffs[0], cutoffs[0]);
+      m_kernels->sum(scores, &m_hot[start], count, &results[0].total_mass,
+                     &results[0].mass);
+      continue;
+    }
+    for (size_t i = 0; i < count; i++) {
+      size_t tenant = m_tenant[start + i];
+      if (tenant >= tenants) {
+        m_hot[start + i] = 0;
+        continue;
+      }
+      Selection &result = results[tenant];
+      bool hot = scores[i] >= cutoffs[tenant];
+      m_hot[start + i] = hot;
+      result.candidates++;
+      result.total_mass += scores[i];
+      if (hot) {
+        result.pages++;
+        result.mass += scores[i];
+      }
+    }
+  }
+  if (!by_tenant)
+    results[0].candidates = m_pfns.size();
+  m_hot_count = 0;
+  for (size_t tenant = 0; tenant < tenants; tenant++) {
+    m_hot_count += results[tenant].pages;
+    if (selections != NULL)
+      selections[tenant] = results[tenant];
+  }
+  return m_hot_count;
+}
+
+void HotnessTracker::forget(size_t index) {
+  m_index.erase(m_pfns[index]);
+  size_t last = m_pfns.size() - 1;
+  if (index != last) {
+    m_pfns[index] = m_pfns[last];
+    m_frequency[index] = m_frequency[last];
+    m_stores[index] = m_stores[last];
+    m_last[index] = m_last[last];
+    m_hot[index] = m_hot[last];
+    m_tenant[index] = m_tenant[last];
+    m_nodes[index] = m_nodes[last];
+    m_threads[index] = m_threads[last];
+    m_past_nodes[index] = m_past_nodes[last];
+    m_past_threads[index] = m_past_threads[last];
+    *m_index.find(m_pfns[index]) = index;
+  }
+  m_pfns.pop_back();
+  m_frequency.pop_back();
+  m_stores.pop_back();
+  m_last.pop_back();
+  m_hot.pop_back();
+  m_tenant.pop_back();
+  m_nodes.pop_back();
+  m_threads.pop_back();
+  m_past_nodes.pop_back();
+  m_past_threads.pop_back();
+}
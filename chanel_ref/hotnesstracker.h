@@ -0,0 +1,240 @@
+#ifndef HOTNESSTRACKER_H
+#define HOTNESSTRACKER_H
+
+#include "common.h"
+#include "hotnesskernels.h"
+#include "pagetable.h"
+
+#include <vector>
+
+/* Hotness of pages with exponentially decayed history.
+ * The score of a page is a frequency, its samples decayed with half_life, plus
+ * a recency bonus that fades with recency_half_life since the last sample.
+ * Decay is lazy: a page stores its frequency as of its last sample, and it is
+ * brought up to date only when the page is sampled again or looked at, so
+ * nothing walks the whole table every period. Pages become hot when their
+ * score reaches hot_threshold on a sample, and cold again when it falls below
+ * cold_threshold, the gap between the two keeps pages from flapping.
+ * Demotion is found by sweep(), which looks at a bounded number of pages per
+ * call and also forgets pages whose score has decayed to nothing, or by
+ * classify(), which does all pages at once with vector kernels. Pages are kept
+ * as columns (structure of arrays) for the kernels to stream through.
+ * Instead of thresholds, select() takes the capacity of the fast tier, for all
+ * pages or for each tenant, and marks the hottest pages that fit as hot.
+ * Stores are counted apart from loads, with the same decay, and weigh
+ * store_weight times a load in the score: a page written to costs more to
+ * keep in a slow tier, so it stays hot at a lower read rate.
+ * Each page also keeps who shares it: a mask of the NUMA nodes it was sampled
+ * from and a 32-bit linear-counting sketch of its threads, in two generations.
+ * sweep() ages them as it passes a page, so a node or thread that stops
+ * sampling a page drops out of it two sweeps later, and a page going cold
+ * loses them all. sharedPages() and remotePages() tell the pages to interleave
+ * or to move to the node of their users.
+ */
+class HotnessTracker {
+public:
+  enum Access {
+    ACCESS_LOAD,  // a load sample
+    ACCESS_STORE, // a store sample, or a page found dirty by a scan
+  };
+
+  struct Config {
+    double half_life_ms = 60000;       // half-life of the frequency
+    double recency_half_life_ms = 1000; // half-life of the recency bonus
+    float recency_weight = 0;          // recency bonus right after a sample
+    float hot_threshold = 10;          // score to become hot at
+    float cold_threshold = 5;          // score to become cold below
+    float forget_score = 0.01;         // score of cold pages to forget below
+    float store_weight = 1;            // weight of a store relative to a load
+  };
+
+  struct Page {
+    float frequency;   // decayed loads + store_weight * decayed stores
+    float loads;       // decayed count of loads
+    float stores;      // decayed count of stores
+    float write_ratio; // stores / (loads + stores), 0 without samples
+    float recency;     // recency bonus
+    float score;       // frequency + recency
+    bool hot;          // whether the page is hot
+    uint32_t nodes;    // bit n % 32 set if lately sampled from node n
+    float threads;     // estimated count of threads lately sampled from
+  };
+
+  struct Selection {
+    float cutoff;      // score a page needs to be selected
+    size_t pages;      // count of pages selected
+    size_t candidates; // count of pages competing for the capacity
+    double mass;       // sum of scores of the pages selected
+    double total_mass; // sum of scores of the candidates
+  };
+
+  HotnessTracker();
+
+  /* Initialize the tracker.
+   *      config:   decay and thresholds
+   *      capacity: count of pages expected, it grows beyond as needed
+   * RETURN: 0 if OK, or a negative error code
+   */
+  int init(const Config &config, size_t capacity);
+
+  /* Account samples of a page.
+   *      pfn:    page frame number (address >> 12)
+   *      time:   time of the sample in ms, of a monotonic clock
+   *      weight: count of samples, or any weight, e.g. the sample period
+   *      tenant: the tenant the page is charged to, see select()
+   *      access: whether the samples are loads or stores
+   *      node:   NUMA node of the cpu of the samples, or -1 if unknown
+   *      tid:    thread of the samples, or 0 if unknown
+   * RETURN: 1 if the page became hot, 0 if not, or a negative error code
+   * NOTE: samples older than the last one of the page are not decayed. A page
+   * belongs to the tenant of its last sample.
+   */
+  int record(uint64_t pfn, uint64_t time, float weight = 1,
+             uint16_t tenant = 0, Access access = ACCESS_LOAD, int node = -1,
+             uint32_t tid = 0);
+
+  /* Get the hotness of a page as of <time>.
+   * RETURN: 0 if OK, -ENOENT if the page is not tracked
+   */
+  int query(uint64_t pfn, uint64_t time, Page *page) const;
+
+  /* Demote and forget pages, looking at <budget> pages at most.
+   *      time:    the current time in ms
+   *      budget:  count of pages to look at, it resumes where it stopped
+   *      on_cold: called as on_cold(uint64_t pfn) with each demoted page
+   * RETURN: count of pages demoted
+   */
+  template <typename F> size_t sweep(uint64_t time, size_t budget, F &&on_cold);
+
+  /* Classify every page as of <time>, with the best kernels of this cpu.
+   *      time:      the current time in ms
+   *      histogram: HOTNESS_BUCKETS counters to receive the count of pages of
+   *                 each score bucket, or NULL
+   * RETURN: count of hot pages
+   * NOTE: pages are neither promoted nor demoted through a callback, see
+   * hotPages() for the result. Pages are not forgotten.
+   */
+  size_t classify(uint64_t time, uint64_t *histogram);
+
+  /* Mark the hottest pages that fit in the fast tier as hot, the others cold.
+   *      time:      the current time in ms
+   *      capacity:  count of pages the fast tier holds
+   *      selection: the buffer to receive the result, or NULL
+   * RETURN: count of hot pages
+   * NOTE: the cutoff comes from a histogram of scores and a selection among
+   * the pages of the bucket it falls in, nothing is sorted. Pages tied at the
+   * cutoff are taken all or none, so fewer than <capacity> pages may be
+   * selected, never more. The thresholds of Config are not used.
+   */
+  size_t select(uint64_t time, size_t capacity, Selection *selection);
+
+  /* Same as select(), with a capacity for each tenant.
+   *      capacities: capacities[i] is the count of pages of tenant i
+   *      tenants:    count of entries of <capacities> and <selections>
+   *      selections: the buffer to receive <tenants> results, or NULL
+   * RETURN: count of hot pages
+   * NOTE: pages of tenants from <tenants> on are cold.
+   */
+  size_t select(uint64_t time, const size_t *capacities, size_t tenants,
+                Selection *selections);
+
+  /* Get the page frame numbers of hot pages.
+   *      pages: the vector to receive them
+   */
+  void hotPages(std::vector<uint64_t> *pages) const;
+
+  /* Get the hot pages sampled from more than one node, to be interleaved or
+   * left where they are.
+   *      pages: the vector to receive their page frame numbers
+   */
+  void sharedPages(std::vector<uint64_t> *pages) const;
+
+  /* Get the hot pages sampled from a single node other than <home>, to be
+   * moved to that node.
+   *      home:  the node the pages are on
+   *      pages: the vector to receive their page frame numbers
+   *      nodes: the vector to receive the node of each page, or NULL
+   * NOTE: nodes from 32 on alias the ones 32 below.
+   */
+  void remotePages(int home, std::vector<uint64_t> *pages,
+                   std::vector<int> *nodes) const;
+
+  /* Get the count of pages tracked.
+   */
+  size_t size() const;
+
+  /* Get the count of hot pages.
+   */
+  size_t hotCount() const;
+
+  /* Get the bytes allocated for the pages.
+   */
+  size_t memory() const;
+
+private:
+  uint32_t elapsed(uint64_t time) const;
+
+  void score(size_t index, uint32_t now, Page *page) const;
+
+  HotnessKernels::Decay decayTo(uint64_t time) const;
+
+  size_t selectHot(uint64_t time, const size_t *capacities, size_t tenants,
+                   bool by_tenant, Selection *selections);
+
+  void forget(size_t index);
+
+private:
+  Config m_config;           // decay and thresholds
+  float m_rate;              // 1 / half_life_ms
+  float m_recency_rate;      // 1 / recency_half_life_ms
+  uint64_t m_origin;         // time of the first sample, UINT64_MAX if none
+  const HotnessKernels *m_kernels; // kernels of classify()
+  PageTable<uint32_t> m_index; // index in the columns of each page
+  // the pages as columns, in no particular order
+  std::vector<uint64_t> m_pfns;   // page frame number
+  std::vector<float> m_frequency; // decayed count as of <m_last>
+  std::vector<float> m_stores;    // decayed count of stores as of <m_last>
+  std::vector<uint32_t> m_last;   // ms since <m_origin> of the last sample
+  std::vector<uint8_t> m_hot;     // 1 if the page is hot, or 0
+  std::vector<uint16_t> m_tenant; // tenant of the last sample
+  std::vector<uint32_t> m_nodes;  // mask of the nodes sampled from
+  std::vector<uint32_t> m_threads; // bits of the hashes of the threads
+  std::vector<uint32_t> m_past_nodes;   // <m_nodes> before the last sweep
+  std::vector<uint32_t> m_past_threads; // <m_threads> before the last sweep
+  size_t m_cursor;           // next page to sweep
+  size_t m_hot_count;        // count of hot pages
+};
+
+template <typename F>
+size_t HotnessTracker::sweep(uint64_t time, size_t budget, F &&on_cold) {
+  uint32_t now = elapsed(time);
+  size_t demoted = 0;
+  for (; budget > 0 && !m_pfns.empty(); budget--) {
+    if (m_cursor >= m_pfns.size())
+      m_cursor = 0;
+    Page page;
+    score(m_cursor, now, &page);
+    if (page.hot && page.score < m_config.cold_threshold) {
+      m_hot[m_cursor] = 0;
+      m_hot_count--;
+      demoted++;
+      on_cold(m_pfns[m_cursor]);
+      // its sharers are to be found again if it heats up
+      m_nodes[m_cursor] = 0;
+      m_threads[m_cursor] = 0;
+    }
+    // sharers not seen since the last sweep are forgotten by the next one
+    m_past_nodes[m_cursor] = m_nodes[m_cursor];
+    m_past_threads[m_cursor] = m_threads[m_cursor];
+    m_nodes[m_cursor] = 0;
+    m_threads[m_cursor] = 0;
+    // the last page takes its place, so <m_cursor> stays
+    if (!m_hot[m_cursor] && page.score < m_config.forget_score)
+      forget(m_cursor);
+    else
+      m_cursor++;
+  }
+  return demoted;
+}
+
+#endif
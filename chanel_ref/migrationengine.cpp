@@ -0,0 +1,272 @@
+#include "migrationengine.h"
+
+#include "topology.h"
+
+#include <algorithm>
+#include <chrono>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PAGE_SIZE 4096UL
+// move_pages(2) flag to move pages mapped by this process only
+#define MPOL_MF_MOVE (1 << 1)
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+MigrationEngine::MigrationEngine() {
+  m_emulated = false;
+  m_privdata = NULL;
+  m_on_batch = NULL;
+  m_running = false;
+  m_inflight = 0;
+  m_promote_next = true;
+  m_next_ns = 0;
+  memset(&m_stats, 0, sizeof(m_stats));
+}
+
+MigrationEngine::~MigrationEngine() { deinit(); }
+
+int MigrationEngine::init(const Config &config, void *privdata,
+                          void (*on_batch)(void *privdata,
+                                           const Batch *batch)) {
+  if (m_running)
+    ERROR({}, -EINVAL, false,
+          "this MigrationEngine has been initialized already");
+  if (config.bytes_per_sec == 0 || config.batch_pages == 0 ||
+      config.emulated_bytes_per_sec == 0)
+    ERROR({}, -EINVAL, false,
+          "invalid bytes_per_sec %lu, batch_pages %lu or "
+          "emulated_bytes_per_sec %lu",
+          config.bytes_per_sec, config.batch_pages,
+          config.emulated_bytes_per_sec);
+  m_config = config;
+  // nodes of CXL memory have no cpu, so look at the nodes with memory
+  std::vector<int> nodes;
+  if (Topology::readCpuList("/sys/devices/system/node/has_memory", nodes) < 0 ||
+      nodes.empty())
+    nodes.assign(1, 0);
+  if (m_config.fast_node < 0)
+    m_config.fast_node = nodes.front();
+  if (m_config.slow_node < 0)
+    m_config.slow_node = nodes.back();
+  m_emulated = config.emulate || m_config.fast_node == m_config.slow_node;
+  if (m_emulated && m_config.fast_node == m_config.slow_node)
+    // a node id the emulated pages are reported on
+    m_config.slow_node = m_config.fast_node + 1;
+  m_privdata = privdata;
+  m_on_batch = on_batch;
+  m_promote_next = true;
+  m_next_ns = now_ns();
+  memset(&m_stats, 0, sizeof(m_stats));
+  m_running = true;
+  m_worker = std::thread(&MigrationEngine::run, this);
+  return 0;
+}
+
+void MigrationEngine::deinit() {
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (!m_running)
+      return;
+    m_running = false;
+  }
+  m_wakeup.notify_all();
+  m_worker.join();
+  std::lock_guard<std::mutex> lock(m_lock);
+  m_promotions = Queue();
+  m_demotions = Queue();
+}
+
+int MigrationEngine::submit(pid_t pid, const uint64_t *addresses,
+                            const float *scores, size_t count, bool promote) {
+  if (pid == 0)
+    pid = getpid();
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (!m_running)
+      ERROR({}, -EINVAL, false, "this MigrationEngine is not initialized");
+    Queue &queue = promote ? m_promotions : m_demotions;
+    for (size_t i = 0; i < count; i++)
+      queue.push({pid, addresses[i] & ~(PAGE_SIZE - 1),
+                  promote ? scores[i] : -scores[i], 0, 0});
+  }
+  m_wakeup.notify_one();
+  return 0;
+}
+
+void MigrationEngine::drop(pid_t pid) {
+  std::lock_guard<std::mutex> lock(m_lock);
+  for (Queue *queue : {&m_promotions, &m_demotions}) {
+    Queue kept;
+    for (; !queue->empty(); queue->pop()) {
+      if (queue->top().pid == pid)
+        m_stats.dropped++;
+      else
+        kept.push(queue->top());
+    }
+    *queue = std::move(kept);
+  }
+}
+
+size_t MigrationEngine::pending() {
+  std::lock_guard<std::mutex> lock(m_lock);
+  return m_promotions.size() + m_demotions.size() + m_inflight;
+}
+
+bool MigrationEngine::emulated() const { return m_emulated; }
+
+void MigrationEngine::getStats(Stats *stats) {
+  std::lock_guard<std::mutex> lock(m_lock);
+  *stats = m_stats;
+}
+
+void MigrationEngine::run() {
+  std::vector<Move> moves;
+  std::unique_lock<std::mutex> lock(m_lock);
+  while (m_running) {
+    // alternate while both directions are pending
+    bool promote = m_promote_next ? !m_promotions.empty() : m_demotions.empty();
+    if (take(promote ? &m_promotions : &m_demotions, &moves) == 0 &&
+        take(promote ? &m_demotions : &m_promotions, &moves) > 0)
+      promote = !promote;
+    if (moves.empty()) {
+      // nothing ready, wait for a submit() or the first retry due
+      m_wakeup.wait_for(lock, std::chrono::milliseconds(
+                                  std::max(m_config.backoff_ms, 1U)));
+      continue;
+    }
+    m_promote_next = !promote;
+    m_inflight = moves.size();
+    lock.unlock();
+    throttle(moves.size() * PAGE_SIZE);
+    issue(moves, promote);
+    lock.lock();
+  }
+}
+
+size_t MigrationEngine::take(Queue *queue, std::vector<Move> *moves) {
+  moves->clear();
+  uint64_t now = now_ns() / 1000000;
+  std::vector<Move> later;
+  while (!queue->empty() && moves->size() < m_config.batch_pages) {
+    const Move &move = queue->top();
+    // a call moves pages of one process
+    if (move.not_before > now ||
+        (!moves->empty() && move.pid != moves->front().pid))
+      later.push_back(move);
+    else
+      moves->push_back(move);
+    queue->pop();
+    // do not unqueue everything looking for a ready page
+    if (later.size() >= m_config.batch_pages)
+      break;
+  }
+  for (const Move &move : later)
+    queue->push(move);
+  return moves->size();
+}
+
+void MigrationEngine::throttle(size_t bytes) {
+  std::unique_lock<std::mutex> lock(m_lock);
+  uint64_t now = now_ns();
+  // no credit for idle time beyond one batch, so bursts stay bounded
+  if (m_next_ns < now)
+    m_next_ns = now;
+  uint64_t start = m_next_ns;
+  m_next_ns += bytes * 1000000000UL / m_config.bytes_per_sec;
+  while (m_running && now_ns() < start)
+    m_wakeup.wait_for(lock, std::chrono::nanoseconds(start - now_ns()));
+}
+
+void MigrationEngine::issue(std::vector<Move> &moves, bool promote) {
+  int node = promote ? m_config.fast_node : m_config.slow_node;
+  pid_t pid = moves.front().pid;
+  std::vector<void *> pages(moves.size());
+  std::vector<int> status(moves.size());
+  for (size_t i = 0; i < moves.size(); i++)
+    pages[i] = (void *)moves[i].address;
+  uint64_t start = now_ns();
+  int ret = m_emulated ? emulateBatch(pid, pages, node, status)
+                       : moveBatch(pid, pages, node, status);
+  uint64_t latency = now_ns() - start;
+  Batch batch = {promote, moves.size(), 0, 0, 0, latency / 1000.0, 0};
+  std::unique_lock<std::mutex> lock(m_lock);
+  m_inflight = 0;
+  if (ret == -ESRCH) {
+    // the process exited, nothing of it is worth moving any more
+    m_stats.dropped += moves.size();
+    lock.unlock();
+    drop(pid);
+    return;
+  }
+  Queue &queue = promote ? m_promotions : m_demotions;
+  uint64_t now = now_ns() / 1000000;
+  for (size_t i = 0; i < moves.size(); i++) {
+    int result = ret < 0 ? ret : status[i];
+    if (result == node) {
+      batch.moved++;
+    } else if ((result == -EBUSY || result == -EAGAIN) &&
+               moves[i].retries < m_config.max_retries) {
+      Move &move = moves[i];
+      move.not_before = now + ((uint64_t)m_config.backoff_ms << move.retries);
+      move.retries++;
+      queue.push(move);
+      batch.retried++;
+    } else {
+      batch.failed++;
+    }
+  }
+  if (latency > 0)
+    batch.mbps = (double)batch.moved * PAGE_SIZE / (1 << 20) /
+                 (latency / 1000000000.0);
+  m_stats.batches++;
+  m_stats.moved += batch.moved;
+  m_stats.retried += batch.retried;
+  m_stats.failed += batch.failed;
+  m_stats.latency_us += batch.latency_us;
+  lock.unlock();
+  if (m_on_batch != NULL)
+    m_on_batch(m_privdata, &batch);
+}
+
+int MigrationEngine::moveBatch(pid_t pid, std::vector<void *> &pages, int node,
+                               std::vector<int> &status) {
+  std::vector<int> nodes(pages.size(), node);
+  // glibc has no wrapper, and libnuma is not worth a dependency for one call
+  long ret = syscall(SYS_move_pages, pid, pages.size(), pages.data(),
+                     nodes.data(), status.data(), MPOL_MF_MOVE);
+  // a positive count of pages not moved still has their status filled in
+  if (ret < 0 && errno == ESRCH)
+    return -ESRCH;
+  if (ret < 0)
+    ERROR({}, -errno, true, "move_pages(%d, %lu pages, node %d) failed: ", pid,
+          pages.size(), node);
+  return 0;
+}
+
+int MigrationEngine::emulateBatch(pid_t pid, std::vector<void *> &pages,
+                                  int node, std::vector<int> &status) {
+  // the copy a move does, without writing anything back to the process
+  char buffer[PAGE_SIZE];
+  for (size_t i = 0; i < pages.size(); i++) {
+    struct iovec local = {buffer, PAGE_SIZE};
+    struct iovec remote = {pages[i], PAGE_SIZE};
+    if (process_vm_readv(pid, &local, 1, &remote, 1, 0) == (ssize_t)PAGE_SIZE)
+      status[i] = node;
+    else if (errno == ESRCH)
+      return -ESRCH;
+    else
+      status[i] = -EFAULT;
+  }
+  // and the time the slow tier would take for it
+  uint64_t ns = pages.size() * PAGE_SIZE * 1000000000UL /
+                m_config.emulated_bytes_per_sec;
+  std::this_thread::sleep_for(std::chrono::nanoseconds(ns));
+  return 0;
+}
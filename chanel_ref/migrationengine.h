@@ -0,0 +1,153 @@
+#ifndef MIGRATIONENGINE_H
+#define MIGRATIONENGINE_H
+
+#include "common.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+/* Moves pages between a fast and a slow memory node from a worker thread.
+ * Callers submit promotions (to the fast node) and demotions (to the slow
+ * node) of pages of a process, each with the score of its hotness. Promotions
+ * are issued hottest first and demotions coldest first, in batches of one
+ * direction that alternate while both are pending, through move_pages(2).
+ * The bytes moved per second are capped by a token bucket, and pages found
+ * busy (-EBUSY, -EAGAIN) are retried after a backoff that doubles each time.
+ * With fewer than two memory nodes, or if asked to, the slow tier is
+ * emulated: a batch is "moved" by reading its pages out of the process and
+ * waiting for as long as the emulated bandwidth would take, so the pipeline
+ * can be run without a CXL device. Pages are then left where they are.
+ */
+class MigrationEngine {
+public:
+  struct Config {
+    int fast_node = -1;             // node to promote to, -1 for the first
+                                    // node with memory
+    int slow_node = -1;             // node to demote to, -1 for the last one
+    uint64_t bytes_per_sec = 1UL << 30; // bytes moved per second at most
+    size_t batch_pages = 512;       // pages of a move_pages() call at most
+    unsigned max_retries = 4;       // retries of a busy page before giving up
+    unsigned backoff_ms = 10;       // wait before the first retry
+    bool emulate = false;           // emulate the slow tier even with 2 nodes
+    uint64_t emulated_bytes_per_sec = 8UL << 30; // bandwidth when emulated
+  };
+
+  struct Batch {
+    bool promote;      // whether the pages went to the fast node
+    size_t pages;      // pages of the batch
+    size_t moved;      // pages on the target node afterwards
+    size_t retried;    // busy pages queued again
+    size_t failed;     // pages given up on, e.g. unmapped or out of retries
+    double latency_us; // time of the move_pages() call
+    double mbps;       // MiB moved per second of <latency_us>
+  };
+
+  struct Stats {
+    uint64_t batches;   // batches issued
+    uint64_t moved;     // see Batch
+    uint64_t retried;
+    uint64_t failed;
+    uint64_t dropped;   // pages of a process that exited, or of drop()
+    double latency_us;  // sum of the latencies of the batches
+  };
+
+  MigrationEngine();
+
+  ~MigrationEngine();
+
+  /* Initialize the engine and start its worker.
+   *      config:   nodes, rate and retries
+   *      privdata: passed to <on_batch>
+   *      on_batch: called on the worker after each batch, or NULL
+   * RETURN: 0 if OK, or a negative error code
+   */
+  int init(const Config &config, void *privdata,
+           void (*on_batch)(void *privdata, const Batch *batch));
+
+  /* Stop the worker, the pages pending are dropped.
+   */
+  void deinit();
+
+  /* Queue pages of a process to move.
+   *      pid:       the process, 0 for the calling one
+   *      addresses: virtual addresses within the pages
+   *      scores:    hotness of each page, orders the moves
+   *      count:     count of pages
+   *      promote:   true to move them to the fast node, false to the slow one
+   * RETURN: 0 if OK, or a negative error code
+   * NOTE: a page queued in both directions moves twice, the caller is to
+   * submit a page once per decision.
+   */
+  int submit(pid_t pid, const uint64_t *addresses, const float *scores,
+             size_t count, bool promote);
+
+  /* Forget the pages pending of a process, e.g. when it exits.
+   */
+  void drop(pid_t pid);
+
+  /* Get the count of pages pending, the batch being moved included.
+   */
+  size_t pending();
+
+  /* Get whether the slow tier is emulated.
+   */
+  bool emulated() const;
+
+  /* Get the counters since init().
+   */
+  void getStats(Stats *stats);
+
+  MigrationEngine(const MigrationEngine &) = delete;
+  MigrationEngine &operator=(const MigrationEngine &) = delete;
+
+private:
+  struct Move {
+    pid_t pid;         // the process
+    uint64_t address;  // page-aligned virtual address
+    float priority;    // the score, negated for demotions
+    unsigned retries;  // busy retries so far
+    uint64_t not_before; // ms of a monotonic clock to retry at, 0 if new
+
+    bool operator<(const Move &other) const {
+      return priority < other.priority;
+    }
+  };
+
+  typedef std::priority_queue<Move> Queue;
+
+  void run();
+
+  size_t take(Queue *queue, std::vector<Move> *moves);
+
+  void issue(std::vector<Move> &moves, bool promote);
+
+  int moveBatch(pid_t pid, std::vector<void *> &pages, int node,
+                std::vector<int> &status);
+
+  int emulateBatch(pid_t pid, std::vector<void *> &pages, int node,
+                   std::vector<int> &status);
+
+  void throttle(size_t bytes);
+
+private:
+  Config m_config;                // see Config
+  bool m_emulated;                // whether the slow tier is emulated
+  void *m_privdata;               // see init()
+  void (*m_on_batch)(void *privdata, const Batch *batch);
+  std::mutex m_lock;              // guards the members below
+  std::condition_variable m_wakeup; // signaled on submit() and deinit()
+  Queue m_promotions;             // hottest first
+  Queue m_demotions;              // coldest first
+  bool m_running;                 // whether the worker is to keep running
+  size_t m_inflight;              // pages of the batch being moved
+  bool m_promote_next;            // direction of the next batch
+  uint64_t m_next_ns;             // when the token bucket allows a batch
+  Stats m_stats;                  // see Stats
+  std::thread m_worker;           // the worker thread
+};
+
+#endif
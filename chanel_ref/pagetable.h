@@ -0,0 +1,348 @@
+#ifndef PAGETABLE_H
+#define PAGETABLE_H
+
+#include "common.h"
+
+#include <type_traits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// slots probed at once, one control byte each
+#define PAGE_TABLE_GROUP 16
+// groups moved to the new table by each insert while resizing
+#define PAGE_TABLE_MIGRATE_GROUPS 2
+
+/* Compact hotness of a page, its page frame number is the key in PageTable.
+ */
+struct PageHeat {
+  uint32_t count : 24; // accesses in the current period, saturating
+  uint32_t hot : 1;    // whether it was hot in the last period
+  uint32_t idle : 7;   // periods since the last access, saturating
+
+  void touch() {
+    if (count != 0xFFFFFF)
+      count++;
+  }
+};
+
+/* A flat open-addressing map from page frame numbers to <Value>.
+ * Slots are probed a group at a time, comparing 7 bits of hash of 16 slots
+ * with one SSE2 instruction (Swiss table style), so most lookups touch one
+ * control line and one slot line. Growing does not stop the world: a bigger
+ * table is allocated and each insert moves a few groups of the old one over,
+ * lookups check both tables meanwhile.
+ * NOTE: pointers to values are invalidated by insert() and erase().
+ */
+template <typename Value> class PageTable {
+  static_assert(std::is_trivially_copyable<Value>::value,
+                "values are moved with plain copies");
+
+public:
+  PageTable() : m_size(0), m_migrate(0) {
+    m_table = {NULL, NULL, 0, 0};
+    m_old = {NULL, NULL, 0, 0};
+  }
+
+  ~PageTable() {
+    release(m_table);
+    release(m_old);
+  }
+
+  /* Initialize the table.
+   *      capacity: the count of pages expected, it grows beyond as needed
+   * RETURN: 0 if OK, or a negative error code
+   */
+  int init(size_t capacity) {
+    if (m_table.ctrl != NULL)
+      ERROR({}, -EINVAL, false, "this PageTable has been initialized already");
+    size_t groups = 1;
+    while (groups * PAGE_TABLE_GROUP * 7 / 8 < capacity)
+      groups *= 2;
+    if (!allocate(&m_table, groups))
+      ERROR({}, -ENOMEM, false, "failed to allocate %lu groups", groups);
+    return 0;
+  }
+
+  /* Find the value of a page.
+   * RETURN: the value, or NULL if absent
+   */
+  Value *find(uint64_t pfn) {
+    if (unlikely(m_table.ctrl == NULL))
+      return NULL;
+    uint64_t hash = hashOf(pfn);
+    Slot *slot = lookup(m_table, pfn, hash);
+    if (slot == NULL && m_old.ctrl != NULL)
+      slot = lookup(m_old, pfn, hash);
+    return slot ? &slot->value : NULL;
+  }
+
+  const Value *find(uint64_t pfn) const {
+    return const_cast<PageTable *>(this)->find(pfn);
+  }
+
+  /* Find the value of a page, inserting a value-initialized one if absent.
+   * RETURN: the value, or NULL if out of memory
+   * NOTE: a table not initialized yet starts with one group.
+   */
+  Value *insert(uint64_t pfn) {
+    if (unlikely(m_table.ctrl == NULL) && init(0) < 0)
+      return NULL;
+    uint64_t hash = hashOf(pfn);
+    Slot *slot = lookup(m_table, pfn, hash);
+    if (slot == NULL && m_old.ctrl != NULL)
+      slot = lookup(m_old, pfn, hash);
+    if (slot != NULL)
+      return &slot->value;
+    if (m_old.ctrl != NULL)
+      migrate(PAGE_TABLE_MIGRATE_GROUPS);
+    if (m_table.used + 1 > limit(m_table) && !grow())
+      return NULL;
+    slot = place(m_table, pfn, hash);
+    slot->value = Value();
+    m_size++;
+    return &slot->value;
+  }
+
+  /* Remove a page.
+   * RETURN: true if it was present
+   */
+  bool erase(uint64_t pfn) {
+    if (unlikely(m_table.ctrl == NULL))
+      return false;
+    uint64_t hash = hashOf(pfn);
+    if (remove(m_table, pfn, hash) ||
+        (m_old.ctrl != NULL && remove(m_old, pfn, hash))) {
+      m_size--;
+      return true;
+    }
+    return false;
+  }
+
+  /* Visit every page, as f(uint64_t pfn, Value &value).
+   */
+  template <typename F> void forEach(F &&f) {
+    visit(m_table, f);
+    if (m_old.ctrl != NULL)
+      visit(m_old, f);
+  }
+
+  /* Remove the pages for which pred(uint64_t pfn, Value &value) is true.
+   * RETURN: the count of pages removed
+   */
+  template <typename F> size_t eraseIf(F &&pred) {
+    size_t count = 0;
+    auto sweep = [&](Table &table) {
+      for (size_t i = 0; i < slotCount(table); i++) {
+        if (isFull(table.ctrl[i]) &&
+            pred(table.slots[i].pfn, table.slots[i].value)) {
+          table.ctrl[i] = CTRL_DELETED;
+          count++;
+        }
+      }
+    };
+    sweep(m_table);
+    if (m_old.ctrl != NULL)
+      sweep(m_old);
+    m_size -= count;
+    return count;
+  }
+
+  /* Remove every page, keeping the memory.
+   */
+  void clear() {
+    if (m_old.ctrl != NULL) {
+      release(m_old);
+      m_old = {NULL, NULL, 0, 0};
+    }
+    if (m_table.ctrl != NULL)
+      memset(m_table.ctrl, CTRL_EMPTY, slotCount(m_table));
+    m_table.used = 0;
+    m_size = 0;
+  }
+
+  size_t size() const { return m_size; }
+
+  /* Get the bytes allocated for the tables.
+   */
+  size_t memory() const { return bytesOf(m_table) + bytesOf(m_old); }
+
+  PageTable(const PageTable &) = delete;
+  PageTable &operator=(const PageTable &) = delete;
+
+private:
+  // a control byte is the low 7 bits of hash of a full slot, or one of these
+  static constexpr uint8_t CTRL_EMPTY = 0x80;
+  static constexpr uint8_t CTRL_DELETED = 0xFE;
+
+  struct Slot {
+    uint64_t pfn;
+    Value value;
+  };
+
+  struct Table {
+    uint8_t *ctrl;     // a control byte for each slot
+    Slot *slots;       // the slots, in the same allocation as <ctrl>
+    size_t group_mask; // count of groups - 1
+    size_t used;       // full and deleted slots
+  };
+
+  static uint64_t hashOf(uint64_t pfn) {
+    uint64_t hash = pfn * 0x9E3779B97F4A7C15UL;
+    return hash ^ (hash >> 29);
+  }
+
+  static uint8_t tagOf(uint64_t hash) { return hash >> 57; }
+
+  static bool isFull(uint8_t ctrl) { return (ctrl & 0x80) == 0; }
+
+  static size_t slotCount(const Table &table) {
+    return table.ctrl ? (table.group_mask + 1) * PAGE_TABLE_GROUP : 0;
+  }
+
+  // at most 7/8 of slots are used, so probing always finds an empty one
+  static size_t limit(const Table &table) { return slotCount(table) / 8 * 7; }
+
+  static size_t bytesOf(const Table &table) {
+    return (slotCount(table) * (1 + sizeof(Slot)) + 63) / 64 * 64;
+  }
+
+  // bit i is set if control byte i of the group is <tag>
+  static uint32_t match(const uint8_t *ctrl, uint8_t tag) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+#else
+    uint32_t bits = 0;
+    for (int i = 0; i < PAGE_TABLE_GROUP; i++)
+      bits |= (uint32_t)(ctrl[i] == tag) << i;
+    return bits;
+#endif
+  }
+
+  // bit i is set if control byte i of the group is empty or deleted
+  static uint32_t matchFree(const uint8_t *ctrl) {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+#else
+    uint32_t bits = 0;
+    for (int i = 0; i < PAGE_TABLE_GROUP; i++)
+      bits |= (uint32_t)!isFull(ctrl[i]) << i;
+    return bits;
+#endif
+  }
+
+  static bool allocate(Table *table, size_t groups) {
+    size_t slots = groups * PAGE_TABLE_GROUP;
+    // <ctrl> first, then the slots, cache line aligned
+    size_t bytes = (slots * (1 + sizeof(Slot)) + 63) / 64 * 64;
+    void *memory = aligned_alloc(64, bytes);
+    if (memory == NULL)
+      return false;
+    table->ctrl = (uint8_t *)memory;
+    table->slots = (Slot *)(table->ctrl + slots);
+    table->group_mask = groups - 1;
+    table->used = 0;
+    memset(table->ctrl, CTRL_EMPTY, slots);
+    return true;
+  }
+
+  static void release(Table &table) { free(table.ctrl); }
+
+  static Slot *lookup(const Table &table, uint64_t pfn, uint64_t hash) {
+    uint8_t tag = tagOf(hash);
+    size_t group = hash & table.group_mask;
+    // triangular probing visits every group of a power of 2 table
+    for (size_t step = 1;; step++) {
+      const uint8_t *ctrl = table.ctrl + group * PAGE_TABLE_GROUP;
+      for (uint32_t bits = match(ctrl, tag); bits != 0; bits &= bits - 1) {
+        Slot *slot = table.slots + group * PAGE_TABLE_GROUP + __builtin_ctz(bits);
+        if (likely(slot->pfn == pfn))
+          return slot;
+      }
+      if (likely(match(ctrl, CTRL_EMPTY) != 0))
+        return NULL;
+      group = (group + step) & table.group_mask;
+    }
+  }
+
+  // take a free slot for <pfn>, which must be absent
+  static Slot *place(Table &table, uint64_t pfn, uint64_t hash) {
+    size_t group = hash & table.group_mask;
+    for (size_t step = 1;; step++) {
+      uint8_t *ctrl = table.ctrl + group * PAGE_TABLE_GROUP;
+      uint32_t bits = matchFree(ctrl);
+      if (likely(bits != 0)) {
+        int i = __builtin_ctz(bits);
+        if (ctrl[i] == CTRL_EMPTY)
+          table.used++;
+        ctrl[i] = tagOf(hash);
+        Slot *slot = table.slots + group * PAGE_TABLE_GROUP + i;
+        slot->pfn = pfn;
+        return slot;
+      }
+      group = (group + step) & table.group_mask;
+    }
+  }
+
+  static bool remove(Table &table, uint64_t pfn, uint64_t hash) {
+    Slot *slot = lookup(table, pfn, hash);
+    if (slot == NULL)
+      return false;
+    // a tombstone, probes for other pages may go through this slot
+    table.ctrl[slot - table.slots] = CTRL_DELETED;
+    return true;
+  }
+
+  template <typename F> static void visit(Table &table, F &f) {
+    for (size_t i = 0; i < slotCount(table); i++)
+      if (isFull(table.ctrl[i]))
+        f(table.slots[i].pfn, table.slots[i].value);
+  }
+
+  // move <groups> groups of the old table to the new one
+  void migrate(size_t groups) {
+    for (; groups > 0 && m_migrate <= m_old.group_mask; groups--, m_migrate++) {
+      uint8_t *ctrl = m_old.ctrl + m_migrate * PAGE_TABLE_GROUP;
+      Slot *slots = m_old.slots + m_migrate * PAGE_TABLE_GROUP;
+      for (int i = 0; i < PAGE_TABLE_GROUP; i++) {
+        if (!isFull(ctrl[i]))
+          continue;
+        Slot *slot = place(m_table, slots[i].pfn, hashOf(slots[i].pfn));
+        slot->value = slots[i].value;
+        // not empty, probes for pages not moved yet may go through it
+        ctrl[i] = CTRL_DELETED;
+      }
+    }
+    if (m_migrate > m_old.group_mask) {
+      release(m_old);
+      m_old = {NULL, NULL, 0, 0};
+    }
+  }
+
+  // start moving to a new table, of the same size if it is mostly tombstones
+  bool grow() {
+    if (m_old.ctrl != NULL)
+      migrate(m_old.group_mask + 1);
+    size_t groups = m_table.group_mask + 1;
+    if (m_size >= limit(m_table) / 2)
+      groups *= 2;
+    Table table;
+    if (!allocate(&table, groups))
+      ERROR({}, false, false, "failed to allocate %lu groups", groups);
+    m_old = m_table;
+    m_table = table;
+    m_migrate = 0;
+    // the caller is inserting, make room for it right away
+    migrate(PAGE_TABLE_MIGRATE_GROUPS);
+    return true;
+  }
+
+private:
+  Table m_table;    // the table new pages go to
+  Table m_old;      // the table being moved to <m_table>, or all NULL
+  size_t m_size;    // count of pages in both tables
+  size_t m_migrate; // next group of <m_old> to move
+};
+
+#endif
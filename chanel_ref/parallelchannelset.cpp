@@ -0,0 +1,399 @@
+#include "parallelchannelset.h"
+
+#include "topology.h"
+
+#include <algorithm>
+#include <map>
+#include <sched.h>
+
+// how long a reader blocks in epoll_wait() while holding its shard
+#define READER_POLL_MS 10
+// capacity of the queues between a reader and the consumers, in batches
+#define QUEUE_CAPACITY 64
+// how long an idle consumer sleeps before looking for batches again
+#define CONSUMER_IDLE_US 100
+
+// restrict the calling thread to <cpus>
+static void pin_to(const std::set<int> &cpus) {
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  for (int cpu : cpus)
+    CPU_SET(cpu, &mask);
+  // not fatal, the thread just runs anywhere
+  sched_setaffinity(0, sizeof(mask), &mask);
+}
+
+ParallelChannelSet::ParallelChannelSet() {
+  m_shards = NULL;
+  m_shard_count = 0;
+  m_reading = false;
+  m_running = false;
+}
+
+ParallelChannelSet::~ParallelChannelSet() { deinit(); }
+
+int ParallelChannelSet::init(std::set<Channel::Type> &types,
+                             const Channel::Options &options,
+                             ChannelSet::Mode mode, size_t shards) {
+  if (m_shards != NULL)
+    ERROR({}, -EINVAL, false,
+          "this ParallelChannelSet has been initialized already");
+  Topology topology;
+  int ret = topology.init();
+  if (ret < 0)
+    ERROR({}, ret, false, "topology.init() failed");
+  // online cpus in node order, so that contiguous groups stay within a node
+  std::vector<int> cpus = topology.getCpus();
+  std::stable_sort(cpus.begin(), cpus.end(), [&](int a, int b) {
+    return topology.getNode(a) < topology.getNode(b);
+  });
+  if (shards == 0)
+    shards = topology.getNodeCount();
+  shards = std::min(shards, cpus.size());
+  m_shards = new Shard[shards];
+  m_shard_count = shards;
+  m_mode = mode;
+  for (size_t i = 0; i < shards; i++) {
+    Shard *shard = m_shards + i;
+    shard->owner = this;
+    shard->waiters = 0;
+    shard->consuming.clear();
+    shard->batch = NULL;
+    shard->error = 0;
+    shard->samples = 0;
+    shard->batches = 0;
+    shard->stolen = 0;
+    shard->dropped = 0;
+    shard->cpus.insert(cpus.begin() + i * cpus.size() / shards,
+                       cpus.begin() + (i + 1) * cpus.size() / shards);
+    ret = shard->full.init(QUEUE_CAPACITY);
+    if (ret == 0)
+      ret = shard->free.init(QUEUE_CAPACITY);
+    if (ret == 0)
+      ret = shard->set.init(types, options, mode, &shard->cpus);
+    if (ret < 0)
+      ERROR(deinit(), ret, false, "failed to initialize shards[%lu]", i);
+  }
+  return 0;
+}
+
+void ParallelChannelSet::deinit() {
+  if (m_shards == NULL)
+    return;
+  stop();
+  for (size_t i = 0; i < m_shard_count; i++) {
+    Shard *shard = m_shards + i;
+    shard->set.deinit();
+    Batch *batch;
+    while (shard->full.pop(&batch))
+      delete batch;
+    while (shard->free.pop(&batch))
+      delete batch;
+    delete shard->batch;
+  }
+  delete[] m_shards;
+  m_shards = NULL;
+  m_shard_count = 0;
+}
+
+ParallelChannelSet::Shard *ParallelChannelSet::shardOf(pid_t pid) {
+  return m_shards + (size_t)pid % m_shard_count;
+}
+
+// lock a shard against its reader, which yields to waiting callers
+#define LOCK_SHARD(shard)                                                      \
+  (shard)->waiters++;                                                          \
+  std::lock_guard<std::mutex> _guard((shard)->lock);                           \
+  (shard)->waiters--
+
+int ParallelChannelSet::add(pid_t pid) {
+  if (m_shards == NULL)
+    ERROR({}, -EINVAL, false,
+          "this ParallelChannelSet has not been initialized yet");
+  if (m_mode == ChannelSet::MODE_PER_PROCESS) {
+    Shard *shard = shardOf(pid);
+    LOCK_SHARD(shard);
+    return shard->set.add(pid);
+  }
+  // every cpu-wide shard may see samples of <pid>
+  for (size_t i = 0; i < m_shard_count; i++) {
+    Shard *shard = m_shards + i;
+    LOCK_SHARD(shard);
+    // a reused pid must not be dropped for the exit of its previous process
+    removeExits(shard);
+    int ret = shard->set.add(pid);
+    if (ret < 0)
+      ERROR({}, ret, false, "shards[%lu].set.add(%d) failed", i, pid);
+  }
+  return 0;
+}
+
+int ParallelChannelSet::remove(pid_t pid) {
+  if (m_shards == NULL)
+    ERROR({}, -EINVAL, false,
+          "this ParallelChannelSet has not been initialized yet");
+  if (m_mode == ChannelSet::MODE_PER_PROCESS) {
+    Shard *shard = shardOf(pid);
+    LOCK_SHARD(shard);
+    return shard->set.remove(pid);
+  }
+  for (size_t i = 0; i < m_shard_count; i++) {
+    Shard *shard = m_shards + i;
+    LOCK_SHARD(shard);
+    int ret = shard->set.remove(pid);
+    if (ret < 0)
+      ERROR({}, ret, false, "shards[%lu].set.remove(%d) failed", i, pid);
+  }
+  return 0;
+}
+
+int ParallelChannelSet::update(std::set<pid_t> &pids) {
+  if (m_shards == NULL)
+    ERROR({}, -EINVAL, false,
+          "this ParallelChannelSet has not been initialized yet");
+  for (size_t i = 0; i < m_shard_count; i++) {
+    Shard *shard = m_shards + i;
+    std::set<pid_t> subset;
+    if (m_mode == ChannelSet::MODE_PER_PROCESS) {
+      for (pid_t pid : pids)
+        if (shardOf(pid) == shard)
+          subset.insert(pid);
+    } else {
+      subset = pids;
+    }
+    LOCK_SHARD(shard);
+    int ret = shard->set.update(subset);
+    if (ret < 0)
+      ERROR({}, ret, false, "shards[%lu].set.update(...) failed", i);
+  }
+  return 0;
+}
+
+int ParallelChannelSet::setPeriod(unsigned long period) {
+  if (m_shards == NULL)
+    ERROR({}, -EINVAL, false,
+          "this ParallelChannelSet has not been initialized yet");
+  for (size_t i = 0; i < m_shard_count; i++) {
+    Shard *shard = m_shards + i;
+    LOCK_SHARD(shard);
+    int ret = shard->set.setPeriod(period);
+    if (ret < 0)
+      ERROR({}, ret, false, "shards[%lu].set.setPeriod(%lu) failed", i,
+            period);
+  }
+  return 0;
+}
+
+int ParallelChannelSet::start(
+    size_t consumers, void *privdata,
+    void (*on_batch)(void *privdata, const Channel::Sample *samples,
+                     size_t count),
+    void (*on_exit)(void *privdata, pid_t pid)) {
+  if (m_shards == NULL)
+    ERROR({}, -EINVAL, false,
+          "this ParallelChannelSet has not been initialized yet");
+  if (m_running)
+    ERROR({}, -EINVAL, false, "this ParallelChannelSet has started already");
+  if (on_batch == NULL)
+    ERROR({}, -EINVAL, false, "param <on_batch> is NULL");
+  if (consumers == 0)
+    consumers = m_shard_count;
+  m_privdata = privdata;
+  m_on_batch = on_batch;
+  m_on_exit = on_exit;
+  m_reading = true;
+  m_running = true;
+  for (size_t i = 0; i < m_shard_count; i++)
+    m_shards[i].error = 0;
+  for (size_t i = 0; i < m_shard_count; i++)
+    m_shards[i].reader =
+        std::thread(&ParallelChannelSet::runReader, this, m_shards + i);
+  for (size_t i = 0; i < consumers; i++)
+    m_consumers.emplace_back(&ParallelChannelSet::runConsumer, this, i);
+  return 0;
+}
+
+int ParallelChannelSet::stop() {
+  if (!m_running)
+    return 0;
+  // readers first, they flush their last batch before leaving
+  m_reading = false;
+  for (size_t i = 0; i < m_shard_count; i++)
+    m_shards[i].reader.join();
+  // then consumers, they drain the queues before leaving
+  m_running = false;
+  for (auto &consumer : m_consumers)
+    consumer.join();
+  m_consumers.clear();
+  int ret = getError();
+  if (ret < 0)
+    ERROR({}, ret, false, "a reader stopped on an error");
+  return 0;
+}
+
+int ParallelChannelSet::getError() {
+  for (size_t i = 0; i < m_shard_count; i++) {
+    int error = m_shards[i].error.load();
+    if (error < 0)
+      return error;
+  }
+  return 0;
+}
+
+bool ParallelChannelSet::contains(pid_t pid) {
+  for (size_t i = 0; i < m_shard_count; i++) {
+    Shard *shard = m_shards + i;
+    LOCK_SHARD(shard);
+    removeExits(shard);
+    RingBuffer::Stats stats;
+    if (shard->set.getStats(pid, &stats) == 0)
+      return true;
+  }
+  return false;
+}
+
+void ParallelChannelSet::getStats(Stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  for (size_t i = 0; i < m_shard_count; i++) {
+    Shard *shard = m_shards + i;
+    stats->samples += shard->samples;
+    stats->batches += shard->batches;
+    stats->stolen += shard->stolen;
+    stats->dropped += shard->dropped;
+  }
+}
+
+int ParallelChannelSet::runReader(Shard *shard) {
+  pin_to(shard->cpus);
+  while (m_reading.load(std::memory_order_relaxed)) {
+    while (shard->waiters.load(std::memory_order_relaxed) > 0)
+      sched_yield();
+    {
+      std::lock_guard<std::mutex> lock(shard->lock);
+      removeExits(shard);
+      // samples are decoded straight into the batch of the shard
+      ssize_t ret = shard->set.pollSamples(
+          READER_POLL_MS,
+          [shard](const Channel::Sample &sample) { append(shard, sample); },
+          [shard](pid_t pid) { onExit(shard, pid); });
+      // a signal delivered to this thread is no reason to stop reading
+      if (ret == -EINTR)
+        continue;
+      // keep the error for stop() and getError(), the reader cannot go on
+      if (ret < 0)
+        ERROR(
+            {
+              shard->error = (int)ret;
+              flush(shard);
+            },
+            (int)ret, false, "shard->set.pollSamples(%d, ...) failed",
+            READER_POLL_MS);
+    }
+    // hand out what we have, so a quiet shard does not hold samples back
+    flush(shard);
+  }
+  return 0;
+}
+
+void ParallelChannelSet::append(Shard *shard, const Channel::Sample &sample) {
+  Batch *batch = shard->batch;
+  if (unlikely(batch == NULL)) {
+    if (!shard->free.pop(&batch))
+      batch = new Batch;
+    batch->count = 0;
+    shard->batch = batch;
+  }
+  batch->samples[batch->count++] = sample;
+  if (batch->count == PARALLEL_BATCH_SIZE)
+    shard->owner->flush(shard);
+}
+
+void ParallelChannelSet::onExit(void *privdata, pid_t pid) {
+  auto *shard = (Shard *)privdata;
+  ParallelChannelSet *self = shard->owner;
+  // the exit is only seen on the cpu it happened on, the other shards drop
+  // <pid> at their next poll; their locks may be held by their readers
+  if (self->m_mode == ChannelSet::MODE_PER_CPU) {
+    for (size_t i = 0; i < self->m_shard_count; i++) {
+      Shard *other = self->m_shards + i;
+      if (other == shard)
+        continue;
+      std::lock_guard<std::mutex> lock(other->exits_lock);
+      other->exits.push_back(pid);
+    }
+  }
+  if (self->m_on_exit)
+    self->m_on_exit(self->m_privdata, pid);
+}
+
+// Called with <shard->lock> held.
+void ParallelChannelSet::removeExits(Shard *shard) {
+  std::vector<pid_t> exits;
+  {
+    std::lock_guard<std::mutex> lock(shard->exits_lock);
+    if (shard->exits.empty())
+      return;
+    exits.swap(shard->exits);
+  }
+  for (pid_t pid : exits)
+    shard->set.remove(pid);
+}
+
+void ParallelChannelSet::flush(Shard *shard) {
+  Batch *batch = shard->batch;
+  if (batch == NULL || batch->count == 0)
+    return;
+  if (shard->full.push(batch)) {
+    shard->batch = NULL;
+    return;
+  }
+  // consumers fell behind, drop the batch rather than stall the ring buffers
+  shard->dropped += batch->count;
+  batch->count = 0;
+}
+
+bool ParallelChannelSet::consume(Shard *shard, bool stolen) {
+  // only one consumer at a time uses the consumer side of the queues
+  if (shard->consuming.test_and_set(std::memory_order_acquire))
+    return false;
+  Batch *batch;
+  bool available = shard->full.pop(&batch);
+  shard->consuming.clear(std::memory_order_release);
+  if (!available)
+    return false;
+  m_on_batch(m_privdata, batch->samples, batch->count);
+  shard->samples += batch->count;
+  shard->batches++;
+  if (stolen)
+    shard->stolen++;
+  // give the batch back to the reader
+  while (shard->consuming.test_and_set(std::memory_order_acquire))
+    sched_yield();
+  if (!shard->free.push(batch))
+    delete batch;
+  shard->consuming.clear(std::memory_order_release);
+  return true;
+}
+
+void ParallelChannelSet::runConsumer(size_t index) {
+  Shard *home = m_shards + index % m_shard_count;
+  pin_to(home->cpus);
+  while (true) {
+    bool consumed = consume(home, false);
+    // our shard is idle, help the others
+    for (size_t i = 1; !consumed && i < m_shard_count; i++)
+      consumed = consume(m_shards + (index + i) % m_shard_count, true);
+    if (consumed)
+      continue;
+    // readers have stopped and every queue is empty
+    if (!m_running.load(std::memory_order_acquire)) {
+      bool empty = true;
+      for (size_t i = 0; i < m_shard_count; i++)
+        empty = empty && m_shards[i].full.empty();
+      if (empty)
+        break;
+      continue;
+    }
+    usleep(CONSUMER_IDLE_US);
+  }
+}
@@ -0,0 +1,165 @@
+#ifndef PARALLELCHANNELSET_H
+#define PARALLELCHANNELSET_H
+
+#include "common.h"
+#include "channelset.h"
+#include "spscqueue.h"
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#define PARALLEL_BATCH_SIZE 256
+
+/* A ChannelSet sharded over several reader threads.
+ * Each shard is a ChannelSet with its own epoll instance, polled by a reader
+ * thread pinned to the cpus the shard serves. Readers hand decoded batches to
+ * consumer threads through lock-free SPSC queues. A consumer prefers its own
+ * shard, and steals batches of other shards when its own is idle.
+ */
+class ParallelChannelSet
+{
+public:
+
+    struct Batch
+    {
+        size_t count;                                   // count of valid samples
+        Channel::Sample samples[PARALLEL_BATCH_SIZE];   // the samples
+    };
+
+    struct Stats
+    {
+        uint64_t samples;   // samples handed to consumers
+        uint64_t batches;   // batches handed to consumers
+        uint64_t stolen;    // batches consumed by a consumer of another shard
+        uint64_t dropped;   // samples dropped because consumers fell behind
+    };
+
+    ParallelChannelSet();
+
+    ~ParallelChannelSet();
+
+    /* Initialize the ParallelChannelSet.
+     *      types: set of Channel::Type to sample
+     *      options: size of ring buffer and wakeup policy of every Channel
+     *      mode: whether to open Channels for each process or for each cpu
+     *      shards: count of shards (and reader threads), 0 for one per NUMA node
+     * RETURN: 0 if ok, or a negative error code
+     * NOTE: online cpus are split into <shards> contiguous groups, in node order, so a
+     *      group does not span nodes unless there are fewer shards than nodes. With
+     *      MODE_PER_CPU a shard samples the cpus of its group, with MODE_PER_PROCESS a
+     *      process goes to the shard of (pid % shards). Either way, the reader of a
+     *      shard runs on the cpus of its group.
+     */
+    int init(std::set<Channel::Type>& types, const Channel::Options& options,
+        ChannelSet::Mode mode, size_t shards);
+
+    /* Uninitialize the ParallelChannelSet, stopping the threads if started.
+     */
+    void deinit();
+
+    /* Same as ChannelSet::add(), callable while started.
+     */
+    int add(pid_t pid);
+
+    /* Same as ChannelSet::remove(), callable while started.
+     */
+    int remove(pid_t pid);
+
+    /* Same as ChannelSet::update(), callable while started.
+     */
+    int update(std::set<pid_t>& pids);
+
+    /* Same as ChannelSet::setPeriod(), callable while started.
+     */
+    int setPeriod(unsigned long period);
+
+    /* Start the reader and consumer threads.
+     *      consumers: count of consumer threads, 0 for one per shard
+     *      privdata: the user-defined argument passed to the callbacks
+     *      on_batch: called on a consumer thread with each batch of samples
+     *      on_exit: called on a reader thread with each exited process
+     * RETURN: 0 if ok, or a negative error code
+     * NOTE: callbacks run concurrently on several threads, and two batches of the same
+     *      shard may be handled concurrently by different consumers.
+     */
+    int start(size_t consumers, void* privdata,
+        void (*on_batch)(void* privdata, const Channel::Sample* samples, size_t count),
+        void (*on_exit)(void* privdata, pid_t pid));
+
+    /* Stop the threads, consuming the batches already read.
+     * RETURN: 0 if ok, or the error a reader stopped on, see getError()
+     */
+    int stop();
+
+    /* Get the error a reader stopped on while started, its shard is no longer read.
+     * RETURN: 0 if every reader is running, or the negative error code of the first
+     *      reader that failed
+     */
+    int getError();
+
+    /* Get the counters summed over shards.
+     */
+    void getStats(Stats* stats);
+
+    /* Check whether a process is still sampled by any shard.
+     * RETURN: true if it is
+     * NOTE: with MODE_PER_CPU, a process that exited is dropped by the shard of the cpu
+     *      it exited on at once, and by the other shards at their next poll.
+     */
+    bool contains(pid_t pid);
+
+private:
+
+    struct Shard
+    {
+        ParallelChannelSet* owner;      // the ParallelChannelSet of this shard
+        ChannelSet set;                 // Channels of this shard
+        std::mutex lock;                // serializes <set> between reader and callers
+        std::atomic<int> waiters;       // callers waiting for <lock>, the reader yields to them
+        std::set<int> cpus;             // cpus served by this shard, the reader runs on them
+        SpscQueue<Batch*> full;         // batches from reader to consumers
+        SpscQueue<Batch*> free;         // batches from consumers back to reader
+        std::atomic_flag consuming;     // held by the consumer using <full> and <free>
+        Batch* batch;                   // batch being filled by the reader
+        std::thread reader;             // the reader thread
+        std::atomic<int> error;         // error the reader stopped on, or 0
+        std::mutex exits_lock;          // guards <exits>, taken apart from <lock>
+        std::vector<pid_t> exits;       // exited on other shards, removed at the next poll
+        std::atomic<uint64_t> samples;  // see Stats
+        std::atomic<uint64_t> batches;
+        std::atomic<uint64_t> stolen;
+        std::atomic<uint64_t> dropped;
+    };
+
+    Shard* shardOf(pid_t pid);
+
+    int runReader(Shard* shard);
+
+    void runConsumer(size_t index);
+
+    static void append(Shard* shard, const Channel::Sample& sample);
+
+    static void onExit(void* privdata, pid_t pid);
+
+    void flush(Shard* shard);
+
+    void removeExits(Shard* shard);
+
+    bool consume(Shard* shard, bool stolen);
+
+private:
+    Shard* m_shards;                    // the shards
+    size_t m_shard_count;               // count of shards
+    ChannelSet::Mode m_mode;            // Channels for each process or for each cpu
+    std::vector<std::thread> m_consumers; // the consumer threads
+    std::atomic<bool> m_reading;        // whether the readers should keep running
+    std::atomic<bool> m_running;        // whether the consumers should keep running
+    void* m_privdata;                   // see start()
+    void (*m_on_batch)(void* privdata, const Channel::Sample* samples, size_t count);
+    void (*m_on_exit)(void* privdata, pid_t pid);
+};
+
+#endif
@@ -0,0 +1,89 @@
+#include "periodcontroller.h"
+
+#include <time.h>
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+PeriodController::PeriodController() {}
+
+int PeriodController::init(const Config &config) {
+  if (config.target_rate < 0 || config.overhead_budget < 0)
+    ERROR({}, -EINVAL, false, "negative target");
+  if (config.target_rate == 0 && config.overhead_budget == 0)
+    ERROR({}, -EINVAL, false, "neither target_rate nor overhead_budget");
+  if (config.overhead_budget > 0 && config.sample_cost_ns <= 0)
+    ERROR({}, -EINVAL, false, "sample_cost_ns must be positive");
+  if (config.min_period == 0 || config.min_period > config.max_period)
+    ERROR({}, -EINVAL, false, "invalid period range [%lu, %lu]",
+          config.min_period, config.max_period);
+  if (config.max_step <= 1 || config.dead_band < 0)
+    ERROR({}, -EINVAL, false, "invalid max_step %f or dead_band %f",
+          config.max_step, config.dead_band);
+  m_config = config;
+  m_states.clear();
+  return 0;
+}
+
+double PeriodController::getTargetRate(size_t channels) {
+  double rate = m_config.target_rate;
+  if (m_config.overhead_budget > 0 && channels > 0) {
+    double budget = m_config.overhead_budget * 1e9 / m_config.sample_cost_ns /
+                    (double)channels;
+    if (rate == 0 || budget < rate)
+      rate = budget;
+  }
+  return rate;
+}
+
+int PeriodController::control(Channel *channel, size_t channels) {
+  unsigned long period = channel->getPeriod();
+  if (period == 0)
+    return 0;
+  const RingBuffer::Stats &stats = channel->getStats();
+  uint64_t now = now_ns();
+  auto it = m_states.find(channel);
+  if (it == m_states.end()) {
+    m_states[channel] = {now, stats.records, stats.lost, stats.throttles};
+    return 0;
+  }
+  State &state = it->second;
+  double elapsed = (now - state.time) / 1e9;
+  if (elapsed <= 0)
+    return 0;
+  // what the event produced at this period, including what the kernel dropped
+  double rate = (stats.records - state.records + stats.lost - state.lost) /
+                elapsed;
+  bool throttled = stats.throttles != state.throttles;
+  state = {now, stats.records, stats.lost, stats.throttles};
+  double target = getTargetRate(channels);
+  double factor;
+  if (target == 0)
+    factor = throttled ? 2 : 1;
+  else
+    factor = rate / target;
+  if (throttled && factor < 2)
+    factor = 2;
+  if (factor > 1 - m_config.dead_band && factor < 1 + m_config.dead_band)
+    return 0;
+  if (factor > m_config.max_step)
+    factor = m_config.max_step;
+  if (factor < 1 / m_config.max_step)
+    factor = 1 / m_config.max_step;
+  double next = period * factor;
+  if (next < m_config.min_period)
+    next = m_config.min_period;
+  if (next > m_config.max_period)
+    next = m_config.max_period;
+  if ((unsigned long)next == period)
+    return 0;
+  int ret = channel->setPeriod((unsigned long)next);
+  if (ret < 0)
+    ERROR({}, ret, false, "channel->setPeriod(%lu) failed", (unsigned long)next);
+  return 0;
+}
+
+void PeriodController::forget(Channel *channel) { m_states.erase(channel); }
@@ -0,0 +1,68 @@
+#ifndef PERIODCONTROLLER_H
+#define PERIODCONTROLLER_H
+
+#include "common.h"
+#include "channel.h"
+
+#include <unordered_map>
+
+/* Closed-loop controller of the sample period of Channels.
+ * Every call to control() compares what a Channel produced since the last
+ * call with the target rate and scales its period by the ratio, within
+ * [1 / max_step, max_step] and a dead band. Lost records count as produced
+ * samples, and any throttling doubles the period at least, since both mean
+ * the kernel could not keep up with the current period.
+ */
+class PeriodController {
+public:
+  struct Config {
+    double target_rate = 1000;       // samples per second per Channel, 0 for no limit
+    double overhead_budget = 0;      // fraction of one cpu for all Channels, 0 for no limit
+    double sample_cost_ns = 2000;    // estimated cpu time spent on one sample
+    unsigned long min_period = 1000; // the smallest period to use
+    unsigned long max_period = 100000000; // the largest period to use
+    double max_step = 4;             // max factor to change the period by at once
+    double dead_band = 0.1;          // relative error left uncorrected
+  };
+
+  PeriodController();
+
+  /* Initialize the controller.
+   *      config: the targets and the limits
+   * RETURN: 0 if OK, or a negative error code
+   * NOTE: with both target_rate and overhead_budget, the lower rate wins.
+   */
+  int init(const Config &config);
+
+  /* Adjust the period of a Channel from what it did since the last call.
+   *      channel:  the Channel, its period is changed through setPeriod()
+   *      channels: count of Channels sharing <overhead_budget>
+   * RETURN: 0 if OK, or a negative error code
+   * NOTE: the first call for a Channel only takes a snapshot. Disabled
+   * Channels (period 0) are left alone.
+   */
+  int control(Channel *channel, size_t channels);
+
+  /* Drop the state of a Channel, call it before the Channel is unbound.
+   */
+  void forget(Channel *channel);
+
+  /* Get the sample rate the controller aims at for each Channel.
+   *      channels: count of Channels sharing <overhead_budget>
+   * RETURN: samples per second, or 0 for no limit.
+   */
+  double getTargetRate(size_t channels);
+
+private:
+  struct State {
+    uint64_t time;        // when the snapshot was taken, in ns
+    uint64_t records;     // RingBuffer::Stats::records at that time
+    uint64_t lost;        // RingBuffer::Stats::lost at that time
+    uint64_t throttles;   // RingBuffer::Stats::throttles at that time
+  };
+
+  Config m_config;                             // targets and limits
+  std::unordered_map<Channel *, State> m_states; // snapshot of each Channel
+};
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef PIDFILTER_H
+#define PIDFILTER_H
+
+#include "common.h"
+
+#include <atomic>
+#include <mutex>
+#include <sched.h>
+#include <set>
+#include <sys/types.h>
+
+/* A set of pids that is read on the sample path and written rarely.
+ * Readers never lock: they look up an immutable open-addressing table that
+ * writers publish with an atomic store (RCU style). A replaced table is freed
+ * only after every reader that might still see it has left its read-side
+ * section, tracked by two alternating reader counters (SRCU style).
+ */
+class PidFilter {
+  struct Table {
+    uint32_t mask;    // capacity - 1, capacity is a power of 2
+    pid_t slots[];    // 0 marks an empty slot
+  };
+
+public:
+  /* A read-side section, keep it short (e.g. one batch of samples).
+   */
+  class Reader {
+  public:
+    explicit Reader(const PidFilter &filter) : m_filter(filter) {
+      m_index = filter.m_epoch.load() & 1;
+      filter.m_readers[m_index].value.fetch_add(1);
+      m_table = filter.m_table.load();
+    }
+
+    ~Reader() { m_filter.m_readers[m_index].value.fetch_sub(1); }
+
+    /* Check whether <pid> is in the snapshot taken by this Reader.
+     */
+    bool contains(pid_t pid) const {
+      const Table *table = m_table;
+      uint32_t i = hash(pid) & table->mask;
+      while (true) {
+        pid_t slot = table->slots[i];
+        if (slot == pid)
+          return true;
+        if (slot == 0)
+          return false;
+        i = (i + 1) & table->mask;
+      }
+    }
+
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
+
+  private:
+    const PidFilter &m_filter;
+    const Table *m_table;
+    unsigned m_index;
+  };
+
+  PidFilter() : m_epoch(0) {
+    m_table.store(build());
+    m_readers[0].value = 0;
+    m_readers[1].value = 0;
+  }
+
+  ~PidFilter() { free(m_table.load()); }
+
+  /* Add a pid to the set.
+   * RETURN: 0 if ok (either newly added or already existed), or a negative
+   * error code
+   */
+  int insert(pid_t pid) {
+    if (pid <= 0)
+      ERROR({}, -EINVAL, false, "invalid pid %d", pid);
+    std::lock_guard<std::mutex> lock(m_write_lock);
+    if (!m_pids.insert(pid).second)
+      return 0;
+    return publish();
+  }
+
+  /* Remove a pid from the set.
+   * RETURN: 0 if ok (either actually removed or never existed), or a
+   * negative error code
+   */
+  int erase(pid_t pid) {
+    std::lock_guard<std::mutex> lock(m_write_lock);
+    if (m_pids.erase(pid) == 0)
+      return 0;
+    return publish();
+  }
+
+  /* Replace the whole set.
+   * RETURN: 0 if ok, or a negative error code
+   */
+  int assign(const std::set<pid_t> &pids) {
+    if (!pids.empty() && *pids.begin() <= 0)
+      ERROR({}, -EINVAL, false, "invalid pid %d", *pids.begin());
+    std::lock_guard<std::mutex> lock(m_write_lock);
+    m_pids = pids;
+    return publish();
+  }
+
+  /* Check whether <pid> is in the set, a Reader for a single lookup.
+   */
+  bool contains(pid_t pid) const { return Reader(*this).contains(pid); }
+
+  size_t size() {
+    std::lock_guard<std::mutex> lock(m_write_lock);
+    return m_pids.size();
+  }
+
+  PidFilter(const PidFilter &) = delete;
+  PidFilter &operator=(const PidFilter &) = delete;
+
+private:
+  static uint32_t hash(pid_t pid) { return (uint32_t)pid * 0x9E3779B1U; }
+
+  // build a table of m_pids, at most half full
+  Table *build() {
+    size_t capacity = 16;
+    while (capacity < m_pids.size() * 2)
+      capacity *= 2;
+    auto *table =
+        (Table *)calloc(1, sizeof(Table) + capacity * sizeof(pid_t));
+    if (table == NULL)
+      return NULL;
+    table->mask = capacity - 1;
+    for (pid_t pid : m_pids) {
+      uint32_t i = hash(pid) & table->mask;
+      while (table->slots[i] != 0)
+        i = (i + 1) & table->mask;
+      table->slots[i] = pid;
+    }
+    return table;
+  }
+
+  // publish a new table and free the old one after a grace period
+  int publish() {
+    Table *table = build();
+    if (table == NULL)
+      ERROR({}, -ENOMEM, false, "failed to allocate a table of %lu pids",
+            m_pids.size());
+    Table *old = m_table.exchange(table);
+    // a reader holding <old> registered itself on either counter before we
+    // published, flip the epoch twice and wait for both to drain
+    for (int i = 0; i < 2; i++) {
+      unsigned index = m_epoch.fetch_xor(1) & 1;
+      while (m_readers[index].value.load() != 0)
+        sched_yield();
+    }
+    free(old);
+    return 0;
+  }
+
+private:
+  struct alignas(64) Counter {
+    std::atomic<long> value;
+  };
+
+  std::atomic<Table *> m_table;     // the published table
+  mutable std::atomic<unsigned> m_epoch; // selects the counter of new readers
+  mutable Counter m_readers[2];     // readers in their read-side sections
+  std::mutex m_write_lock;          // serializes writers
+  std::set<pid_t> m_pids;           // the master copy, owned by writers
+};
+
+#endif
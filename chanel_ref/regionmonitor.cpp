@@ -0,0 +1,294 @@
+#include "regionmonitor.h"
+
+#include <algorithm>
+#include <math.h>
+
+#define PAGE_SHIFT 12
+// addresses from here on are not of the process, e.g. [vsyscall]
+#define USER_SPACE_END 0x800000000000UL
+
+// whether two densities are close enough for their regions to merge
+static bool similar(double a, double b, double threshold) {
+  return fabs(a - b) <= threshold * std::max(a, b);
+}
+
+static uint64_t pagesOf(const RegionMonitor::Region &region) {
+  return std::max<uint64_t>((region.end - region.start) >> PAGE_SHIFT, 1);
+}
+
+// merge <b> into <a>, its neighbor, weighting by size
+static void absorb(RegionMonitor::Region *a, const RegionMonitor::Region &b) {
+  double pages_a = pagesOf(*a), pages_b = pagesOf(b);
+  a->density =
+      (a->density * pages_a + b.density * pages_b) / (pages_a + pages_b);
+  a->age = (a->age * pages_a + b.age * pages_b) / (pages_a + pages_b);
+  a->samples += b.samples;
+  a->start = std::min(a->start, b.start);
+  a->end = std::max(a->end, b.end);
+}
+
+RegionMonitor::RegionMonitor() {
+  memset(&m_stats, 0, sizeof(m_stats));
+  m_random = 0x9E3779B97F4A7C15UL;
+}
+
+int RegionMonitor::init(const Config &config) {
+  if (config.min_regions == 0 || config.min_regions * 2 > config.max_regions)
+    ERROR({}, -EINVAL, false, "invalid min_regions %lu or max_regions %lu",
+          config.min_regions, config.max_regions);
+  if (config.aggregate_ms == 0 || config.smoothing <= 0 ||
+      config.smoothing > 1)
+    ERROR({}, -EINVAL, false, "invalid aggregate_ms %lu or smoothing %f",
+          config.aggregate_ms, config.smoothing);
+  m_config = config;
+  return 0;
+}
+
+int RegionMonitor::add(pid_t pid) {
+  if (m_targets.count(pid))
+    return 0;
+  std::vector<Range> ranges;
+  int ret = readRanges(pid, &ranges);
+  if (ret < 0)
+    ERROR({}, ret, false, "readRanges(%d, &ranges) failed", pid);
+  Target &target = m_targets[pid];
+  // the first tick() starts the intervals
+  target.aggregate_time = 0;
+  target.update_time = 0;
+  update(&target, ranges);
+  return 0;
+}
+
+int RegionMonitor::remove(pid_t pid) {
+  return m_targets.erase(pid) ? 0 : -ENOENT;
+}
+
+void RegionMonitor::record(pid_t pid, uint64_t address, uint32_t weight) {
+  auto it = m_targets.find(pid);
+  if (it == m_targets.end())
+    return;
+  std::vector<Region> &regions = it->second.regions;
+  // the last region starting at or before <address>
+  auto region = std::upper_bound(
+      regions.begin(), regions.end(), address,
+      [](uint64_t address, const Region &region) {
+        return address < region.start;
+      });
+  if (region == regions.begin() || address >= (--region)->end) {
+    m_stats.unmapped += weight;
+    return;
+  }
+  region->samples += weight;
+  m_stats.samples += weight;
+}
+
+int RegionMonitor::tick(uint64_t now) {
+  for (auto it = m_targets.begin(); it != m_targets.end();) {
+    Target &target = it->second;
+    if (target.aggregate_time == 0) {
+      target.aggregate_time = now;
+      target.update_time = now;
+    }
+    if (now - target.update_time >= m_config.update_ms) {
+      std::vector<Range> ranges;
+      int ret = readRanges(it->first, &ranges);
+      if (ret == -ENOENT || ret == -ESRCH) {
+        it = m_targets.erase(it);
+        continue;
+      }
+      // the other processes go on, this one keeps its regions until the
+      // next update
+      if (ret < 0)
+        WARN(false, "readRanges(%d, &ranges) failed: %s", it->first,
+             strerror(-ret));
+      else
+        update(&target, ranges);
+      target.update_time = now;
+    }
+    if (now - target.aggregate_time >= m_config.aggregate_ms)
+      aggregate(&target, now);
+    it++;
+  }
+  return 0;
+}
+
+int RegionMonitor::getRegions(pid_t pid, std::vector<Region> *regions) const {
+  auto it = m_targets.find(pid);
+  if (it == m_targets.end())
+    return -ENOENT;
+  *regions = it->second.regions;
+  return 0;
+}
+
+void RegionMonitor::getStats(Stats *stats) const { *stats = m_stats; }
+
+int RegionMonitor::readRanges(pid_t pid, std::vector<Range> *ranges) const {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+    return -errno;
+  ranges->clear();
+  char line[512];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    Range range;
+    if (sscanf(line, "%lx-%lx", &range.start, &range.end) != 2 ||
+        range.start >= USER_SPACE_END)
+      continue;
+    // adjacent mappings make a single range
+    if (!ranges->empty() && ranges->back().end == range.start)
+      ranges->back().end = range.end;
+    else
+      ranges->push_back(range);
+  }
+  fclose(file);
+  if (ranges->size() <= m_config.max_regions)
+    return 0;
+  // too many ranges, close the smallest gaps between them
+  std::vector<uint64_t> gaps(ranges->size() - 1);
+  for (size_t i = 0; i + 1 < ranges->size(); i++)
+    gaps[i] = (*ranges)[i + 1].start - (*ranges)[i].end;
+  size_t closing = ranges->size() - m_config.max_regions;
+  std::vector<uint64_t> sorted = gaps;
+  std::nth_element(sorted.begin(), sorted.begin() + closing - 1, sorted.end());
+  uint64_t widest = sorted[closing - 1];
+  std::vector<Range> closed;
+  closed.push_back((*ranges)[0]);
+  for (size_t i = 0; i + 1 < ranges->size(); i++) {
+    if (gaps[i] <= widest && closing > 0) {
+      closed.back().end = (*ranges)[i + 1].end;
+      closing--;
+    } else {
+      closed.push_back((*ranges)[i + 1]);
+    }
+  }
+  ranges->swap(closed);
+  return 0;
+}
+
+void RegionMonitor::update(Target *target, const std::vector<Range> &ranges) {
+  // clip the regions to the ranges, and cover the rest of the ranges with
+  // new regions
+  const std::vector<Region> &old = target->regions;
+  std::vector<Region> regions;
+  size_t i = 0;
+  for (const Range &range : ranges) {
+    uint64_t covered = range.start;
+    while (i < old.size() && old[i].end <= range.start)
+      i++;
+    for (; i < old.size() && old[i].start < range.end; i++) {
+      Region region = old[i];
+      region.start = std::max(region.start, range.start);
+      region.end = std::min(region.end, range.end);
+      if (region.start > covered)
+        regions.push_back({covered, region.start, 0, 0, 0});
+      regions.push_back(region);
+      covered = region.end;
+      // the rest of it may be in the next range
+      if (old[i].end > range.end)
+        break;
+    }
+    if (covered < range.end)
+      regions.push_back({covered, range.end, 0, 0, 0});
+  }
+  target->regions.swap(regions);
+  // new regions in the holes may exceed the bound, merge pairs of neighbors
+  // until they do not
+  std::vector<Region> &merged = target->regions;
+  while (merged.size() > m_config.max_regions) {
+    size_t excess = merged.size() - m_config.max_regions;
+    size_t kept = 0;
+    for (size_t j = 0; j < merged.size(); j++) {
+      if (excess > 0 && kept > 0 && (j % 2) == 1) {
+        absorb(&merged[kept - 1], merged[j]);
+        excess--;
+        m_stats.merges++;
+      } else {
+        merged[kept++] = merged[j];
+      }
+    }
+    merged.resize(kept);
+  }
+  // and split the largest regions until there are enough
+  while (merged.size() < m_config.min_regions) {
+    auto largest = std::max_element(
+        merged.begin(), merged.end(), [](const Region &a, const Region &b) {
+          return a.end - a.start < b.end - b.start;
+        });
+    if (largest == merged.end() || pagesOf(*largest) < 2)
+      break;
+    Region second = *largest;
+    second.start = largest->start + (pagesOf(*largest) / 2 << PAGE_SHIFT);
+    largest->end = second.start;
+    merged.insert(largest + 1, second);
+    m_stats.splits++;
+  }
+}
+
+void RegionMonitor::aggregate(Target *target, uint64_t now) {
+  double seconds = (now - target->aggregate_time) / 1000.0;
+  for (Region &region : target->regions) {
+    double density = region.samples / (double)pagesOf(region) / seconds;
+    density = m_config.smoothing * density +
+              (1 - m_config.smoothing) * region.density;
+    if (similar(density, region.density, m_config.merge_threshold))
+      region.age++;
+    else
+      region.age = 0;
+    region.density = density;
+    region.samples = 0;
+  }
+  merge(target);
+  if (target->regions.size() < m_config.max_regions / 2)
+    split(target);
+  target->aggregate_time = now;
+  m_stats.aggregations++;
+}
+
+void RegionMonitor::merge(Target *target) {
+  std::vector<Region> &regions = target->regions;
+  size_t kept = 0;
+  for (size_t i = 0; i < regions.size(); i++) {
+    // keep min_regions, counting the ones not looked at yet
+    if (kept > 0 && regions[kept - 1].end == regions[i].start &&
+        kept + (regions.size() - i) > m_config.min_regions &&
+        similar(regions[kept - 1].density, regions[i].density,
+                m_config.merge_threshold)) {
+      absorb(&regions[kept - 1], regions[i]);
+      m_stats.merges++;
+    } else {
+      regions[kept++] = regions[i];
+    }
+  }
+  regions.resize(kept);
+}
+
+void RegionMonitor::split(Target *target) {
+  std::vector<Region> &regions = target->regions;
+  std::vector<Region> split;
+  split.reserve(std::min(regions.size() * 2, m_config.max_regions));
+  for (size_t i = 0; i < regions.size(); i++) {
+    const Region &region = regions[i];
+    uint64_t pages = pagesOf(region);
+    // leave room for the regions not looked at yet
+    if (pages < 2 ||
+        split.size() + (regions.size() - i) >= m_config.max_regions) {
+      split.push_back(region);
+      continue;
+    }
+    uint64_t middle =
+        region.start + ((1 + random() % (pages - 1)) << PAGE_SHIFT);
+    split.push_back({region.start, middle, region.density, 0, region.age});
+    split.push_back({middle, region.end, region.density, 0, region.age});
+    m_stats.splits++;
+  }
+  regions.swap(split);
+}
+
+uint64_t RegionMonitor::random() {
+  // xorshift64
+  m_random ^= m_random << 13;
+  m_random ^= m_random >> 7;
+  m_random ^= m_random << 17;
+  return m_random;
+}
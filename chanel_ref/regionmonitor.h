@@ -0,0 +1,124 @@
+#ifndef REGIONMONITOR_H
+#define REGIONMONITOR_H
+
+#include "common.h"
+
+#include <map>
+#include <sys/types.h>
+#include <vector>
+
+/* Access density of the address space of processes, in a bounded count of
+ * regions whatever the size of the address space (like DAMON, in userspace,
+ * fed by samples instead of page table scans).
+ * Regions start from the mappings in /proc/<pid>/maps. Every aggregation
+ * interval, the samples of each region give its density (samples per 4K page
+ * per second, smoothed over intervals), then neighbors of similar density are
+ * merged and, while there are fewer than max_regions / 2 regions, every region
+ * is split in two at a random page. Regions thus follow the access pattern,
+ * small where density changes and large where it is flat. Mappings are
+ * re-read every update interval.
+ */
+class RegionMonitor {
+public:
+  struct Config {
+    size_t min_regions = 10;      // regions of a process at least
+    size_t max_regions = 1000;    // regions of a process at most
+    uint64_t aggregate_ms = 100;  // interval of aggregations
+    uint64_t update_ms = 1000;    // interval of re-reading the mappings
+    double merge_threshold = 0.2; // relative density difference to merge under
+    double smoothing = 0.5;       // weight of the last interval in the density
+  };
+
+  struct Region {
+    uint64_t start;   // first address
+    uint64_t end;     // address after the last
+    double density;   // samples per 4K page per second, smoothed
+    uint64_t samples; // samples since the last aggregation
+    uint32_t age;     // aggregations since the density last changed much
+  };
+
+  struct Stats {
+    uint64_t samples;      // samples that fell in a region
+    uint64_t unmapped;     // samples that fell out of every region
+    uint64_t aggregations; // aggregations done
+    uint64_t splits;       // regions split
+    uint64_t merges;       // regions merged
+  };
+
+  RegionMonitor();
+
+  /* Initialize the monitor.
+   *      config: bounds and intervals
+   * RETURN: 0 if OK, or a negative error code
+   */
+  int init(const Config &config);
+
+  /* Start monitoring a process, from its current mappings.
+   * RETURN: 0 if OK, or a negative error code
+   */
+  int add(pid_t pid);
+
+  /* Stop monitoring a process.
+   * RETURN: 0 if OK, or -ENOENT if it is not monitored
+   */
+  int remove(pid_t pid);
+
+  /* Account samples of an address of a process.
+   *      pid:     the process, not monitored ones are ignored
+   *      address: the virtual address sampled
+   *      weight:  count of samples
+   */
+  void record(pid_t pid, uint64_t address, uint32_t weight = 1);
+
+  /* Aggregate and re-read mappings when their intervals are due, call it
+   * after each poll of the samples.
+   *      now: the current time in ms, of a monotonic clock
+   * RETURN: 0 if OK, or a negative error code
+   * NOTE: processes whose mappings cannot be read any more (i.e. exited) are
+   * removed. Another failure to read the mappings of a process is reported
+   * and that process keeps its regions, the others are not held up.
+   */
+  int tick(uint64_t now);
+
+  /* Get the regions of a process.
+   *      regions: the vector to receive them, by address
+   * RETURN: 0 if OK, or -ENOENT if it is not monitored
+   */
+  int getRegions(pid_t pid, std::vector<Region> *regions) const;
+
+  /* Get the counters summed over processes.
+   */
+  void getStats(Stats *stats) const;
+
+private:
+  struct Range {
+    uint64_t start; // first address
+    uint64_t end;   // address after the last
+  };
+
+  struct Target {
+    std::vector<Region> regions; // the regions, by address
+    uint64_t aggregate_time;     // time of the last aggregation, in ms
+    uint64_t update_time;        // time of the last update, in ms
+  };
+
+  int readRanges(pid_t pid, std::vector<Range> *ranges) const;
+
+  void update(Target *target, const std::vector<Range> &ranges);
+
+  void aggregate(Target *target, uint64_t now);
+
+  void merge(Target *target);
+
+  void split(Target *target);
+
+  uint64_t random();
+
+private:
+  Config m_config;                   // bounds and intervals
+  std::map<pid_t, Target> m_targets; // the processes monitored
+  Stats m_stats;                     // see Stats
+  uint64_t m_random;                 // state of random(), for split points
+};
+
+#endif
@@ -0,0 +1,162 @@
+#include "regiontree.h"
+
+#include <algorithm>
+#include <functional>
+
+#define SHIFT_4K 12
+#define SHIFT_2M 21
+#define SHIFT_1G 30
+
+// keep the <count> hottest regions in <heap>, the coldest of them on top
+static void keep(std::vector<RegionTree::Region> *heap, size_t count,
+                 const RegionTree::Region &region) {
+  auto hotter = [](const RegionTree::Region &a, const RegionTree::Region &b) {
+    return a.count > b.count;
+  };
+  if (heap->size() < count) {
+    heap->push_back(region);
+    std::push_heap(heap->begin(), heap->end(), hotter);
+  } else if (count > 0 && region.count > heap->front().count) {
+    std::pop_heap(heap->begin(), heap->end(), hotter);
+    heap->back() = region;
+    std::push_heap(heap->begin(), heap->end(), hotter);
+  }
+}
+
+RegionTree::RegionTree() {}
+
+int RegionTree::init(size_t capacity) {
+  int ret = m_index.init(capacity);
+  if (ret < 0)
+    ERROR({}, ret, false, "m_index.init(%lu) failed", capacity);
+  m_giants.reserve(capacity);
+  return 0;
+}
+
+int RegionTree::record(uint64_t address, uint32_t weight) {
+  uint64_t giant_number = address >> SHIFT_1G;
+  uint32_t *index = m_index.find(giant_number);
+  if (index == NULL) {
+    index = m_index.insert(giant_number);
+    if (index == NULL)
+      ERROR({}, -ENOMEM, false, "failed to insert 1G region %lx", giant_number);
+    *index = m_giants.size();
+    m_giants.emplace_back();
+    Giant &giant = m_giants.back();
+    giant.number = giant_number;
+    giant.count = 0;
+    giant.touched = 0;
+    std::fill(giant.children, giant.children + REGION_FANOUT, NO_CHILD);
+  }
+  Giant &giant = m_giants[*index];
+  uint32_t &child = giant.children[(address >> SHIFT_2M) % REGION_FANOUT];
+  if (child == NO_CHILD) {
+    child = m_huges.size();
+    m_huges.emplace_back();
+    Huge &huge = m_huges.back();
+    huge.number = address >> SHIFT_2M;
+    huge.count = 0;
+    huge.touched = 0;
+    std::fill(huge.pages, huge.pages + REGION_FANOUT, 0);
+    giant.touched++;
+  }
+  Huge &huge = m_huges[child];
+  uint16_t &page = huge.pages[(address >> SHIFT_4K) % REGION_FANOUT];
+  if (page == 0)
+    huge.touched++;
+  page = std::min<uint32_t>(page + weight, UINT16_MAX);
+  huge.count += weight;
+  giant.count += weight;
+  return 0;
+}
+
+uint64_t RegionTree::count(uint64_t address, Level level) const {
+  if (level == LEVEL_1G) {
+    const uint32_t *index = m_index.find(address >> SHIFT_1G);
+    return index ? m_giants[*index].count : 0;
+  }
+  const Huge *huge = findHuge(address);
+  if (huge == NULL)
+    return 0;
+  if (level == LEVEL_2M)
+    return huge->count;
+  return huge->pages[(address >> SHIFT_4K) % REGION_FANOUT];
+}
+
+void RegionTree::hottest(Level level, size_t count,
+                         std::vector<Region> *regions) const {
+  regions->clear();
+  switch (level) {
+  case LEVEL_1G:
+    for (const Giant &giant : m_giants)
+      keep(regions, count,
+           {giant.number << SHIFT_1G, giant.count, giant.touched});
+    break;
+  case LEVEL_2M:
+    for (const Huge &huge : m_huges)
+      keep(regions, count, {huge.number << SHIFT_2M, huge.count, huge.touched});
+    break;
+  case LEVEL_4K:
+    for (const Huge &huge : m_huges) {
+      // no page of a region colder than the coldest kept can make it
+      if (regions->size() == count &&
+          (count == 0 || huge.count <= regions->front().count))
+        continue;
+      for (size_t i = 0; i < REGION_FANOUT; i++)
+        if (huge.pages[i] != 0)
+          keep(regions, count,
+               {(huge.number << SHIFT_2M) + (i << SHIFT_4K), huge.pages[i], 0});
+    }
+    break;
+  }
+  std::sort(regions->begin(), regions->end(),
+            [](const Region &a, const Region &b) { return a.count > b.count; });
+}
+
+int RegionTree::skew(uint64_t address, double share, Skew *skew) const {
+  const Huge *huge = findHuge(address);
+  if (huge == NULL)
+    return -ENOENT;
+  uint16_t pages[REGION_FANOUT];
+  std::copy(huge->pages, huge->pages + REGION_FANOUT, pages);
+  std::sort(pages, pages + REGION_FANOUT, std::greater<uint16_t>());
+  // saturated pages make the sum of pages below the count of the region
+  uint64_t sum = 0;
+  for (uint16_t page : pages)
+    sum += page;
+  skew->count = huge->count;
+  skew->touched = huge->touched;
+  skew->hottest = pages[0];
+  skew->coverage = 0;
+  uint64_t covered = 0;
+  while (skew->coverage < REGION_FANOUT && covered < share * sum)
+    covered += pages[skew->coverage++];
+  return 0;
+}
+
+void RegionTree::decay() {
+  for (Giant &giant : m_giants)
+    giant.count >>= 1;
+  for (Huge &huge : m_huges) {
+    huge.count >>= 1;
+    huge.touched = 0;
+    for (size_t i = 0; i < REGION_FANOUT; i++) {
+      huge.pages[i] >>= 1;
+      huge.touched += huge.pages[i] != 0;
+    }
+  }
+}
+
+size_t RegionTree::memory() const {
+  return m_index.memory() + m_giants.capacity() * sizeof(Giant) +
+         m_huges.capacity() * sizeof(Huge);
+}
+
+const RegionTree::Huge *RegionTree::findHuge(uint64_t address) const {
+  const uint32_t *index = m_index.find(address >> SHIFT_1G);
+  if (index == NULL)
+    return NULL;
+  uint32_t child =
+      m_giants[*index].children[(address >> SHIFT_2M) % REGION_FANOUT];
+  return child == NO_CHILD ? NULL : &m_huges[child];
+}
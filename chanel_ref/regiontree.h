@@ -0,0 +1,116 @@
+#ifndef REGIONTREE_H
+#define REGIONTREE_H
+
+#include "common.h"
+#include "pagetable.h"
+
+#include <vector>
+
+// entries of a node, 9 bits of address like a level of x86 page tables
+#define REGION_FANOUT 512
+
+/* Hotness of memory at 4K, 2M and 1G granularity at once.
+ * A radix tree shaped like the page tables: 1G regions are found through a
+ * PageTable, each holds the indices of its 512 2M regions, and each 2M region
+ * holds the counters of its 512 4K pages. A sample adds to the three levels in
+ * one walk, so every level is counted exactly (but for saturated 4K pages) and
+ * a query on huge regions does not add up pages.
+ * Memory is about 1 KiB for each 2M region sampled, plus 2 KiB for each 1G
+ * region.
+ */
+class RegionTree {
+public:
+  enum Level {
+    LEVEL_4K, // base pages
+    LEVEL_2M, // huge pages
+    LEVEL_1G, // gigantic pages
+  };
+
+  struct Region {
+    uint64_t address; // start of the region
+    uint64_t count;   // samples in the region
+    uint32_t touched; // sampled children, 4K pages of a 2M region or 2M
+                      // regions of a 1G one, 0 for a 4K page
+  };
+
+  struct Skew {
+    uint64_t count;    // samples in the 2M region
+    uint32_t touched;  // 4K pages of it sampled
+    uint32_t hottest;  // samples of its hottest 4K page
+    uint32_t coverage; // fewest 4K pages holding <share> of the samples
+  };
+
+  RegionTree();
+
+  /* Initialize the tree.
+   *      capacity: count of 1G regions expected, it grows beyond as needed
+   * RETURN: 0 if OK, or a negative error code
+   */
+  int init(size_t capacity);
+
+  /* Account samples of an address.
+   *      address: the address sampled
+   *      weight:  count of samples
+   * RETURN: 0 if OK, or a negative error code
+   * NOTE: counters of 4K pages saturate at 65535.
+   */
+  int record(uint64_t address, uint32_t weight = 1);
+
+  /* Get the count of samples of the region of an address.
+   */
+  uint64_t count(uint64_t address, Level level) const;
+
+  /* Get the hottest regions of a level.
+   *      level:   the granularity
+   *      count:   count of regions wanted
+   *      regions: the vector to receive them, hottest first
+   */
+  void hottest(Level level, size_t count, std::vector<Region> *regions) const;
+
+  /* Report how samples spread over the 4K pages of a 2M region, to tell
+   * whether splitting the huge page is worth it: a low <coverage> means a few
+   * pages take most samples, and the rest could go to a slower tier.
+   *      address: an address of the 2M region
+   *      share:   the share of samples for Skew::coverage, e.g. 0.9
+   *      skew:    the buffer to receive the report
+   * RETURN: 0 if OK, -ENOENT if the region has no samples
+   */
+  int skew(uint64_t address, double share, Skew *skew) const;
+
+  /* Halve every counter, so that old samples weigh less than new ones.
+   * NOTE: regions are kept when their count drops to 0.
+   */
+  void decay();
+
+  /* Get the bytes allocated for the tree.
+   */
+  size_t memory() const;
+
+private:
+  // a 1G region
+  struct Giant {
+    uint64_t number;                  // address >> 30
+    uint64_t count;                   // samples of its 2M regions
+    uint32_t touched;                 // count of its 2M regions
+    uint32_t children[REGION_FANOUT]; // index in <m_huges>, or NO_CHILD
+  };
+
+  // a 2M region
+  struct Huge {
+    uint64_t number;               // address >> 21
+    uint64_t count;                // samples of its 4K pages
+    uint32_t touched;              // count of its 4K pages sampled
+    uint16_t pages[REGION_FANOUT]; // samples of each 4K page, saturating
+  };
+
+  static constexpr uint32_t NO_CHILD = UINT32_MAX;
+
+  const Huge *findHuge(uint64_t address) const;
+
+private:
+  PageTable<uint32_t> m_index; // index in <m_giants> of each 1G region
+  std::vector<Giant> m_giants; // the 1G regions
+  std::vector<Huge> m_huges;   // the 2M regions
+};
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include "common.h"
+
+#include <linux/perf_event.h>
+
+// records larger than this that straddle the end of the ring are skipped
+#define RING_SCRATCH_SIZE 512
+
+/* Reader of a perf_event mmap ring buffer.
+ * It walks the records between data_tail and data_head, reassembles records
+ * that straddle the end of the ring in a fixed scratch buffer (no allocation),
+ * and accounts PERF_RECORD_LOST / PERF_RECORD_THROTTLE /
+ * PERF_RECORD_UNTHROTTLE itself instead of handing them out.
+ */
+class RingBuffer {
+public:
+  struct Stats {
+    uint64_t records;      // records handed out to the caller
+    uint64_t bytes;        // bytes consumed, including every record type
+    uint64_t lost;         // samples dropped by the kernel (ring was full)
+    uint64_t lost_records; // count of PERF_RECORD_LOST records
+    uint64_t throttles;    // count of PERF_RECORD_THROTTLE records
+    uint64_t unthrottles;  // count of PERF_RECORD_UNTHROTTLE records
+    uint64_t throttled_ns; // total time between throttle and unthrottle
+    uint64_t skipped;      // records that could not be reassembled
+  };
+
+  RingBuffer() : m_meta(NULL), m_data(NULL), m_mask(0), m_throttle_time(0) {
+    resetStats();
+  }
+
+  /* Attach to a mapped perf_event ring buffer.
+   *      buffer:    the address returned by mmap(), i.e. the header page
+   *      data_size: size of the data area, must be a power of 2
+   * NOTE: data_offset/data_size from the header page are preferred if the
+   * kernel fills them.
+   */
+  void attach(void *buffer, size_t data_size) {
+    auto *meta = (struct perf_event_mmap_page *)buffer;
+    size_t offset = meta->data_offset ? meta->data_offset : 4096;
+    if (meta->data_size)
+      data_size = meta->data_size;
+    assert((data_size & (data_size - 1)) == 0);
+    m_meta = meta;
+    m_data = (char *)buffer + offset;
+    m_mask = data_size - 1;
+    m_throttle_time = 0;
+  }
+
+  void detach() {
+    m_meta = NULL;
+    m_data = NULL;
+    m_mask = 0;
+  }
+
+  /* Visit every record between data_tail and data_head.
+   *      on_record: called as bool(const struct perf_event_header *record)
+   *          with a contiguous copy of each record; return false to stop
+   *          before this record, leaving it in the ring for the next call
+   * RETURN: the count of records handed to <on_record> and consumed
+   * NOTE: data_tail is published once, after the whole walk.
+   */
+  template <typename F> size_t drain(F &&on_record) {
+    uint64_t tail = m_meta->data_tail;
+    uint64_t head = __atomic_load_n(&m_meta->data_head, __ATOMIC_ACQUIRE);
+    assert(tail <= head);
+    size_t count = 0;
+    while (tail < head) {
+      // the data_head and data_tail never wrap, they are logical.
+      // records are 8-byte aligned, so the header itself never straddles.
+      uint64_t position = tail & m_mask;
+      auto *header = (const struct perf_event_header *)(m_data + position);
+      size_t size = header->size;
+      if (unlikely(size < sizeof(*header) || tail + size > head)) {
+        // corrupted record, drop everything we have
+        m_stats.skipped++;
+        tail = head;
+        break;
+      }
+      if (unlikely(position + size > m_mask + 1)) {
+        if (size > sizeof(m_scratch)) {
+          m_stats.skipped++;
+          tail += size;
+          continue;
+        }
+        size_t first = m_mask + 1 - position;
+        memcpy(m_scratch, m_data + position, first);
+        memcpy(m_scratch + first, m_data, size - first);
+        header = (const struct perf_event_header *)m_scratch;
+      }
+      if (likely(header->type == PERF_RECORD_SAMPLE) || !account(header)) {
+        if (!on_record(header))
+          break;
+        m_stats.records++;
+        count++;
+      }
+      tail += size;
+    }
+    m_stats.bytes += tail - m_meta->data_tail;
+    // notify kernel that it can write new data
+    __atomic_store_n(&m_meta->data_tail, tail, __ATOMIC_RELEASE);
+    return count;
+  }
+
+  /* Check whether there is any unread record.
+   */
+  bool empty() const {
+    return __atomic_load_n(&m_meta->data_head, __ATOMIC_ACQUIRE) ==
+           m_meta->data_tail;
+  }
+
+  const Stats &getStats() const { return m_stats; }
+
+  void resetStats() { memset(&m_stats, 0, sizeof(m_stats)); }
+
+private:
+  // see man page for perf_event_open()
+  struct lost_record {
+    struct perf_event_header header;
+    uint64_t id;
+    uint64_t lost;
+  };
+
+  struct throttle_record {
+    struct perf_event_header header;
+    uint64_t time;
+    uint64_t id;
+    uint64_t stream_id;
+  };
+
+  // RETURN: true if <header> is an accounting record consumed here
+  bool account(const struct perf_event_header *header) {
+    switch (header->type) {
+    case PERF_RECORD_LOST:
+      m_stats.lost_records++;
+      m_stats.lost += ((const struct lost_record *)header)->lost;
+      return true;
+    case PERF_RECORD_THROTTLE:
+      m_stats.throttles++;
+      m_throttle_time = ((const struct throttle_record *)header)->time;
+      return true;
+    case PERF_RECORD_UNTHROTTLE: {
+      uint64_t time = ((const struct throttle_record *)header)->time;
+      m_stats.unthrottles++;
+      if (m_throttle_time && time > m_throttle_time)
+        m_stats.throttled_ns += time - m_throttle_time;
+      m_throttle_time = 0;
+      return true;
+    }
+    default:
+      return false;
+    }
+  }
+
+private:
+  struct perf_event_mmap_page *m_meta; // header page of the ring buffer
+  char *m_data;                        // data area of the ring buffer
+  uint64_t m_mask;                     // data_size - 1
+  uint64_t m_throttle_time;            // time of the pending THROTTLE, or 0
+  Stats m_stats;                       // accounting of the records
+  alignas(8) char m_scratch[RING_SCRATCH_SIZE]; // reassembled records
+};
+
+#endif
@@ -0,0 +1,129 @@
+#include "sampleaggregator.h"
+
+#include <algorithm>
+
+SampleAggregator::Local::Local(const SampleAggregator &owner)
+    : m_owner(owner) {
+  m_table = NULL;
+  m_tables = 0;
+  m_epoch = owner.m_epoch.load(std::memory_order_acquire);
+  m_detached = false;
+}
+
+SampleAggregator::Local::~Local() {
+  Table *table;
+  while (m_full.pop(&table))
+    delete table;
+  while (m_free.pop(&table))
+    delete table;
+  delete m_table;
+}
+
+void SampleAggregator::Local::flush() {
+  uint64_t epoch = m_owner.m_epoch.load(std::memory_order_acquire);
+  if (epoch == m_epoch || m_table->size() == 0)
+    return;
+  Table *spare;
+  if (!m_free.pop(&spare)) {
+    // merge() is behind, keep counting into this table until it catches up
+    if (m_tables == AGGREGATOR_LOCAL_TABLES)
+      return;
+    spare = new Table();
+    if (spare->init(m_owner.m_config.local_capacity) < 0) {
+      delete spare;
+      return;
+    }
+    m_tables++;
+  }
+  // never full, it has room for every table allocated
+  m_full.push(m_table);
+  m_table = spare;
+  m_epoch = epoch;
+}
+
+SampleAggregator::SampleAggregator() : m_epoch(0) {}
+
+SampleAggregator::~SampleAggregator() {
+  for (Local *local : m_locals)
+    delete local;
+}
+
+int SampleAggregator::init(const Config &config) {
+  if (config.local_capacity == 0)
+    ERROR({}, -EINVAL, false, "param <local_capacity> is zero");
+  m_config = config;
+  int ret = m_view.init(config.view);
+  if (ret < 0)
+    ERROR({}, ret, false, "m_view.init(config.view) failed");
+  m_snapshot.store(std::make_shared<const Snapshot>());
+  return 0;
+}
+
+SampleAggregator::Local *SampleAggregator::attach() {
+  Local *local = new Local(*this);
+  local->m_table = new Local::Table();
+  if (local->m_table->init(m_config.local_capacity) < 0 ||
+      local->m_full.init(AGGREGATOR_LOCAL_TABLES) < 0 ||
+      local->m_free.init(AGGREGATOR_LOCAL_TABLES) < 0) {
+    delete local;
+    return NULL;
+  }
+  local->m_tables = 1;
+  std::lock_guard<std::mutex> lock(m_locals_lock);
+  m_locals.push_back(local);
+  return local;
+}
+
+void SampleAggregator::detach(Local *local) {
+  if (local->m_table->size() > 0) {
+    local->m_full.push(local->m_table);
+    local->m_table = NULL;
+  }
+  local->m_detached.store(true, std::memory_order_release);
+}
+
+size_t SampleAggregator::merge() {
+  uint64_t epoch = m_epoch.fetch_add(1, std::memory_order_acq_rel) + 1;
+  size_t folded = 0;
+  std::vector<Local *> locals;
+  {
+    std::lock_guard<std::mutex> lock(m_locals_lock);
+    locals = m_locals;
+  }
+  std::vector<Local *> gone;
+  for (Local *local : locals) {
+    // every table handed over before detach() is in the queue if this is seen
+    bool detached = local->m_detached.load(std::memory_order_acquire);
+    Local::Table *table;
+    while (local->m_full.pop(&table)) {
+      table->forEach([this](uint64_t pfn, uint32_t &count) {
+        m_view.record(pfn, count);
+      });
+      table->clear();
+      local->m_free.push(table);
+      folded++;
+    }
+    if (detached)
+      gone.push_back(local);
+  }
+  if (!gone.empty()) {
+    std::lock_guard<std::mutex> lock(m_locals_lock);
+    for (Local *local : gone) {
+      m_locals.erase(std::find(m_locals.begin(), m_locals.end(), local));
+      delete local;
+    }
+  }
+  if (m_config.decay_epochs != 0 && epoch % m_config.decay_epochs == 0)
+    m_view.decay();
+  auto snapshot = std::make_shared<Snapshot>();
+  snapshot->epoch = epoch;
+  snapshot->total = m_view.total();
+  m_view.top(&snapshot->pages, m_config.snapshot_pages);
+  m_snapshot.store(std::move(snapshot), std::memory_order_release);
+  return folded;
+}
+
+std::shared_ptr<const SampleAggregator::Snapshot>
+SampleAggregator::snapshot() const {
+  return m_snapshot.load(std::memory_order_acquire);
+}
@@ -0,0 +1,128 @@
+#ifndef SAMPLEAGGREGATOR_H
+#define SAMPLEAGGREGATOR_H
+
+#include "common.h"
+#include "heavyhitters.h"
+#include "pagetable.h"
+#include "spscqueue.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// tables of counts of a sampling thread at most, the one it fills included
+#define AGGREGATOR_LOCAL_TABLES 4
+
+/* Counts of samples taken by several threads, merged into one view.
+ * Each sampling thread counts into a table of its own (a Local), with neither
+ * locks nor atomics. merge() starts a new epoch, and a thread that sees the
+ * new epoch at its next flush() hands its table over through a lock-free
+ * queue and goes on with an empty one. The merging thread folds the tables
+ * handed over into a HeavyHitters, and publishes the hottest pages of it as an
+ * immutable Snapshot, that readers take without blocking anyone.
+ * Samples thus reach the view one merge() after the flush() that follows
+ * them, and those of a thread that stopped flushing (e.g. idle) wait until it
+ * flushes again or detaches.
+ */
+class SampleAggregator {
+public:
+  struct Config {
+    size_t local_capacity = 4096; // pages of a table of a Local, it grows
+    size_t snapshot_pages = 1024; // hottest pages of a Snapshot
+    size_t decay_epochs = 16;     // merges between decays of the view, 0 never
+    HeavyHitters::Config view;    // bounds of the view
+  };
+
+  struct Snapshot {
+    uint64_t epoch;                         // merges before this one
+    uint64_t total;                         // samples in the view
+    std::vector<HeavyHitters::Entry> pages; // hottest pages, hottest first
+  };
+
+  /* The counts of one sampling thread, used by that thread only.
+   */
+  class Local {
+  public:
+    /* Account samples of a page.
+     * RETURN: 0 if OK, or -ENOMEM
+     */
+    int record(uint64_t pfn, uint32_t weight = 1) {
+      uint32_t *count = m_table->insert(pfn);
+      if (unlikely(count == NULL))
+        return -ENOMEM;
+      *count += weight;
+      return 0;
+    }
+
+    /* Hand the counts over if a merge() asked for them, call it between
+     * batches of samples.
+     */
+    void flush();
+
+    Local(const Local &) = delete;
+    Local &operator=(const Local &) = delete;
+
+  private:
+    typedef PageTable<uint32_t> Table;
+
+    friend class SampleAggregator;
+
+    explicit Local(const SampleAggregator &owner);
+
+    ~Local();
+
+    const SampleAggregator &m_owner; // the aggregator
+    Table *m_table;                  // the table being filled
+    size_t m_tables;                 // tables allocated
+    uint64_t m_epoch;                // the epoch last seen by flush()
+    SpscQueue<Table *> m_full;       // tables handed over, to merge()
+    SpscQueue<Table *> m_free;       // tables merged, back from merge()
+    std::atomic<bool> m_detached;    // set by detach()
+  };
+
+  SampleAggregator();
+
+  ~SampleAggregator();
+
+  /* Initialize the aggregator.
+   *      config: sizes of the tables and bounds of the view
+   * RETURN: 0 if OK, or a negative error code
+   */
+  int init(const Config &config);
+
+  /* Register a sampling thread.
+   * RETURN: its Local, or NULL if out of memory
+   */
+  Local *attach();
+
+  /* Unregister a sampling thread, its counts are merged by the next merge()
+   * and its Local is freed then.
+   */
+  void detach(Local *local);
+
+  /* Start a new epoch, fold the tables handed over since the last merge()
+   * into the view, and publish a new Snapshot. Call it from one thread at a
+   * time, e.g. periodically from a thread of its own.
+   * RETURN: count of tables folded
+   */
+  size_t merge();
+
+  /* Get the last Snapshot published, it stays valid as long as it is held.
+   */
+  std::shared_ptr<const Snapshot> snapshot() const;
+
+  SampleAggregator(const SampleAggregator &) = delete;
+  SampleAggregator &operator=(const SampleAggregator &) = delete;
+
+private:
+  Config m_config;                   // see Config
+  std::atomic<uint64_t> m_epoch;     // bumped by each merge()
+  HeavyHitters m_view;               // the counts merged, owned by merge()
+  std::mutex m_locals_lock;          // guards <m_locals>, not taken to sample
+  std::vector<Local *> m_locals;     // the threads attached, or detached but
+                                     // not merged yet
+  std::atomic<std::shared_ptr<const Snapshot>> m_snapshot; // the last one
+};
+
+#endif
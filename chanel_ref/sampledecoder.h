@@ -0,0 +1,94 @@
+#ifndef SAMPLEDECODER_H
+#define SAMPLEDECODER_H
+
+#include <linux/perf_event.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Layout of a PERF_RECORD_SAMPLE, derived at compile time from the
+ * PERF_SAMPLE_* bits of its perf_event_attr::sample_type.
+ * Every offset is a constant, so reading a field is a single load and adding
+ * a field to <SampleType> costs nothing at run time. Only fixed-size fields
+ * are supported, a <SampleType> with a variable-size one (e.g. CALLCHAIN,
+ * READ, RAW) does not compile.
+ */
+template <uint64_t SampleType> class SampleDecoder {
+  // the fixed-size fields, in the order they appear in a record (which is
+  // not the order of their bits), see man page for perf_event_open()
+  static constexpr uint64_t ORDER[] = {
+      PERF_SAMPLE_IDENTIFIER,     PERF_SAMPLE_IP,
+      PERF_SAMPLE_TID,            PERF_SAMPLE_TIME,
+      PERF_SAMPLE_ADDR,           PERF_SAMPLE_ID,
+      PERF_SAMPLE_STREAM_ID,      PERF_SAMPLE_CPU,
+      PERF_SAMPLE_PERIOD,         PERF_SAMPLE_WEIGHT | PERF_SAMPLE_WEIGHT_STRUCT,
+      PERF_SAMPLE_DATA_SRC,       PERF_SAMPLE_TRANSACTION,
+      PERF_SAMPLE_PHYS_ADDR,      PERF_SAMPLE_CGROUP,
+      PERF_SAMPLE_DATA_PAGE_SIZE, PERF_SAMPLE_CODE_PAGE_SIZE,
+  };
+
+  static constexpr uint64_t supported() {
+    uint64_t fields = 0;
+    for (uint64_t field : ORDER)
+      fields |= field;
+    return fields;
+  }
+
+  static_assert((SampleType & ~supported()) == 0,
+                "variable-size sample fields are not supported");
+  static_assert((SampleType & PERF_SAMPLE_WEIGHT) == 0 ||
+                    (SampleType & PERF_SAMPLE_WEIGHT_STRUCT) == 0,
+                "PERF_SAMPLE_WEIGHT and PERF_SAMPLE_WEIGHT_STRUCT are exclusive");
+
+public:
+  /* Check whether <field> is sampled.
+   */
+  static constexpr bool has(uint64_t field) {
+    return (SampleType & field) != 0;
+  }
+
+  /* Get the offset of a field from the start of the record.
+   */
+  template <uint64_t Field> static constexpr size_t offset() {
+    static_assert(has(Field), "the field is not in SampleType");
+    size_t offset = sizeof(struct perf_event_header);
+    for (uint64_t field : ORDER) {
+      if (field & Field)
+        break;
+      if (has(field))
+        offset += sizeof(uint64_t);
+    }
+    return offset;
+  }
+
+  // size of a record, every field takes 8 bytes
+  static constexpr size_t SIZE = [] {
+    size_t size = sizeof(struct perf_event_header);
+    for (uint64_t field : ORDER)
+      if (has(field))
+        size += sizeof(uint64_t);
+    return size;
+  }();
+
+  /* Read a 64-bit field, e.g. PERF_SAMPLE_ADDR or PERF_SAMPLE_WEIGHT.
+   */
+  template <uint64_t Field> static uint64_t get(const void *record) {
+    return *(const uint64_t *)((const char *)record + offset<Field>());
+  }
+
+  static uint32_t pid(const void *record) {
+    return *(const uint32_t *)((const char *)record +
+                               offset<PERF_SAMPLE_TID>());
+  }
+
+  static uint32_t tid(const void *record) {
+    return *(const uint32_t *)((const char *)record +
+                               offset<PERF_SAMPLE_TID>() + sizeof(uint32_t));
+  }
+
+  static uint32_t cpu(const void *record) {
+    return *(const uint32_t *)((const char *)record +
+                               offset<PERF_SAMPLE_CPU>());
+  }
+};
+
+#endif
@@ -0,0 +1,142 @@
+#include "softdirty.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define PAGE_SHIFT 12
+// pagemap entries read at once, 4 KiB
+#define SCAN_CHUNK 512
+// the soft-dirty bit of a pagemap entry
+#define PM_SOFT_DIRTY (1UL << 55)
+// addresses from here on are not of the process, e.g. [vsyscall]
+#define USER_SPACE_END 0x800000000000UL
+
+// Whether the kernel tracks soft-dirty bits: without CONFIG_MEM_SOFT_DIRTY
+// clear_refs takes "4" and pagemap reads fine, but bit 55 is never set, so a
+// page of our own is written after a clear and its bit checked.
+// RETURN: 0 if tracked, -EOPNOTSUPP if not, or another negative error code
+static int probe() {
+  long page_size = sysconf(_SC_PAGESIZE);
+  volatile char *page = (volatile char *)mmap(
+      NULL, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+      0);
+  if (page == MAP_FAILED)
+    ERROR({}, -errno, true, "mmap(NULL, %ld, ...) failed: ", page_size);
+  int pagemap = open("/proc/self/pagemap", O_RDONLY);
+  int clear_refs = open("/proc/self/clear_refs", O_WRONLY);
+  int ret = 0;
+  uint64_t entry = 0;
+  page[0] = 1;
+  if (pagemap < 0 || clear_refs < 0 || pwrite(clear_refs, "4", 1, 0) != 1) {
+    ret = -errno;
+  } else {
+    page[0] = 2;
+    uint64_t offset = (uint64_t)page / page_size * sizeof(uint64_t);
+    if (pread(pagemap, &entry, sizeof(entry), offset) != sizeof(entry))
+      ret = -errno;
+  }
+  const char *errstr = strerror(-ret);
+  if (pagemap >= 0)
+    close(pagemap);
+  if (clear_refs >= 0)
+    close(clear_refs);
+  munmap((void *)page, page_size);
+  if (ret < 0)
+    ERROR({}, ret, false, "failed to probe soft-dirty bits: %s", errstr);
+  if ((entry & PM_SOFT_DIRTY) == 0)
+    ERROR({}, -EOPNOTSUPP, false,
+          "the kernel does not track soft-dirty bits (CONFIG_MEM_SOFT_DIRTY)");
+  return 0;
+}
+
+SoftDirtyScanner::SoftDirtyScanner() {
+  m_pid = 0;
+  m_pagemap = -1;
+  m_clear_refs = -1;
+}
+
+SoftDirtyScanner::~SoftDirtyScanner() {
+  if (m_pagemap >= 0)
+    close(m_pagemap);
+  if (m_clear_refs >= 0)
+    close(m_clear_refs);
+}
+
+int SoftDirtyScanner::init(pid_t pid) {
+  if (m_pagemap >= 0)
+    ERROR({}, -EINVAL, false,
+          "this SoftDirtyScanner has been initialized already");
+  // the same on every call, the kernel config does not change
+  static const int supported = probe();
+  if (supported < 0)
+    ERROR({}, supported, false, "soft-dirty bits are unusable");
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/pagemap", pid);
+  m_pagemap = open(path, O_RDONLY);
+  if (m_pagemap < 0)
+    ERROR({}, -errno, true, "open(%s) failed: ", path);
+  snprintf(path, sizeof(path), "/proc/%d/clear_refs", pid);
+  m_clear_refs = open(path, O_WRONLY);
+  if (m_clear_refs < 0)
+    ERROR(({
+            close(m_pagemap);
+            m_pagemap = -1;
+          }),
+          -errno, true, "open(%s) failed: ", path);
+  m_pid = pid;
+  m_entries.resize(SCAN_CHUNK);
+  return clear();
+}
+
+ssize_t SoftDirtyScanner::scan(void *privdata,
+                               void (*on_dirty)(void *privdata,
+                                                uint64_t page)) {
+  if (m_pagemap < 0)
+    ERROR({}, -EINVAL, false, "this SoftDirtyScanner is not initialized");
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/maps", m_pid);
+  FILE *maps = fopen(path, "r");
+  if (maps == NULL)
+    ERROR({}, -errno, true, "fopen(%s) failed: ", path);
+  ssize_t count = 0;
+  char line[512];
+  while (fgets(line, sizeof(line), maps) != NULL) {
+    uint64_t start, end;
+    char perms[5];
+    if (sscanf(line, "%lx-%lx %4s", &start, &end, perms) != 3 ||
+        perms[1] != 'w' || start >= USER_SPACE_END)
+      continue;
+    for (uint64_t page = start >> PAGE_SHIFT; page < end >> PAGE_SHIFT;) {
+      size_t pages = std::min<uint64_t>((end >> PAGE_SHIFT) - page, SCAN_CHUNK);
+      ssize_t ret = pread(m_pagemap, m_entries.data(), pages * sizeof(uint64_t),
+                          page * sizeof(uint64_t));
+      if (ret <= 0)
+        ERROR(fclose(maps), ret < 0 ? -errno : -EIO, ret < 0,
+              "pread(pagemap) failed at page %lx: ", page);
+      pages = ret / sizeof(uint64_t);
+      for (size_t i = 0; i < pages; i++) {
+        if ((m_entries[i] & PM_SOFT_DIRTY) == 0)
+          continue;
+        if (on_dirty != NULL)
+          on_dirty(privdata, page + i);
+        count++;
+      }
+      page += pages;
+    }
+  }
+  fclose(maps);
+  int ret = clear();
+  if (ret < 0)
+    return ret;
+  return count;
+}
+
+int SoftDirtyScanner::clear() {
+  // "4" clears the soft-dirty bits of every page of the process
+  if (pwrite(m_clear_refs, "4", 1, 0) != 1)
+    ERROR({}, -errno, true, "failed to clear the soft-dirty bits of %d: ",
+          m_pid);
+  return 0;
+}
@@ -0,0 +1,53 @@
+#ifndef SOFTDIRTY_H
+#define SOFTDIRTY_H
+
+#include "common.h"
+
+#include <sys/types.h>
+#include <vector>
+
+/* Pages of a process written to since the last scan, from the soft-dirty bits
+ * of /proc/<pid>/pagemap (see Documentation/admin-guide/mm/soft-dirty.rst).
+ * A scan reads the bits of the writable mappings and clears them all, so each
+ * page is reported once per interval however many times it was written.
+ * Unlike store sampling, every written page is seen, at the cost of a write
+ * fault on the first store to each page after a clear and of a walk of the
+ * whole mappings per scan, so scan every few seconds rather than per poll.
+ */
+class SoftDirtyScanner {
+public:
+  SoftDirtyScanner();
+
+  ~SoftDirtyScanner();
+
+  /* Open the pagemap of a process and clear its soft-dirty bits.
+   * RETURN: 0 if OK, -EOPNOTSUPP if the kernel does not track soft-dirty
+   *         bits, or another negative error code
+   * NOTE: the caller needs the permissions of ptrace on the process.
+   */
+  int init(pid_t pid);
+
+  /* Report the pages written since the last scan (or init()), then clear the
+   * soft-dirty bits for the next one.
+   *      privdata: passed to <on_dirty>
+   *      on_dirty: called with the virtual page number (address >> 12) of
+   *                each dirty page, by address
+   * RETURN: count of dirty pages, or a negative error code
+   * NOTE: writes between reading the bits of a page and the clear are missed.
+   */
+  ssize_t scan(void *privdata, void (*on_dirty)(void *privdata, uint64_t page));
+
+  SoftDirtyScanner(const SoftDirtyScanner &) = delete;
+  SoftDirtyScanner &operator=(const SoftDirtyScanner &) = delete;
+
+private:
+  int clear();
+
+private:
+  pid_t m_pid;                   // the process scanned
+  int m_pagemap;                 // fd of /proc/<pid>/pagemap
+  int m_clear_refs;              // fd of /proc/<pid>/clear_refs
+  std::vector<uint64_t> m_entries; // a chunk of pagemap entries
+};
+
+#endif
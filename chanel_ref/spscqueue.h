@@ -0,0 +1,93 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include "common.h"
+
+#include <atomic>
+
+/* A bounded lock-free queue of one producer and one consumer.
+ * The producer and the consumer each cache the index of the other side, so
+ * they only touch the shared cache line when the queue looks full or empty.
+ */
+template <typename T> class SpscQueue {
+public:
+  SpscQueue() : m_slots(NULL), m_mask(0) {
+    m_head.value = 0;
+    m_tail.value = 0;
+    m_cached_head = 0;
+    m_cached_tail = 0;
+  }
+
+  ~SpscQueue() { delete[] m_slots; }
+
+  /* Initialize the queue.
+   *      capacity: the max count of elements, rounded up to a power of 2
+   * RETURN: 0 if OK, or a negative error code
+   */
+  int init(size_t capacity) {
+    if (m_slots != NULL)
+      ERROR({}, -EINVAL, false, "this SpscQueue has been initialized already");
+    if (capacity == 0)
+      ERROR({}, -EINVAL, false, "param <capacity> is zero");
+    size_t size = 1;
+    while (size < capacity)
+      size *= 2;
+    m_slots = new T[size];
+    m_mask = size - 1;
+    return 0;
+  }
+
+  /* Append an element, called by the producer only.
+   * RETURN: true if OK, false if the queue is full
+   */
+  bool push(const T &value) {
+    size_t tail = m_tail.value.load(std::memory_order_relaxed);
+    if (tail - m_cached_head > m_mask) {
+      m_cached_head = m_head.value.load(std::memory_order_acquire);
+      if (tail - m_cached_head > m_mask)
+        return false;
+    }
+    m_slots[tail & m_mask] = value;
+    m_tail.value.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /* Take the oldest element, called by the consumer only.
+   * RETURN: true if OK, false if the queue is empty
+   */
+  bool pop(T *value) {
+    size_t head = m_head.value.load(std::memory_order_relaxed);
+    if (head == m_cached_tail) {
+      m_cached_tail = m_tail.value.load(std::memory_order_acquire);
+      if (head == m_cached_tail)
+        return false;
+    }
+    *value = m_slots[head & m_mask];
+    m_head.value.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /* Check whether the queue is empty, from any thread.
+   */
+  bool empty() const {
+    return m_head.value.load(std::memory_order_acquire) ==
+           m_tail.value.load(std::memory_order_acquire);
+  }
+
+  SpscQueue(const SpscQueue &) = delete;
+  SpscQueue &operator=(const SpscQueue &) = delete;
+
+private:
+  struct alignas(64) Index {
+    std::atomic<size_t> value;
+  };
+
+  T *m_slots;                      // the ring of elements
+  size_t m_mask;                   // capacity - 1
+  Index m_head;                    // next element to pop, owned by consumer
+  Index m_tail;                    // next slot to push, owned by producer
+  alignas(64) size_t m_cached_head; // producer's copy of m_head
+  alignas(64) size_t m_cached_tail; // consumer's copy of m_tail
+};
+
+#endif
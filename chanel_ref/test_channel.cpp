@@ -1,28 +1,18 @@
 #include "channel.h"
+#include "hotnesstracker.h"
+#include "softdirty.h"
 #include <set>
 #include <vector>
-#include <unordered_map>
-struct PageInfo {
-    unsigned long address;
-    unsigned int accessCount;
-    time_t lastAccessTime;
-    bool isHot;
-};
 
+// pages looked at for demotion while waiting for samples
+const size_t SWEEP_BUDGET = 4096;
+// how often pages written to are looked for, in ms
+const uint64_t SCAN_INTERVAL = 5000;
 
-const unsigned int HOT_ACCESS_THRESHOLD = 10;
-const time_t CLASSIFICATION_PERIOD = 60;
-
-void classifyPages(std::unordered_map<unsigned long, PageInfo>& pages) {
-    for (auto& it : pages) {
-        PageInfo& page = it.second;
-        if (page.accessCount > HOT_ACCESS_THRESHOLD) {
-            page.isHot = true;
-        } else {
-            page.isHot = false;
-        }
-        page.accessCount = 0;
-    }
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
 }
 
 int main(int argc, char *argv[]) {
@@ -40,16 +30,46 @@ int main(int argc, char *argv[]) {
   ret = c.setPeriod(period);
   if (ret)
     return ret;
+  HotnessTracker tracker;
+  HotnessTracker::Config config;
+  ret = tracker.init(config, 1 << 16);
+  if (ret)
+    return ret;
+  // stores that were not sampled still show up as dirty pages
+  SoftDirtyScanner scanner;
+  ret = scanner.init(pid);
+  // without soft-dirty bits in the kernel, go on with sampled stores only
+  bool scanning = ret == 0;
+  if (ret && ret != -EOPNOTSUPP)
+    return ret;
+  uint64_t scan_time = now_ms();
   while (true) {
     Channel::Sample sample;
     ret = c.readSample(&sample);
     if (ret == -EAGAIN) {
+      tracker.sweep(now_ms(), SWEEP_BUDGET, [](uint64_t pfn) {
+        printf("cold: %lx\n", pfn << 12);
+      });
+      if (scanning && now_ms() - scan_time >= SCAN_INTERVAL) {
+        scan_time = now_ms();
+        ssize_t dirty = scanner.scan(&tracker, [](void *privdata,
+                                                  uint64_t page) {
+          static_cast<HotnessTracker *>(privdata)->record(
+              page, now_ms(), 1, 0, HotnessTracker::ACCESS_STORE);
+        });
+        if (dirty < 0)
+          return dirty;
+      }
       usleep(10000);
       continue;
     } else if (ret < 0)
       return ret;
-    else
-      printf("type: %x, cpu: %u, pid: %u, tid: %u, address: %lx\n", sample.type,
+    HotnessTracker::Access access = sample.type == Channel::CHANNEL_STORE
+                                        ? HotnessTracker::ACCESS_STORE
+                                        : HotnessTracker::ACCESS_LOAD;
+    if (tracker.record(sample.address >> 12, now_ms(), 1, 0, access) > 0)
+      printf("hot: %lx\n", sample.address & ~0xFFFUL);
+    printf("type: %x, cpu: %u, pid: %u, tid: %u, address: %lx\n", sample.type,
              sample.cpu, sample.pid, sample.tid, sample.address);
   }
   return 0;
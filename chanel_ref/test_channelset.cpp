@@ -1,6 +1,12 @@
 #include "channelset.h"
+#include "regiontree.h"
+
+// hottest huge pages reported after each poll
+#define REPORT_REGIONS 4
 
 void on_sample(void *privdata, Channel::Sample *sample) {
+  RegionTree *tree = (RegionTree *)privdata;
+  tree->record(sample->address);
   printf("type: %x, cpu: %u, pid: %u, tid: %u, address: %lx\n", sample->type,
          sample->cpu, sample->pid, sample->tid, sample->address);
 }
@@ -30,15 +36,27 @@ int main(int argc, char *argv[]) {
   if (ret)
     return ret;
   ret = cs.update(pids);
+  if (ret)
+    return ret;
+  RegionTree tree;
+  ret = tree.init(64);
   if (ret)
     return ret;
   size_t total = 0;
   while (true) {
-    ssize_t ret = cs.pollSamples(1000, NULL, on_sample, NULL);
+    ssize_t ret = cs.pollSamples(1000, &tree, on_sample, NULL);
     if (ret < 0)
       return (int)ret;
     total += ret;
     printf("count: %ld, total: %lu\n", ret, total);
+    std::vector<RegionTree::Region> regions;
+    tree.hottest(RegionTree::LEVEL_2M, REPORT_REGIONS, &regions);
+    for (const RegionTree::Region &region : regions) {
+      RegionTree::Skew skew;
+      tree.skew(region.address, 0.9, &skew);
+      printf("2M region: %lx, count: %lu, pages: %u, 90%% in %u pages\n",
+             region.address, region.count, skew.touched, skew.coverage);
+    }
   }
   return 0;
 }
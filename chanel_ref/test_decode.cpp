@@ -0,0 +1,64 @@
+// the checks are the test, keep them in any build
+#undef NDEBUG
+
+#include "channel.h"
+
+#include <cassert>
+#include <iostream>
+#include <linux/perf_event.h>
+
+// a data_src with the PERF_MEM_LVLNUM_* level <lvl_num>
+static uint64_t levelNumber(uint32_t lvl_num, bool remote = false) {
+  union perf_mem_data_src src;
+  src.val = 0;
+  src.mem_lvl_num = lvl_num;
+  src.mem_remote = remote;
+  return src.val;
+}
+
+// a data_src with the legacy PERF_MEM_LVL_* bits <lvl> only
+static uint64_t levelBits(uint32_t lvl) {
+  union perf_mem_data_src src;
+  src.val = 0;
+  src.mem_lvl = lvl;
+  return src.val;
+}
+
+int main() {
+  static const struct {
+    uint32_t lvl_num;
+    bool remote;
+    Channel::MemLevel level;
+  } LEVELS[] = {
+      {0x01, false, Channel::MEM_L1},
+      {0x02, false, Channel::MEM_L2},
+      {0x03, false, Channel::MEM_L3},
+      {0x03, true, Channel::MEM_REMOTE_CACHE},
+      {0x04, false, Channel::MEM_L3},
+      {0x08, false, Channel::MEM_UNCACHED},
+      {0x09, false, Channel::MEM_CXL},
+      {0x0a, false, Channel::MEM_IO},
+      {0x0b, false, Channel::MEM_L3},
+      {0x0c, false, Channel::MEM_LFB},
+      {0x0d, false, Channel::MEM_LOCAL_DRAM},
+      {0x0d, true, Channel::MEM_REMOTE_DRAM},
+      {0x0e, false, Channel::MEM_PMEM},
+  };
+  for (const auto &entry : LEVELS)
+    assert(Channel::decodeLevel(levelNumber(entry.lvl_num, entry.remote)) ==
+           entry.level);
+
+  // older kernels leave the level number N/A
+  assert(Channel::decodeLevel(levelNumber(PERF_MEM_LVLNUM_NA)) ==
+         Channel::MEM_UNKNOWN);
+  assert(Channel::decodeLevel(levelBits(PERF_MEM_LVL_HIT | PERF_MEM_LVL_L1)) ==
+         Channel::MEM_L1);
+  assert(Channel::decodeLevel(levelBits(PERF_MEM_LVL_REM_RAM1)) ==
+         Channel::MEM_REMOTE_DRAM);
+  assert(Channel::decodeLevel(levelBits(PERF_MEM_LVL_UNC)) ==
+         Channel::MEM_UNCACHED);
+  assert(Channel::decodeLevel(0) == Channel::MEM_UNKNOWN);
+
+  std::cout << "ok\n";
+  return 0;
+}
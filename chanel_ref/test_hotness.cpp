@@ -0,0 +1,77 @@
+// the checks are the test, keep them in any build
+#undef NDEBUG
+
+#include "hotnesstracker.h"
+
+#include <cassert>
+#include <iostream>
+
+int main() {
+  HotnessTracker tracker;
+  HotnessTracker::Config config;
+  config.hot_threshold = 4;
+  config.cold_threshold = 2;
+  assert(tracker.init(config, 1024) == 0);
+  auto sweep = [&](uint64_t time) {
+    return tracker.sweep(time, tracker.size(), [](uint64_t) {});
+  };
+
+  // a page hot on nodes 0 and 1, by 8 threads
+  for (uint32_t tid = 1; tid <= 8; tid++)
+    tracker.record(0x100, 0, 1, 0, HotnessTracker::ACCESS_LOAD, tid % 2, tid);
+  HotnessTracker::Page page;
+  assert(tracker.query(0x100, 0, &page) == 0);
+  assert(page.hot);
+  assert(page.nodes == 0b11);
+  assert(page.threads > 4);
+  std::vector<uint64_t> pages;
+  tracker.sharedPages(&pages);
+  assert(pages.size() == 1 && pages[0] == 0x100);
+
+  // node 1 and its threads go away, one thread of node 0 keeps it hot
+  for (uint64_t time = 10; time <= 30; time += 10) {
+    for (int i = 0; i < 4; i++)
+      tracker.record(0x100, time, 1, 0, HotnessTracker::ACCESS_LOAD, 0, 2);
+    // node 1 is still seen until a second sweep passes the page
+    assert(tracker.query(0x100, time, &page) == 0);
+    assert(page.nodes == (time <= 20 ? 0b11U : 0b01U));
+    sweep(time);
+  }
+  assert(tracker.query(0x100, 30, &page) == 0);
+  assert(page.hot);
+  assert(page.threads < 2);
+  tracker.sharedPages(&pages);
+  assert(pages.empty());
+  std::vector<int> nodes;
+  tracker.remotePages(1, &pages, &nodes);
+  assert(pages.size() == 1 && nodes[0] == 0);
+
+  // a page going cold loses its sharers at once
+  tracker.record(0x200, 30, 4, 0, HotnessTracker::ACCESS_LOAD, 3, 7);
+  assert(tracker.query(0x200, 30, &page) == 0);
+  assert(page.hot && page.nodes == 0b1000);
+  sweep(30 + 2 * 60000);
+  assert(tracker.query(0x200, 30 + 2 * 60000, &page) == 0);
+  assert(!page.hot && page.nodes == 0 && page.threads == 0);
+
+  // a page looked at alone decays as the kernels decay all of them
+  HotnessTracker decayed;
+  config.recency_weight = 2;
+  assert(decayed.init(config, 16) == 0);
+  decayed.record(0x300, 1000, 3);
+  const HotnessKernels &scalar =
+      HotnessKernels::get(HotnessKernels::ISA_SCALAR);
+  for (uint32_t age = 1; age < 200000; age = age * 3 + 7) {
+    assert(decayed.query(0x300, 1000 + age, &page) == 0);
+    float frequency = 3, score;
+    uint32_t last = 0;
+    HotnessKernels::Decay decay = {
+        age, (float)(1 / config.half_life_ms), config.recency_weight,
+        (float)(1 / config.recency_half_life_ms)};
+    scalar.score(&frequency, &last, 1, decay, &score);
+    assert(page.score == score);
+  }
+
+  std::cout << "ok\n";
+  return 0;
+}
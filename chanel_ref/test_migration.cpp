@@ -0,0 +1,54 @@
+#include "migrationengine.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+static void on_batch(void *privdata, const MigrationEngine::Batch *batch) {
+  printf("%s: %lu pages, moved: %lu, retried: %lu, failed: %lu, "
+         "latency: %.0f us, %.1f MiB/s\n",
+         batch->promote ? "promote" : "demote", batch->pages, batch->moved,
+         batch->retried, batch->failed, batch->latency_us, batch->mbps);
+}
+
+int main(int argc, char *argv[]) {
+  size_t mib, rate;
+  if (argc != 3 || sscanf(argv[1], "%lu", &mib) != 1 ||
+      sscanf(argv[2], "%lu", &rate) != 1) {
+    printf("USAGE: %s <MiB to move> <MiB per second>\n", argv[0]);
+    return 1;
+  }
+  size_t pages = mib << 8;
+  char *region = (char *)mmap(NULL, pages * 4096, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED)
+    return -errno;
+  memset(region, 1, pages * 4096);
+  MigrationEngine engine;
+  MigrationEngine::Config config;
+  config.bytes_per_sec = rate << 20;
+  int ret = engine.init(config, NULL, on_batch);
+  if (ret)
+    return ret;
+  printf("emulated: %d\n", engine.emulated());
+  std::vector<uint64_t> addresses(pages);
+  std::vector<float> scores(pages);
+  for (size_t i = 0; i < pages; i++) {
+    addresses[i] = (uint64_t)(region + i * 4096);
+    scores[i] = rand() % 1000;
+  }
+  // demote all, then bring the first half back
+  ret = engine.submit(0, addresses.data(), scores.data(), pages, false);
+  if (ret == 0)
+    ret = engine.submit(0, addresses.data(), scores.data(), pages / 2, true);
+  if (ret)
+    return ret;
+  while (engine.pending() > 0)
+    usleep(10000);
+  MigrationEngine::Stats stats;
+  engine.getStats(&stats);
+  printf("batches: %lu, moved: %lu, retried: %lu, failed: %lu, "
+         "mean latency: %.0f us\n",
+         stats.batches, stats.moved, stats.retried, stats.failed,
+         stats.batches > 0 ? stats.latency_us / stats.batches : 0);
+  return 0;
+}
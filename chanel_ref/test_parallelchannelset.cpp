@@ -0,0 +1,98 @@
+#include "parallelchannelset.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+static std::atomic<size_t> total;
+
+void on_batch(void *privdata, const Channel::Sample *samples, size_t count) {
+  total += count;
+}
+
+void on_exit(void *privdata, pid_t pid) { printf("exit: %d\n", pid); }
+
+// With MODE_PER_CPU, a process that exits on the cpu of one shard must be
+// dropped by every shard.
+static int check_exit(ParallelChannelSet &cs) {
+  pid_t child = fork();
+  if (child < 0)
+    return -errno;
+  if (child == 0) {
+    // outlive add(), then exit on whatever cpu it runs on
+    usleep(500000);
+    _exit(0);
+  }
+  int ret = cs.add(child);
+  if (ret)
+    return ret;
+  waitpid(child, NULL, 0);
+  // the readers poll every few ms, give them a second at most
+  for (int i = 0; i < 100 && cs.contains(child); i++)
+    usleep(10000);
+  if (cs.contains(child)) {
+    printf("exited process %d is still sampled\n", child);
+    return 1;
+  }
+  printf("exited process %d is dropped by every shard\n", child);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long period;
+  size_t shards;
+  ChannelSet::Mode mode = ChannelSet::MODE_PER_PROCESS;
+  int first = 3;
+  if (argc > 3 && strcmp(argv[3], "percpu") == 0) {
+    mode = ChannelSet::MODE_PER_CPU;
+    first = 4;
+  }
+  if (argc < first + 1 || sscanf(argv[1], "%lu", &period) != 1 ||
+      sscanf(argv[2], "%lu", &shards) != 1) {
+  wrong_arguments:
+    printf("USAGE: %s <period> <shards> [percpu] <pid1> <pid2> ...\n",
+           argv[0]);
+    return 1;
+  }
+  std::set<pid_t> pids;
+  for (int i = first; i < argc; i++) {
+    pid_t pid;
+    if (sscanf(argv[i], "%d", &pid) != 1)
+      goto wrong_arguments;
+    pids.insert(pid);
+  }
+  ParallelChannelSet cs;
+  std::set<Channel::Type> types;
+  types.insert(Channel::CHANNEL_LOAD);
+  types.insert(Channel::CHANNEL_STORE);
+  Channel::Options options;
+  options.ring_pages = 64;
+  options.wakeup = Channel::WAKEUP_ADAPTIVE;
+  int ret = cs.init(types, options, mode, shards);
+  if (ret)
+    return ret;
+  ret = cs.setPeriod(period);
+  if (ret)
+    return ret;
+  ret = cs.update(pids);
+  if (ret)
+    return ret;
+  ret = cs.start(0, NULL, on_batch, on_exit);
+  if (ret)
+    return ret;
+  if (mode == ChannelSet::MODE_PER_CPU) {
+    ret = check_exit(cs);
+    if (ret)
+      return ret;
+  }
+  while (true) {
+    sleep(1);
+    // a reader that failed no longer reads its shard
+    if (cs.getError() < 0)
+      return cs.stop();
+    ParallelChannelSet::Stats stats;
+    cs.getStats(&stats);
+    printf("total: %lu, batches: %lu, stolen: %lu, dropped: %lu\n",
+           total.load(), stats.batches, stats.stolen, stats.dropped);
+  }
+  return 0;
+}
@@ -0,0 +1,86 @@
+#include "channelset.h"
+#include "regionmonitor.h"
+
+#include <algorithm>
+#include <time.h>
+
+// densest regions reported after each poll
+#define REPORT_REGIONS 4
+
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void on_sample(void *privdata, Channel::Sample *sample) {
+  RegionMonitor *monitor = (RegionMonitor *)privdata;
+  monitor->record(sample->pid, sample->address);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long period;
+  if (argc < 3 || sscanf(argv[1], "%lu", &period) != 1) {
+  wrong_arguments:
+    printf("USAGE: %s <period> <pid1> <pid2> ...\n", argv[0]);
+    return 1;
+  }
+  std::set<pid_t> pids;
+  for (int i = 2; i < argc; i++) {
+    pid_t pid;
+    if (sscanf(argv[i], "%d", &pid) != 1)
+      goto wrong_arguments;
+    pids.insert(pid);
+  }
+  ChannelSet cs;
+  std::set<Channel::Type> types;
+  types.insert(Channel::CHANNEL_LOAD);
+  types.insert(Channel::CHANNEL_STORE);
+  int ret = cs.init(types);
+  if (ret)
+    return ret;
+  ret = cs.setPeriod(period);
+  if (ret)
+    return ret;
+  ret = cs.update(pids);
+  if (ret)
+    return ret;
+  RegionMonitor monitor;
+  ret = monitor.init(RegionMonitor::Config());
+  if (ret)
+    return ret;
+  for (pid_t pid : pids) {
+    ret = monitor.add(pid);
+    if (ret)
+      return ret;
+  }
+  while (true) {
+    ssize_t ret = cs.pollSamples(100, &monitor, on_sample, NULL);
+    if (ret < 0)
+      return (int)ret;
+    ret = monitor.tick(now_ms());
+    if (ret < 0)
+      return (int)ret;
+    for (pid_t pid : pids) {
+      std::vector<RegionMonitor::Region> regions;
+      if (monitor.getRegions(pid, &regions) < 0)
+        continue;
+      size_t count = std::min(regions.size(), (size_t)REPORT_REGIONS);
+      std::partial_sort(regions.begin(), regions.begin() + count,
+                        regions.end(),
+                        [](const RegionMonitor::Region &a,
+                           const RegionMonitor::Region &b) {
+                          return a.density > b.density;
+                        });
+      printf("pid: %d, regions: %lu\n", pid, regions.size());
+      for (size_t i = 0; i < count; i++)
+        printf("  [%lx, %lx), density: %.3f, age: %u\n", regions[i].start,
+               regions[i].end, regions[i].density, regions[i].age);
+    }
+    RegionMonitor::Stats stats;
+    monitor.getStats(&stats);
+    printf("samples: %lu, unmapped: %lu, splits: %lu, merges: %lu\n",
+           stats.samples, stats.unmapped, stats.splits, stats.merges);
+  }
+  return 0;
+}
@@ -0,0 +1,65 @@
+#include "topology.h"
+
+#include <fstream>
+#include <string>
+
+Topology::Topology() { m_node_count = 0; }
+
+int Topology::readCpuList(const char *path, std::vector<int> &cpus) {
+  std::ifstream file(path);
+  if (!file)
+    ERROR({}, -ENOENT, false, "failed to open %s", path);
+  std::string range;
+  while (std::getline(file, range, ',')) {
+    int first, last;
+    int count = sscanf(range.c_str(), "%d-%d", &first, &last);
+    if (count < 1)
+      continue;
+    if (count == 1)
+      last = first;
+    for (int cpu = first; cpu <= last; cpu++)
+      cpus.push_back(cpu);
+  }
+  return 0;
+}
+
+int Topology::init() {
+  m_cpus.clear();
+  m_nodes.clear();
+  int ret = readCpuList("/sys/devices/system/cpu/online", m_cpus);
+  if (ret < 0)
+    ERROR({}, ret, false, "readCpuList(...) failed");
+  if (m_cpus.empty())
+    ERROR({}, -ENOENT, false, "no online cpu");
+  m_nodes.assign(m_cpus.back() + 1, -1);
+  for (int cpu : m_cpus)
+    m_nodes[cpu] = 0;
+  m_node_count = 1;
+  std::vector<int> nodes;
+  if (readCpuList("/sys/devices/system/node/online", nodes) < 0)
+    return 0;
+  for (int node : nodes) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    std::vector<int> cpus;
+    if (readCpuList(path, cpus) < 0)
+      continue;
+    for (int cpu : cpus)
+      if (cpu < (int)m_nodes.size() && m_nodes[cpu] >= 0)
+        m_nodes[cpu] = node;
+    if (node + 1 > m_node_count)
+      m_node_count = node + 1;
+  }
+  return 0;
+}
+
+const std::vector<int> &Topology::getCpus() { return m_cpus; }
+
+int Topology::getNode(int cpu) {
+  if (cpu < 0 || cpu >= (int)m_nodes.size())
+    return -1;
+  return m_nodes[cpu];
+}
+
+int Topology::getNodeCount() { return m_node_count; }
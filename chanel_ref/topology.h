@@ -0,0 +1,46 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include "common.h"
+
+#include <vector>
+
+/* The online cpus and the NUMA node each of them belongs to, read from sysfs.
+ */
+class Topology {
+public:
+  Topology();
+
+  /* Load the topology of this machine.
+   * RETURN: 0 if OK, or a negative error code
+   * NOTE: without /sys/devices/system/node, every cpu is put on node 0.
+   */
+  int init();
+
+  /* Get the online cpus, in ascending order.
+   */
+  const std::vector<int> &getCpus();
+
+  /* Get the node of a cpu.
+   * RETURN: the node, or -1 if <cpu> is not online.
+   */
+  int getNode(int cpu);
+
+  /* Get the count of nodes, i.e. the max node id + 1.
+   */
+  int getNodeCount();
+
+  /* Parse a cpu list file like "0-3,8-11".
+   *      path: the file to read
+   *      cpus: the vector to append the cpus to
+   * RETURN: 0 if OK, or a negative error code
+   */
+  static int readCpuList(const char *path, std::vector<int> &cpus);
+
+private:
+  std::vector<int> m_cpus;  // online cpus
+  std::vector<int> m_nodes; // node of each cpu, indexed by cpu, or -1
+  int m_node_count;         // max node id + 1
+};
+
+#endif
@@ -1,68 +1,237 @@
-#include <fcntl.h>
-#include <stdexcept>
-#include <string>
-#include <sys/mman.h>
-#include <unistd.h>
+#include "cxl_mem.h"
 
-class MemoryMapper {
-public:
-//"/dev/dax0.0"
-  MemoryMapper(const std::string &filename, size_t size)
-      : fd_(-1), addr_(nullptr), size_(size) {
-    fd_ = open(filename.c_str(), O_RDWR);
-    if (fd_ == -1) {
-      throw std::runtime_error("Error opening file: " + filename);
-    }
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <linux/magic.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <thread>
+#include <vector>
 
-    addr_ = static_cast<char *>(
-        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0));
-    if (addr_ == MAP_FAILED) {
-      close(fd_);
-      throw std::runtime_error("Error mapping file: " + filename);
-    }
-  }
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+#ifndef MFD_HUGE_SHIFT
+#define MFD_HUGE_SHIFT 26
+#endif
 
-  ~MemoryMapper() {
-    if (addr_ != nullptr) {
-      munmap(addr_, size_);
-    }
-    if (fd_ != -1) {
-      close(fd_);
-    }
-  }
+constexpr size_t kPageSize = 4096;
+constexpr size_t kHugePageSize = 2UL << 20;
 
-  char *getAddr() const { return addr_; }
-  size_t getSize() const { return size_; }
+static std::string errorOf(const std::string &what, const std::string &path) {
+  return what + " " + path + ": " + strerror(errno);
+}
 
-  MemoryMapper(const MemoryMapper &) = delete;
-  MemoryMapper &operator=(const MemoryMapper &) = delete;
+// Reads the first number of a sysfs file, or returns <fallback>.
+static long long readNumber(const std::string &path, long long fallback) {
+  std::ifstream file(path);
+  long long value;
+  if (!(file >> value))
+    return fallback;
+  return value;
+}
 
-private:
-  int fd_;
-  char *addr_;
-  size_t size_;
-};
+// Reads a list like "0-3,8-11" of a sysfs file.
+static std::vector<int> readList(const std::string &path) {
+  std::vector<int> values;
+  std::ifstream file(path);
+  std::string range;
+  while (std::getline(file, range, ',')) {
+    int first, last;
+    int count = sscanf(range.c_str(), "%d-%d", &first, &last);
+    if (count < 1)
+      continue;
+    if (count == 1)
+      last = first;
+    for (int value = first; value <= last; value++)
+      values.push_back(value);
+  }
+  return values;
+}
 
-class CXLMem {
-public:
-  explicit CXLMem(const MemoryMapper &mapper) : mapper_(mapper) {}
+// The cpus of <node>, or of the nearest node with cpus if it has none, as a
+// CXL node does not. Empty if the node is not known.
+static std::vector<int> cpusNear(int node) {
+  std::string dir = "/sys/devices/system/node/node";
+  std::vector<int> cpus = readList(dir + std::to_string(node) + "/cpulist");
+  if (!cpus.empty())
+    return cpus;
+  std::ifstream file(dir + std::to_string(node) + "/distance");
+  std::vector<std::pair<int, int>> nearest; // (distance, node)
+  int distance;
+  for (int other = 0; file >> distance; other++)
+    if (other != node)
+      nearest.emplace_back(distance, other);
+  std::sort(nearest.begin(), nearest.end());
+  for (auto &[distance, other] : nearest) {
+    cpus = readList(dir + std::to_string(other) + "/cpulist");
+    if (!cpus.empty())
+      break;
+  }
+  return cpus;
+}
 
-  template <typename T> T *accessData(size_t offset = 0) {
-    checkOffset(offset, sizeof(T));
-    return reinterpret_cast<T *>(mapper_.getAddr() + offset);
+MemoryMapper::MemoryMapper(const std::string &filename, const Options &options)
+    : fd_(-1), addr_(nullptr), size_(options.size), alignment_(0), node_(-1) {
+  fd_ = open(filename.c_str(), O_RDWR | (options.create ? O_CREAT : 0), 0666);
+  if (fd_ == -1) {
+    throw std::runtime_error(errorOf("Error opening file:", filename));
   }
+  try {
+    struct stat st;
+    if (fstat(fd_, &st) == -1) {
+      throw std::runtime_error(errorOf("Error getting the size of", filename));
+    }
+    if (S_ISCHR(st.st_mode)) {
+      // a devdax device, described by sysfs
+      std::string name = filename.substr(filename.rfind('/') + 1);
+      std::string dir = "/sys/bus/dax/devices/" + name + "/";
+      size_t device_size = readNumber(dir + "size", 0);
+      if (size_ == 0)
+        size_ = device_size;
+      if (device_size != 0 && size_ > device_size)
+        throw std::runtime_error("Mapping exceeds the size of " + filename);
+      // kernels before 5.10 have no align, and map devdax at 2 MiB
+      alignment_ = readNumber(dir + "align", kHugePageSize);
+      node_ = readNumber(dir + "target_node", readNumber(dir + "numa_node", -1));
+    } else {
+      if (size_ == 0)
+        size_ = st.st_size;
+      if (size_ > (size_t)st.st_size) {
+        // pages past the end of the file would fault with SIGBUS
+        if (!options.create)
+          throw std::runtime_error("Mapping exceeds the size of " + filename);
+        if (ftruncate(fd_, size_) == -1)
+          throw std::runtime_error(
+              errorOf("Error setting file size:", filename));
+      }
+      struct statfs fs;
+      if (fstatfs(fd_, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC)
+        alignment_ = fs.f_bsize;
+    }
+    map(filename, options);
+  } catch (...) {
+    close(fd_);
+    throw;
+  }
+}
 
-  char *getRawData(size_t offset = 0) {
-    checkOffset(offset, 1); // Minimal check for offset
-    return mapper_.getAddr() + offset;
+MemoryMapper::MemoryMapper(int fd, const std::string &name,
+                           const Options &options)
+    : fd_(fd), addr_(nullptr), size_(options.size), alignment_(0), node_(-1) {
+  try {
+    if (ftruncate(fd_, size_) == -1)
+      throw std::runtime_error(errorOf("Error setting file size:", name));
+    map(name, options);
+  } catch (...) {
+    close(fd_);
+    throw;
   }
+}
 
-private:
-  const MemoryMapper &mapper_;
+std::unique_ptr<MemoryMapper>
+MemoryMapper::createMemfd(const std::string &name, size_t size,
+                          size_t huge_page_size) {
+  unsigned flags = MFD_CLOEXEC;
+  if (huge_page_size != 0)
+    flags |= MFD_HUGETLB | (__builtin_ctzl(huge_page_size) << MFD_HUGE_SHIFT);
+  int fd = memfd_create(name.c_str(), flags);
+  if (fd == -1)
+    throw std::runtime_error(errorOf("Error creating memfd:", name));
+  Options options;
+  options.size = size;
+  options.alignment = huge_page_size;
+  return std::unique_ptr<MemoryMapper>(new MemoryMapper(fd, name, options));
+}
 
-  void checkOffset(size_t offset, size_t size) const {
-    if (offset + size > mapper_.getSize()) {
-      throw std::runtime_error("Offset and size exceed mapped region");
-    }
+void MemoryMapper::map(const std::string &filename, const Options &options) {
+  if (size_ == 0)
+    throw std::runtime_error("Nothing to map in " + filename);
+  if (options.alignment != 0)
+    alignment_ = options.alignment;
+  // huge pages need the address aligned as well as the offset
+  if (alignment_ < kHugePageSize && size_ >= kHugePageSize)
+    alignment_ = kHugePageSize;
+  if (alignment_ < kPageSize)
+    alignment_ = kPageSize;
+  // reserve room to align, then map the backing over the aligned part
+  size_t reserved = size_ + alignment_;
+  char *base = static_cast<char *>(mmap(nullptr, reserved, PROT_NONE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS |
+                                            MAP_NORESERVE,
+                                        -1, 0));
+  if (base == MAP_FAILED)
+    throw std::runtime_error(errorOf("Error reserving space for", filename));
+  char *aligned = reinterpret_cast<char *>(
+      ((uintptr_t)base + alignment_ - 1) & ~(uintptr_t)(alignment_ - 1));
+  int flags = MAP_FIXED | (options.populate ? MAP_POPULATE : 0);
+  void *addr = MAP_FAILED;
+  if (options.sync)
+    addr = mmap(aligned, size_, PROT_READ | PROT_WRITE,
+                MAP_SHARED_VALIDATE | MAP_SYNC | flags, fd_, 0);
+  // MAP_SYNC is for DAX filesystems only
+  if (addr == MAP_FAILED)
+    addr = mmap(aligned, size_, PROT_READ | PROT_WRITE, MAP_SHARED | flags,
+                fd_, 0);
+  if (addr == MAP_FAILED) {
+    std::string error = errorOf("Error mapping file:", filename);
+    munmap(base, reserved);
+    throw std::runtime_error(error);
+  }
+  if (aligned > base)
+    munmap(base, aligned - base);
+  if (base + reserved > aligned + size_)
+    munmap(aligned + size_, base + reserved - (aligned + size_));
+  addr_ = aligned;
+}
+
+void MemoryMapper::prefault(size_t threads, int node) {
+  if (node < 0)
+    node = node_;
+  std::vector<int> cpus;
+  if (node >= 0)
+    cpus = cpusNear(node);
+  if (threads == 0)
+    threads = cpus.empty() ? std::thread::hardware_concurrency() : cpus.size();
+  if (threads == 0)
+    threads = 1;
+  // whole units of the alignment to each thread, so no huge page is split
+  size_t units = (size_ + alignment_ - 1) / alignment_;
+  threads = std::min(threads, units);
+  std::vector<std::thread> workers;
+  std::atomic<int> error(0); // errno of the first thread that failed
+  for (size_t i = 0; i < threads; i++) {
+    size_t begin = std::min(units * i / threads * alignment_, size_);
+    size_t end = std::min(units * (i + 1) / threads * alignment_, size_);
+    workers.emplace_back([this, &cpus, &error, begin, end] {
+      if (!cpus.empty()) {
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        for (int cpu : cpus)
+          CPU_SET(cpu, &mask);
+        // not fatal, the pages are just faulted from anywhere
+        sched_setaffinity(0, sizeof(mask), &mask);
+      }
+      if (madvise(addr_ + begin, end - begin, MADV_POPULATE_WRITE) == 0)
+        return;
+      if (errno != EINVAL) {
+        int expected = 0;
+        error.compare_exchange_strong(expected, errno);
+        return;
+      }
+      // before Linux 5.14, write faults that leave the contents as they are
+      for (size_t offset = begin; offset < end; offset += kPageSize)
+        __atomic_fetch_add(addr_ + offset, 0, __ATOMIC_RELAXED);
+    });
+  }
+  for (auto &worker : workers)
+    worker.join();
+  if (error != 0) {
+    errno = error;
+    throw std::runtime_error(errorOf("Error prefaulting", "the mapping"));
   }
-};
+}
@@ -0,0 +1,103 @@
+#ifndef CXL_MEM_H
+#define CXL_MEM_H
+
+#include <fcntl.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Maps a devdax device (e.g. "/dev/dax0.0"), a file or a memfd in full or in
+// part, aligned to the pages backing it.
+//
+// The size, alignment and NUMA node of a devdax device come from
+// /sys/bus/dax/devices/<name>, those of a file from fstat() and fstatfs(), so
+// hugetlbfs files are aligned to their huge pages. A mapping is placed at a
+// multiple of its alignment, 2 MiB at least for anything larger, so that the
+// kernel can back it with huge pages. prefault() faults it in from several
+// threads on the cpus of its node, instead of serializing the first touches.
+class MemoryMapper {
+public:
+  struct Options {
+    size_t size = 0;      // bytes to map, 0 for the whole device or file
+    size_t alignment = 0; // of the address, 0 to derive it from the backing
+    bool create = false;  // create the file, or grow it to <size>
+    bool populate = false; // fault the mapping in at mmap() (MAP_POPULATE)
+    bool sync = false;    // MAP_SYNC, for files on a DAX filesystem; falls
+                          // back to MAP_SHARED where not supported
+  };
+
+  //"/dev/dax0.0"
+  MemoryMapper(const std::string &filename, size_t size)
+      : MemoryMapper(filename, Options{size}) {}
+
+  MemoryMapper(const std::string &filename, const Options &options);
+
+  // An anonymous memfd of <size> bytes, on huge pages of <huge_page_size>
+  // (2 MiB or 1 GiB) unless 0. Stands in for devdax where there is none.
+  static std::unique_ptr<MemoryMapper>
+  createMemfd(const std::string &name, size_t size, size_t huge_page_size = 0);
+
+  ~MemoryMapper() {
+    if (addr_ != nullptr) {
+      munmap(addr_, size_);
+    }
+    if (fd_ != -1) {
+      close(fd_);
+    }
+  }
+
+  // Faults every page in, from <threads> threads (0 for one per cpu) pinned to
+  // the cpus of <node> (-1 for the node of the backing, or any cpu if unknown).
+  // Contents are left as they are. Throws std::runtime_error if a page
+  // cannot be faulted in, e.g. for lack of memory.
+  void prefault(size_t threads = 0, int node = -1);
+
+  char *getAddr() const { return addr_; }
+  size_t getSize() const { return size_; }
+  int getFd() const { return fd_; }
+  size_t getAlignment() const { return alignment_; }
+  // The NUMA node of the backing, or -1 if unknown.
+  int getNode() const { return node_; }
+
+  MemoryMapper(const MemoryMapper &) = delete;
+  MemoryMapper &operator=(const MemoryMapper &) = delete;
+
+private:
+  MemoryMapper(int fd, const std::string &name, const Options &options);
+
+  void map(const std::string &filename, const Options &options);
+
+  int fd_;
+  char *addr_;
+  size_t size_;
+  size_t alignment_;
+  int node_;
+};
+
+class CXLMem {
+public:
+  explicit CXLMem(const MemoryMapper &mapper) : mapper_(mapper) {}
+
+  template <typename T> T *accessData(size_t offset = 0) {
+    checkOffset(offset, sizeof(T));
+    return reinterpret_cast<T *>(mapper_.getAddr() + offset);
+  }
+
+  char *getRawData(size_t offset = 0) {
+    checkOffset(offset, 1); // Minimal check for offset
+    return mapper_.getAddr() + offset;
+  }
+
+private:
+  const MemoryMapper &mapper_;
+
+  void checkOffset(size_t offset, size_t size) const {
+    if (offset + size > mapper_.getSize()) {
+      throw std::runtime_error("Offset and size exceed mapped region");
+    }
+  }
+};
+
+#endif
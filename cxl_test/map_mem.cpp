@@ -0,0 +1,42 @@
+#include "cxl_mem.h"
+
+#include <chrono>
+#include <iostream>
+
+// Maps a devdax device, a file or a memfd, and times its prefault.
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 4) {
+    std::cerr << "Usage: " << argv[0]
+              << " </dev/daxX.Y | file | memfd> [MiB] [threads]\n"
+              << "  MiB defaults to the whole device or file, threads to "
+                 "the cpus of its node\n";
+    return 1;
+  }
+  std::string path = argv[1];
+  size_t size = argc > 2 ? std::stoul(argv[2]) << 20 : 0;
+  size_t threads = argc > 3 ? std::stoul(argv[3]) : 0;
+  try {
+    std::unique_ptr<MemoryMapper> mapper;
+    if (path == "memfd") {
+      mapper = MemoryMapper::createMemfd("map_mem", size);
+    } else {
+      MemoryMapper::Options options;
+      options.size = size;
+      mapper = std::make_unique<MemoryMapper>(path, options);
+    }
+    std::cout << "size: " << mapper->getSize()
+              << ", alignment: " << mapper->getAlignment()
+              << ", node: " << mapper->getNode() << std::endl;
+    auto start = std::chrono::steady_clock::now();
+    mapper->prefault(threads);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << "prefault: " << elapsed.count() << " s, "
+              << mapper->getSize() / elapsed.count() / (1 << 30) << " GiB/s"
+              << std::endl;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << '\n';
+    return 1;
+  }
+  return 0;
+}
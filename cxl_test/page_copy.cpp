@@ -0,0 +1,133 @@
+#include "page_copy.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+constexpr size_t kPageSize = 4096;
+
+static void copyScalar(void *dst, const void *src, size_t size,
+                       size_t prefetch) {
+  memcpy(dst, src, size);
+}
+
+#if defined(__x86_64__)
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+#define AVX512_TARGET __attribute__((target("avx512f")))
+
+// Copies the bytes up to the first <alignment> boundary of <dst>, and returns
+// how many it copied.
+static size_t copyHead(void *dst, const void *src, size_t size,
+                       size_t alignment) {
+  size_t head = -(uintptr_t)dst & (alignment - 1);
+  head = std::min(head, size);
+  memcpy(dst, src, head);
+  return head;
+}
+
+AVX2_TARGET static void copyAvx2(void *dst, const void *src, size_t size,
+                                 size_t prefetch) {
+  size_t head = copyHead(dst, src, size, 32);
+  char *d = static_cast<char *>(dst) + head;
+  const char *s = static_cast<const char *>(src) + head;
+  size -= head;
+  // a cache line of each of two streams per iteration
+  for (; size >= 128; size -= 128, s += 128, d += 128) {
+    _mm_prefetch(s + prefetch, _MM_HINT_NTA);
+    _mm_prefetch(s + prefetch + 64, _MM_HINT_NTA);
+    __m256i a = _mm256_loadu_si256((const __m256i *)s);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+    __m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+    _mm256_stream_si256((__m256i *)d, a);
+    _mm256_stream_si256((__m256i *)(d + 32), b);
+    _mm256_stream_si256((__m256i *)(d + 64), c);
+    _mm256_stream_si256((__m256i *)(d + 96), e);
+  }
+  // streaming stores are weakly ordered, publish them before returning
+  _mm_sfence();
+  memcpy(d, s, size);
+}
+
+AVX512_TARGET static void copyAvx512(void *dst, const void *src, size_t size,
+                                     size_t prefetch) {
+  size_t head = copyHead(dst, src, size, 64);
+  char *d = static_cast<char *>(dst) + head;
+  const char *s = static_cast<const char *>(src) + head;
+  size -= head;
+  for (; size >= 256; size -= 256, s += 256, d += 256) {
+    _mm_prefetch(s + prefetch, _MM_HINT_NTA);
+    _mm_prefetch(s + prefetch + 64, _MM_HINT_NTA);
+    _mm_prefetch(s + prefetch + 128, _MM_HINT_NTA);
+    _mm_prefetch(s + prefetch + 192, _MM_HINT_NTA);
+    __m512i a = _mm512_loadu_si512(s);
+    __m512i b = _mm512_loadu_si512(s + 64);
+    __m512i c = _mm512_loadu_si512(s + 128);
+    __m512i e = _mm512_loadu_si512(s + 192);
+    _mm512_stream_si512((__m512i *)d, a);
+    _mm512_stream_si512((__m512i *)(d + 64), b);
+    _mm512_stream_si512((__m512i *)(d + 128), c);
+    _mm512_stream_si512((__m512i *)(d + 192), e);
+  }
+  _mm_sfence();
+  memcpy(d, s, size);
+}
+
+#endif
+
+static const PageCopy KERNELS[] = {
+    {copyScalar, PageCopy::ISA_SCALAR},
+#if defined(__x86_64__)
+    {copyAvx2, PageCopy::ISA_AVX2},
+    {copyAvx512, PageCopy::ISA_AVX512},
+#endif
+};
+
+// The best instruction set of this cpu.
+static PageCopy::Isa supportedIsa() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return PageCopy::ISA_AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return PageCopy::ISA_AVX2;
+#endif
+  return PageCopy::ISA_SCALAR;
+}
+
+const PageCopy &PageCopy::get(Isa isa) {
+  static const Isa supported = supportedIsa();
+  return KERNELS[std::min(isa, supported)];
+}
+
+const PageCopy &PageCopy::best() { return get(ISA_AVX512); }
+
+void PageCopy::copyParallel(void *dst, const void *src, size_t size,
+                            size_t threads) const {
+  if (threads == 0)
+    threads = std::max(1U, std::thread::hardware_concurrency());
+  size_t pages = (size + kPageSize - 1) / kPageSize;
+  threads = std::min(threads, pages);
+  if (threads <= 1) {
+    copy(dst, src, size);
+    return;
+  }
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < threads; i++) {
+    size_t begin = std::min(pages * i / threads * kPageSize, size);
+    size_t end = std::min(pages * (i + 1) / threads * kPageSize, size);
+    workers.emplace_back([this, dst, src, begin, end] {
+      copy(static_cast<char *>(dst) + begin,
+           static_cast<const char *>(src) + begin, end - begin);
+    });
+  }
+  for (auto &worker : workers)
+    worker.join();
+}
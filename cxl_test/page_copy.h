@@ -0,0 +1,48 @@
+#ifndef PAGE_COPY_H
+#define PAGE_COPY_H
+
+#include <cstddef>
+
+// Copies pages between tiers with non-temporal stores, so that moving a page
+// that is probably cold does not evict the hot lines of the LLC, nor read the
+// destination lines in before overwriting them.
+//
+// There is a plain memcpy, an AVX2 and an AVX-512 flavor; the best one the cpu
+// supports is picked at run time. The vector ones prefetch the source well
+// ahead, since it may be on the far tier, whose loads take several times as
+// long as those of DRAM.
+struct PageCopy {
+  enum Isa {
+    ISA_SCALAR, // memcpy, any cpu
+    ISA_AVX2,   // 32-byte streaming stores
+    ISA_AVX512, // 64-byte streaming stores
+  };
+
+  // How far ahead of the loads the source is prefetched, in bytes. About the
+  // bytes in flight to cover a far-tier load at full bandwidth.
+  static constexpr size_t kPrefetchDistance = 2048;
+
+  // Copies <size> bytes; the buffers may have any alignment, but the copy is
+  // the fastest with <dst> on a 64-byte boundary.
+  void copy(void *dst, const void *src, size_t size,
+            size_t prefetch = kPrefetchDistance) const {
+    kernel(dst, src, size, prefetch);
+  }
+
+  // Splits the copy into slices of whole 4 KiB pages, copied from <threads>
+  // threads (0 for one per cpu). Worth it from a few MiB on.
+  void copyParallel(void *dst, const void *src, size_t size,
+                    size_t threads = 0) const;
+
+  void (*kernel)(void *dst, const void *src, size_t size, size_t prefetch);
+  Isa isa;
+
+  // The kernels of an instruction set, or of the best one this cpu supports
+  // below it.
+  static const PageCopy &get(Isa isa);
+
+  // The kernels of the best instruction set this cpu supports.
+  static const PageCopy &best();
+};
+
+#endif
@@ -0,0 +1,104 @@
+// the checks are the test, keep them in any build
+#undef NDEBUG
+
+#include "tiered_arena.h"
+
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+// Both tiers are files on tmpfs here, the CXL one standing in for /dev/dax0.0.
+constexpr size_t kRegionSize = 64UL << 20;
+constexpr size_t kExtentSize = TieredArena::kExtentSize;
+
+int main() {
+  try {
+    DRAMMem dram("/dev/shm/tiered_arena_dram", kRegionSize);
+    DRAMMem cxl("/dev/shm/tiered_arena_cxl", kRegionSize);
+    TieredArena arena(TieredArena::regionOf(dram), TieredArena::regionOf(cxl));
+
+    // small objects keep their address and contents across moves
+    uint64_t *small = static_cast<uint64_t *>(
+        arena.allocate(sizeof(uint64_t) * 4, TieredArena::TIER_CXL));
+    assert(small != nullptr);
+    assert(arena.tierOf(small) == TieredArena::TIER_CXL);
+    for (int i = 0; i < 4; i++)
+      small[i] = 0x1234 + i;
+    assert(arena.promote(small));
+    assert(arena.tierOf(small) == TieredArena::TIER_DRAM);
+    for (int i = 0; i < 4; i++)
+      assert(small[i] == 0x1234 + (uint64_t)i);
+    assert(arena.freeBytes(TieredArena::TIER_CXL) == kRegionSize);
+
+    // large objects move all their extents
+    size_t large_size = 5UL << 20;
+    char *large =
+        static_cast<char *>(arena.allocate(large_size, TieredArena::TIER_DRAM));
+    assert(large != nullptr);
+    memset(large, 0xAB, large_size);
+    assert(arena.demote(large));
+    assert(arena.tierOf(large + large_size - 1) == TieredArena::TIER_CXL);
+    assert(large[0] == (char)0xAB && large[large_size - 1] == (char)0xAB);
+    // through a pointer into its last extent, the whole object moves
+    assert(arena.promote(large + large_size - 1));
+    assert(arena.tierOf(large) == TieredArena::TIER_DRAM);
+    assert(arena.tierOf(large + large_size - 1) == TieredArena::TIER_DRAM);
+    assert(large[0] == (char)0xAB && large[large_size - 1] == (char)0xAB);
+    assert(arena.freeBytes(TieredArena::TIER_CXL) == kRegionSize);
+    arena.deallocate(large + kExtentSize);
+    assert(arena.freeBytes(TieredArena::TIER_CXL) == kRegionSize);
+
+    // threads allocate and free through their caches
+    std::vector<std::thread> threads;
+    std::atomic<int> failures(0);
+    for (int t = 0; t < 4; t++)
+      threads.emplace_back([&arena, &failures, t] {
+        std::vector<uint32_t *> objects;
+        for (int i = 0; i < 10000; i++) {
+          auto *object = static_cast<uint32_t *>(
+              arena.allocate(64, t % 2 ? TieredArena::TIER_CXL
+                                       : TieredArena::TIER_DRAM));
+          if (object == nullptr) {
+            failures++;
+            return;
+          }
+          *object = t * 100000 + i;
+          objects.push_back(object);
+        }
+        for (int i = 0; i < 10000; i++) {
+          if (*objects[i] != (uint32_t)(t * 100000 + i))
+            failures++;
+          arena.deallocate(objects[i]);
+        }
+      });
+    for (auto &thread : threads)
+      thread.join();
+    assert(failures == 0);
+
+    // a tier out of extents refuses to allocate
+    assert(arena.allocate(kRegionSize + 1, TieredArena::TIER_DRAM) == nullptr);
+    arena.deallocate(small);
+
+    // freed large objects give their extents of the view back
+    DRAMMem small_dram("/dev/shm/tiered_arena_small_dram", 8UL << 20);
+    DRAMMem small_cxl("/dev/shm/tiered_arena_small_cxl", 8UL << 20);
+    TieredArena small_arena(TieredArena::regionOf(small_dram),
+                            TieredArena::regionOf(small_cxl));
+    for (int i = 0; i < 32; i++) {
+      void *object = small_arena.allocate(3UL << 20, TieredArena::TIER_DRAM);
+      assert(object != nullptr);
+      small_arena.deallocate(object);
+    }
+    assert(small_arena.freeBytes(TieredArena::TIER_DRAM) == 8UL << 20);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << '\n';
+    return 1;
+  }
+  unlink("/dev/shm/tiered_arena_dram");
+  unlink("/dev/shm/tiered_arena_cxl");
+  unlink("/dev/shm/tiered_arena_small_dram");
+  unlink("/dev/shm/tiered_arena_small_cxl");
+  std::cout << "OK\n";
+  return 0;
+}
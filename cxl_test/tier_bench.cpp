@@ -0,0 +1,234 @@
+#include "cxl_mem.h"
+#include "tmpfs_mem.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <immintrin.h>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+// Latency, bandwidth and loaded latency of one memory tier, as JSON on stdout.
+//
+// The region is split in two: the first half is walked by the pointer chase,
+// the second is streamed through by the bandwidth threads, so that the loaded
+// latency measures the chase while the other half is kept busy.
+
+constexpr size_t kLineSize = 64;
+constexpr size_t kChaseLoads = 1 << 24;
+// Passes over its buffer of a bandwidth thread, the best one counts.
+constexpr int kPasses = 3;
+// Bytes a loading thread reads between two updates of the byte count.
+constexpr size_t kLoadChunk = 1 << 20;
+
+using Clock = std::chrono::steady_clock;
+
+static double secondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Links the lines of <buffer> into one cycle in random order, so neither the
+// prefetchers nor the TLB help.
+static void *buildChase(char *buffer, size_t size) {
+  size_t lines = size / kLineSize;
+  std::vector<size_t> order(lines);
+  for (size_t i = 0; i < lines; i++)
+    order[i] = i;
+  std::shuffle(order.begin() + 1, order.end(), std::mt19937_64(42));
+  for (size_t i = 0; i < lines; i++)
+    *reinterpret_cast<void **>(buffer + order[i] * kLineSize) =
+        buffer + order[(i + 1) % lines] * kLineSize;
+  return buffer;
+}
+
+// Nanoseconds per dependent load.
+static double chase(void *start, size_t loads) {
+  void *p = start;
+  auto begin = Clock::now();
+  for (size_t i = 0; i < loads; i++)
+    p = *static_cast<void **>(p);
+  double seconds = secondsSince(begin);
+  // keep <p> alive
+  asm volatile("" : : "r"(p));
+  return seconds * 1e9 / loads;
+}
+
+// <text> as a JSON string, quotes included.
+static std::string jsonString(const std::string &text) {
+  std::string json = "\"";
+  for (unsigned char c : text) {
+    if (c == '"' || c == '\\') {
+      json += '\\';
+      json += c;
+    } else if (c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      json += escaped;
+    } else {
+      json += c;
+    }
+  }
+  return json + '"';
+}
+
+enum Kernel { KERNEL_READ, KERNEL_WRITE, KERNEL_COPY, KERNEL_NT_WRITE };
+
+static const char *kernelName(Kernel kernel) {
+  switch (kernel) {
+  case KERNEL_READ:
+    return "read";
+  case KERNEL_WRITE:
+    return "write";
+  case KERNEL_COPY:
+    return "copy";
+  case KERNEL_NT_WRITE:
+    return "nt_write";
+  }
+  return "";
+}
+
+// Runs <kernel> once over <buffer>, returns the bytes moved.
+static size_t runKernel(Kernel kernel, char *buffer, size_t size) {
+  uint64_t *words = reinterpret_cast<uint64_t *>(buffer);
+  size_t count = size / sizeof(uint64_t);
+  switch (kernel) {
+  case KERNEL_READ: {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < count; i++)
+      sum += words[i];
+    asm volatile("" : : "r"(sum));
+    return size;
+  }
+  case KERNEL_WRITE:
+    for (size_t i = 0; i < count; i++)
+      words[i] = i;
+    asm volatile("" : : : "memory");
+    return size;
+  case KERNEL_COPY:
+    // a read and a write of each byte, as STREAM counts it
+    memcpy(buffer + size / 2, buffer, size / 2);
+    return size;
+  case KERNEL_NT_WRITE: {
+    __m128i value = _mm_set1_epi64x(1);
+    __m128i *lines = reinterpret_cast<__m128i *>(buffer);
+    for (size_t i = 0; i < size / sizeof(__m128i); i++)
+      _mm_stream_si128(lines + i, value);
+    _mm_sfence();
+    return size;
+  }
+  }
+  return 0;
+}
+
+// GiB/s of <threads> threads each running <kernel> over a slice of <buffer>.
+static double bandwidth(Kernel kernel, char *buffer, size_t size,
+                        size_t threads) {
+  size_t slice = size / threads / kLineSize * kLineSize;
+  double best = 0;
+  for (int pass = 0; pass < kPasses; pass++) {
+    std::vector<std::thread> workers;
+    std::atomic<size_t> bytes(0);
+    auto begin = Clock::now();
+    for (size_t t = 0; t < threads; t++)
+      workers.emplace_back([&, t] {
+        bytes += runKernel(kernel, buffer + t * slice, slice);
+      });
+    for (auto &worker : workers)
+      worker.join();
+    best = std::max(best, bytes / secondsSince(begin) / (1 << 30));
+  }
+  return best;
+}
+
+// Chase latency while <threads> threads read through <buffer> nonstop.
+static void loadedLatency(void *start, char *buffer, size_t size,
+                          size_t threads, double *latency, double *gbps) {
+  std::atomic<bool> running(true);
+  std::atomic<size_t> bytes(0);
+  std::vector<std::thread> workers;
+  size_t slice = threads > 0 ? size / threads / kLineSize * kLineSize : 0;
+  for (size_t t = 0; t < threads; t++)
+    workers.emplace_back([&, t] {
+      // counted a chunk at a time, so the chase window sees most of them
+      for (size_t offset = 0; running.load(std::memory_order_relaxed);
+           offset = offset + kLoadChunk < slice ? offset + kLoadChunk : 0)
+        bytes += runKernel(KERNEL_READ, buffer + t * slice + offset,
+                           std::min(kLoadChunk, slice - offset));
+    });
+  // only the chase window is timed, not the start-up and join of the threads
+  size_t first = bytes;
+  auto begin = Clock::now();
+  *latency = chase(start, kChaseLoads / 4);
+  *gbps = (bytes - first) / secondsSince(begin) / (1 << 30);
+  running = false;
+  for (auto &worker : workers)
+    worker.join();
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3 || argc > 4) {
+    std::cerr << "Usage: " << argv[0]
+              << " </dev/daxX.Y | file | memfd | dram:<tmpfs file>> <MiB> "
+                 "[threads]\n";
+    return 1;
+  }
+  std::string target = argv[1];
+  size_t size = std::stoul(argv[2]) << 20;
+  size_t threads = argc > 3 ? std::stoul(argv[3])
+                            : std::max(1U, std::thread::hardware_concurrency());
+  if (threads == 0) {
+    std::cerr << "threads must be at least 1\n";
+    return 1;
+  }
+  try {
+    std::unique_ptr<MemoryMapper> mapper;
+    std::unique_ptr<DRAMMem> dram;
+    char *region;
+    if (target.rfind("dram:", 0) == 0) {
+      dram = std::make_unique<DRAMMem>(target.substr(5), size);
+      region = dram->getAddr();
+    } else {
+      if (target == "memfd")
+        mapper = MemoryMapper::createMemfd("tier_bench", size);
+      else
+        mapper = std::make_unique<MemoryMapper>(target, size);
+      mapper->prefault();
+      region = mapper->getAddr();
+    }
+    // fault everything in before timing anything
+    memset(region, 0, size);
+    char *chase_buffer = region;
+    char *stream_buffer = region + size / 2;
+    size_t half = size / 2;
+    void *start = buildChase(chase_buffer, half);
+
+    std::cout << "{\n  \"target\": " << jsonString(target) << ",\n"
+              << "  \"bytes\": " << size << ",\n"
+              << "  \"threads\": " << threads << ",\n";
+    std::cout << "  \"chase_latency_ns\": " << chase(start, kChaseLoads)
+              << ",\n  \"bandwidth_gibps\": {";
+    for (Kernel kernel :
+         {KERNEL_READ, KERNEL_WRITE, KERNEL_COPY, KERNEL_NT_WRITE})
+      std::cout << (kernel == KERNEL_READ ? "\n" : ",\n") << "    \""
+                << kernelName(kernel) << "\": "
+                << bandwidth(kernel, stream_buffer, half, threads);
+    std::cout << "\n  },\n  \"loaded_latency\": [";
+    // the chase takes a cpu of its own
+    size_t max_load = std::max<size_t>(threads, 2) - 1;
+    for (size_t load = 0; load <= max_load; load++) {
+      double latency, gbps;
+      loadedLatency(start, stream_buffer, half, load, &latency, &gbps);
+      std::cout << (load == 0 ? "\n" : ",\n") << "    {\"threads\": " << load
+                << ", \"bandwidth_gibps\": " << gbps
+                << ", \"latency_ns\": " << latency << "}";
+    }
+    std::cout << "\n  ]\n}" << std::endl;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << '\n';
+    return 1;
+  }
+  return 0;
+}
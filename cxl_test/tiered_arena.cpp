@@ -0,0 +1,318 @@
+#include "tiered_arena.h"
+
+#include "page_copy.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+// Objects a thread moves between its cache and the shared free lists at once.
+constexpr size_t kCacheBatch = 32;
+// Objects of a class a thread caches before giving a batch back.
+constexpr size_t kCacheLimit = 2 * kCacheBatch;
+
+namespace {
+
+std::mutex registry_lock;
+std::map<uint64_t, TieredArena *> registry; // arenas alive, by id
+uint64_t next_id = 1;
+
+} // namespace
+
+// The caches of a thread, given back to their arenas when the thread exits.
+struct TieredArena::ThreadCaches {
+  std::vector<std::pair<uint64_t, Cache *>> caches;
+
+  ~ThreadCaches() {
+    std::lock_guard<std::mutex> lock(registry_lock);
+    for (auto &[id, cache] : caches) {
+      auto it = registry.find(id);
+      if (it != registry.end())
+        it->second->flush(cache);
+    }
+  }
+};
+
+TieredArena::TieredArena(const Region &dram, const Region &cxl,
+                         size_t view_size)
+    : regions_{dram, cxl}, view_(nullptr), view_used_(0) {
+  for (const Region &region : regions_)
+    if (region.size % kExtentSize != 0)
+      throw std::runtime_error("Region is not made of whole 2 MiB extents");
+  if (view_size == 0)
+    view_size = dram.size + cxl.size;
+  view_extents_ = (view_size + kExtentSize - 1) / kExtentSize;
+  // reserve one more extent to align the view to extents
+  size_t reserved = (view_extents_ + 1) * kExtentSize;
+  char *base = static_cast<char *>(mmap(nullptr, reserved, PROT_NONE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS |
+                                            MAP_NORESERVE,
+                                        -1, 0));
+  if (base == MAP_FAILED)
+    throw std::runtime_error("Error reserving the view");
+  view_ = reinterpret_cast<char *>(((uintptr_t)base + kExtentSize - 1) &
+                                   ~(kExtentSize - 1));
+  if (view_ > base)
+    munmap(base, view_ - base);
+  munmap(view_ + view_extents_ * kExtentSize,
+         base + reserved - (view_ + view_extents_ * kExtentSize));
+  extents_.reset(new Extent[view_extents_]());
+  for (size_t i = 0; i < view_extents_; i++) {
+    extents_[i].tier = TIER_DRAM;
+    extents_[i].state = EXTENT_FREE;
+  }
+  for (int tier = 0; tier < TIER_COUNT; tier++)
+    for (size_t offset = regions_[tier].size; offset > 0;)
+      free_backing_[tier].push_back(offset -= kExtentSize);
+  std::lock_guard<std::mutex> lock(registry_lock);
+  id_ = next_id++;
+  registry[id_] = this;
+}
+
+TieredArena::~TieredArena() {
+  {
+    std::lock_guard<std::mutex> lock(registry_lock);
+    registry.erase(id_);
+  }
+  munmap(view_, view_extents_ * kExtentSize);
+}
+
+size_t TieredArena::classOf(size_t size) {
+  size_t size_class = 0;
+  while ((kMinObjectSize << size_class) < size)
+    size_class++;
+  return size_class;
+}
+
+size_t TieredArena::extentOf(const void *ptr) const {
+  return (static_cast<const char *>(ptr) - view_) / kExtentSize;
+}
+
+TieredArena::Tier TieredArena::tierOf(const void *ptr) const {
+  return static_cast<Tier>(extents_[extentOf(ptr)].tier.load());
+}
+
+size_t TieredArena::freeBytes(Tier tier) const {
+  std::lock_guard<std::mutex> lock(extents_lock_);
+  return free_backing_[tier].size() * kExtentSize;
+}
+
+TieredArena::Cache *TieredArena::cache() {
+  static thread_local ThreadCaches caches;
+  for (auto &[id, cache] : caches.caches)
+    if (id == id_)
+      return cache;
+  Cache *cache = new Cache;
+  {
+    std::lock_guard<std::mutex> lock(extents_lock_);
+    caches_.emplace_back(cache);
+  }
+  caches.caches.emplace_back(id_, cache);
+  return cache;
+}
+
+void *TieredArena::allocate(size_t size, Tier tier) {
+  if (size == 0)
+    size = 1;
+  if (size > kMaxObjectSize) {
+    size_t run = (size + kExtentSize - 1) / kExtentSize;
+    std::lock_guard<std::mutex> lock(extents_lock_);
+    if (free_backing_[tier].size() < run)
+      return nullptr;
+    size_t first = takeRun(run);
+    if (first == view_extents_)
+      return nullptr;
+    for (size_t i = first; i < first + run; i++) {
+      if (!mapExtent(i, tier))
+        throw std::runtime_error("Error mapping an extent");
+      extents_[i].state = EXTENT_LARGE;
+      extents_[i].first = first;
+    }
+    extents_[first].run = run;
+    return view_ + first * kExtentSize;
+  }
+  size_t size_class = classOf(size);
+  std::vector<void *> &objects = cache()->objects[tier][size_class];
+  while (true) {
+    if (objects.empty()) {
+      refill(cache(), tier, size_class);
+      if (objects.empty())
+        return nullptr;
+    }
+    void *ptr = objects.back();
+    objects.pop_back();
+    // the slab may have moved since the object was cached
+    if (tierOf(ptr) == tier)
+      return ptr;
+    std::lock_guard<std::mutex> lock(class_locks_[size_class]);
+    free_objects_[tierOf(ptr)][size_class].push_back(ptr);
+  }
+}
+
+void TieredArena::deallocate(void *ptr) {
+  if (ptr == nullptr)
+    return;
+  size_t index = extentOf(ptr);
+  Extent &extent = extents_[index];
+  if (extent.state == EXTENT_LARGE) {
+    std::lock_guard<std::mutex> lock(extents_lock_);
+    index = extent.first;
+    for (size_t i = index; i < index + extents_[index].run; i++) {
+      unmapExtent(i);
+      free_extents_.push_back(i);
+    }
+    return;
+  }
+  Tier tier = static_cast<Tier>(extent.tier.load());
+  Cache *c = cache();
+  std::vector<void *> &objects = c->objects[tier][extent.size_class];
+  objects.push_back(ptr);
+  if (objects.size() >= kCacheLimit)
+    drain(c, tier, extent.size_class, kCacheBatch);
+}
+
+void TieredArena::refill(Cache *cache, Tier tier, size_t size_class) {
+  std::vector<void *> &objects = cache->objects[tier][size_class];
+  std::unique_lock<std::mutex> lock(class_locks_[size_class]);
+  std::vector<void *> &shared = free_objects_[tier][size_class];
+  if (shared.empty()) {
+    lock.unlock();
+    if (!newSlab(tier, size_class))
+      return;
+    lock.lock();
+  }
+  size_t count = std::min(shared.size(), kCacheBatch);
+  objects.insert(objects.end(), shared.end() - count, shared.end());
+  shared.resize(shared.size() - count);
+}
+
+void TieredArena::drain(Cache *cache, Tier tier, size_t size_class,
+                        size_t keep) {
+  std::vector<void *> &objects = cache->objects[tier][size_class];
+  if (objects.size() <= keep)
+    return;
+  std::lock_guard<std::mutex> lock(class_locks_[size_class]);
+  std::vector<void *> &shared = free_objects_[tier][size_class];
+  shared.insert(shared.end(), objects.begin() + keep, objects.end());
+  objects.resize(keep);
+}
+
+void TieredArena::flush(Cache *cache) {
+  for (int tier = 0; tier < TIER_COUNT; tier++)
+    for (size_t size_class = 0; size_class < kClassCount; size_class++)
+      drain(cache, static_cast<Tier>(tier), size_class, 0);
+}
+
+// Called with <extents_lock_> held.
+size_t TieredArena::takeRun(size_t run) {
+  // freed extents first, the view is not to grow while they would do
+  std::sort(free_extents_.begin(), free_extents_.end());
+  for (size_t i = 0; i + run <= free_extents_.size(); i++) {
+    if (free_extents_[i + run - 1] - free_extents_[i] != run - 1)
+      continue;
+    size_t first = free_extents_[i];
+    free_extents_.erase(free_extents_.begin() + i,
+                        free_extents_.begin() + i + run);
+    return first;
+  }
+  // a free run at the end of the used view grows into fresh extents
+  size_t tail = 0;
+  while (tail < free_extents_.size() && tail < run &&
+         free_extents_[free_extents_.size() - 1 - tail] ==
+             view_used_ - 1 - tail)
+    tail++;
+  if (view_used_ - tail + run > view_extents_)
+    return view_extents_;
+  free_extents_.resize(free_extents_.size() - tail);
+  size_t first = view_used_ - tail;
+  view_used_ = first + run;
+  return first;
+}
+
+bool TieredArena::newSlab(Tier tier, size_t size_class) {
+  size_t index;
+  {
+    std::lock_guard<std::mutex> lock(extents_lock_);
+    if (free_backing_[tier].empty())
+      return false;
+    if (!free_extents_.empty()) {
+      index = free_extents_.back();
+      free_extents_.pop_back();
+    } else if (view_used_ < view_extents_) {
+      index = view_used_++;
+    } else {
+      return false;
+    }
+    if (!mapExtent(index, tier))
+      throw std::runtime_error("Error mapping an extent");
+    extents_[index].state = EXTENT_SLAB;
+    extents_[index].size_class = size_class;
+  }
+  size_t object_size = kMinObjectSize << size_class;
+  char *slab = view_ + index * kExtentSize;
+  std::lock_guard<std::mutex> lock(class_locks_[size_class]);
+  std::vector<void *> &shared = free_objects_[tier][size_class];
+  // backwards, so that objects are handed out by address
+  for (size_t offset = kExtentSize; offset >= object_size;)
+    shared.push_back(slab + (offset -= object_size));
+  return true;
+}
+
+// Called with <extents_lock_> held.
+bool TieredArena::mapExtent(size_t index, Tier tier) {
+  Extent &extent = extents_[index];
+  extent.backing = free_backing_[tier].back();
+  void *addr = mmap(view_ + index * kExtentSize, kExtentSize,
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                    regions_[tier].fd, extent.backing);
+  if (addr == MAP_FAILED)
+    return false;
+  free_backing_[tier].pop_back();
+  extent.tier = tier;
+  return true;
+}
+
+// Called with <extents_lock_> held.
+void TieredArena::unmapExtent(size_t index) {
+  Extent &extent = extents_[index];
+  free_backing_[extent.tier].push_back(extent.backing);
+  extent.state = EXTENT_FREE;
+  // back to a reservation, not a hole another mmap() could take
+  mmap(view_ + index * kExtentSize, kExtentSize, PROT_NONE,
+       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+}
+
+bool TieredArena::move(void *ptr, Tier tier) {
+  size_t index = extentOf(ptr);
+  std::lock_guard<std::mutex> lock(extents_lock_);
+  size_t run = 1;
+  if (extents_[index].state == EXTENT_LARGE) {
+    // <ptr> may point into any extent of the object
+    index = extents_[index].first;
+    run = extents_[index].run;
+  }
+  size_t needed = 0;
+  for (size_t i = index; i < index + run; i++)
+    needed += extents_[i].tier != tier;
+  if (free_backing_[tier].size() < needed)
+    return false;
+  for (size_t i = index; i < index + run; i++)
+    if (extents_[i].tier != tier && !moveExtent(i, tier))
+      throw std::runtime_error("Error remapping an extent");
+  return true;
+}
+
+// Called with <extents_lock_> held.
+bool TieredArena::moveExtent(size_t index, Tier tier) {
+  Extent &extent = extents_[index];
+  Tier from = static_cast<Tier>(extent.tier.load());
+  size_t backing = extent.backing;
+  size_t target = free_backing_[tier].back();
+  // through the mapping of the whole region, the view still maps the source
+  PageCopy::best().copy(regions_[tier].addr + target,
+                        view_ + index * kExtentSize, kExtentSize);
+  if (!mapExtent(index, tier))
+    return false;
+  free_backing_[from].push_back(backing);
+  return true;
+}
@@ -0,0 +1,136 @@
+#ifndef TIERED_ARENA_H
+#define TIERED_ARENA_H
+
+#include "cxl_mem.h"
+#include "tmpfs_mem.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Allocates objects on a DRAM and a CXL region, and moves them between the two
+// without changing their addresses.
+//
+// Objects live in a virtual view reserved up front and split into 2 MiB
+// extents. Each extent in use is mapped MAP_FIXED onto an extent of the file of
+// one tier, so moving it is a copy into a free extent of the other tier and an
+// mmap() over the old mapping: the kernel swaps the mapping atomically, and
+// pointers into the extent stay valid.
+//
+// Objects up to kMaxObjectSize are carved from slabs, one extent of one size
+// class and tier each, through per-thread caches that only take a lock to
+// exchange a batch with the shared free lists. Slabs stay with their class
+// once carved. Larger objects take whole extents, given back when freed.
+// Either region may be a DRAMMem on tmpfs, e.g. to stand in for the CXL tier
+// where there is no CXL device.
+class TieredArena {
+public:
+  enum Tier { TIER_DRAM, TIER_CXL, TIER_COUNT };
+
+  // A file mapped in full, whose extents back the view.
+  struct Region {
+    int fd;
+    char *addr;
+    size_t size;
+  };
+
+  static constexpr size_t kExtentSize = 2UL << 20;
+  static constexpr size_t kMinObjectSize = 16;
+  static constexpr size_t kMaxObjectSize = 64UL << 10;
+
+  static Region regionOf(const MemoryMapper &mapper) {
+    return {mapper.getFd(), mapper.getAddr(), mapper.getSize()};
+  }
+
+  static Region regionOf(const DRAMMem &mem) {
+    return {mem.getFd(), mem.getAddr(), mem.getSize()};
+  }
+
+  // Throws std::runtime_error if a region is not made of whole extents or the
+  // view cannot be reserved. The view defaults to the size of both regions.
+  TieredArena(const Region &dram, const Region &cxl, size_t view_size = 0);
+
+  ~TieredArena();
+
+  // Returns nullptr if <tier> is out of extents or the view is full.
+  void *allocate(size_t size, Tier tier);
+
+  void deallocate(void *ptr);
+
+  // Moves the extents of the object at <ptr> to <tier>; a slab moves with all
+  // its objects. Writers of those extents are to be held off by the caller
+  // meanwhile, stores made during the copy are lost.
+  // Returns false if <tier> is out of extents, true if moved or already there.
+  bool move(void *ptr, Tier tier);
+
+  bool promote(void *ptr) { return move(ptr, TIER_DRAM); }
+  bool demote(void *ptr) { return move(ptr, TIER_CXL); }
+
+  Tier tierOf(const void *ptr) const;
+
+  size_t freeBytes(Tier tier) const;
+
+  TieredArena(const TieredArena &) = delete;
+  TieredArena &operator=(const TieredArena &) = delete;
+
+private:
+  static constexpr size_t kClassCount = 13; // 16 B to 64 KiB, powers of 2
+
+  enum State : uint8_t { EXTENT_FREE, EXTENT_SLAB, EXTENT_LARGE };
+
+  struct Extent {
+    std::atomic<uint8_t> tier; // read without lock by the caches
+    State state;
+    uint8_t size_class;        // of a slab
+    size_t run;                // extents of a large object, at its first one
+    size_t first;              // first extent of the large object of this one
+    size_t backing;            // offset in the file of <tier>
+  };
+
+  struct Cache {
+    std::vector<void *> objects[TIER_COUNT][kClassCount];
+  };
+
+  struct ThreadCaches;
+
+  static size_t classOf(size_t size);
+
+  size_t extentOf(const void *ptr) const;
+
+  Cache *cache();
+
+  void refill(Cache *cache, Tier tier, size_t size_class);
+
+  void drain(Cache *cache, Tier tier, size_t size_class, size_t keep);
+
+  void flush(Cache *cache);
+
+  size_t takeRun(size_t run);
+
+  bool newSlab(Tier tier, size_t size_class);
+
+  bool mapExtent(size_t index, Tier tier);
+
+  void unmapExtent(size_t index);
+
+  bool moveExtent(size_t index, Tier tier);
+
+  Region regions_[TIER_COUNT];
+  char *view_;
+  size_t view_extents_;
+  uint64_t id_; // never reused, tells the caches of this arena apart
+  std::unique_ptr<Extent[]> extents_;
+
+  mutable std::mutex extents_lock_; // guards the members below
+  std::vector<size_t> free_backing_[TIER_COUNT]; // free offsets of each file
+  std::vector<size_t> free_extents_;            // free extents of the view
+  size_t view_used_;                            // extents of the view used
+  std::vector<std::unique_ptr<Cache>> caches_;  // caches of all threads
+
+  std::mutex class_locks_[kClassCount];
+  std::vector<void *> free_objects_[TIER_COUNT][kClassCount];
+};
+
+#endif
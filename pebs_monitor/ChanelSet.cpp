@@ -18,13 +18,18 @@
 #include <unistd.h>
 #include <vector>
 
+#include "../chanel_ref/hotnesstracker.h"
+#include "../chanel_ref/ringbuffer.h"
+#include "../chanel_ref/sampledecoder.h"
+#include "../chanel_ref/topology.h"
+
 constexpr int WAKEUP_EVENTS = 1;
 constexpr unsigned long INIT_SAMPLE_PERIOD = 100000;
 constexpr int PAGE_SIZE = 4096;
 constexpr int RING_BUFFER_PAGES = 4;
 constexpr int MMAP_SIZE = ((1 + RING_BUFFER_PAGES) * PAGE_SIZE);
-
-#define READ_MEMORY_BARRIER() __builtin_ia32_lfence()
+constexpr uint64_t SAMPLE_TYPE = PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_TID |
+                                 PERF_SAMPLE_ADDR | PERF_SAMPLE_CPU;
 
 // Error handling utility
 template <typename CleanupFunc, typename... MsgArgs>
@@ -74,8 +79,7 @@ public:
     attr.config = static_cast<uint64_t>(type);
     attr.size = sizeof(struct perf_event_attr);
     attr.sample_period = INIT_SAMPLE_PERIOD;
-    attr.sample_type = PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_TID |
-                       PERF_SAMPLE_ADDR | PERF_SAMPLE_CPU;
+    attr.sample_type = SAMPLE_TYPE;
     attr.disabled = 1;
     attr.exclude_kernel = 1;
     attr.precise_ip = 3;
@@ -105,11 +109,14 @@ public:
     m_pid = pid;
     m_type = type;
     m_id = id;
+    m_ring.attach(m_buffer, PAGE_SIZE * RING_BUFFER_PAGES);
+    m_ring.resetStats();
     return 0;
   }
 
   void unbind() {
     if (m_fd >= 0) {
+      m_ring.detach();
       munmap(m_buffer, MMAP_SIZE);
       close(m_fd);
       m_fd = -1;
@@ -138,38 +145,28 @@ public:
       return Error([] {}, -EINVAL, false, "Channel not bound");
     }
 
-    auto *meta = reinterpret_cast<struct perf_event_mmap_page *>(m_buffer);
-    uint64_t tail = meta->data_tail;
-    uint64_t head = meta->data_head;
-    READ_MEMORY_BARRIER();
-    // assert(tail <= head);
-    spdlog::debug("tail: {}, head: {}", tail, head);
-
-    if (tail == head) {
-      return -EAGAIN; // No data available
-    }
-
     bool available = false;
-    while (tail < head) {
-      uint64_t position = tail % (PAGE_SIZE * RING_BUFFER_PAGES);
-      auto *entry = reinterpret_cast<struct perf_sample *>(
-          (char *)m_buffer + PAGE_SIZE + position);
-
-      tail += entry->header.size;
-      if (entry->header.type == PERF_RECORD_SAMPLE && entry->id == m_id &&
-          entry->pid == m_pid) {
-            // copy operation
+    m_ring.drain([&](const struct perf_event_header *header) {
+      if (available) {
+        return false;
+      }
+      if (header->type == PERF_RECORD_SAMPLE &&
+          Decoder::get<PERF_SAMPLE_IDENTIFIER>(header) == m_id &&
+          Decoder::pid(header) == static_cast<uint32_t>(m_pid)) {
+        // copy operation
         sample->type = m_type; // LLC_MISSES or LOAD
-        sample->cpu = entry->cpu;
-        sample->pid = entry->pid;
-        sample->tid = entry->tid;
-        sample->address = entry->address;
+        sample->cpu = Decoder::cpu(header);
+        sample->pid = Decoder::pid(header);
+        sample->tid = Decoder::tid(header);
+        sample->address = Decoder::get<PERF_SAMPLE_ADDR>(header);
         available = true;
-        break;
       }
-    }
+      return true;
+    });
+
+    const RingBuffer::Stats &stats = m_ring.getStats();
+    spdlog::debug("lost: {}, throttles: {}", stats.lost, stats.throttles);
 
-    meta->data_tail = tail;
     return available ? 0 : -EAGAIN;
   }
 
@@ -179,26 +176,18 @@ public:
 
   int getPerfFd() const { return m_fd; }
 
+  const RingBuffer::Stats &getStats() const { return m_ring.getStats(); }
+
 private:
+  using Decoder = SampleDecoder<SAMPLE_TYPE>;
+
   pid_t m_pid;
   Type m_type;
   int m_fd;
   uint64_t m_id;
   void *m_buffer;
   unsigned long m_period;
-  struct perf_event_header {
-    uint32_t type;
-    uint16_t misc;
-    uint16_t size;
-  };
-
-  struct perf_sample {
-    struct perf_event_header header;
-    uint64_t id;
-    pid_t pid, tid;
-    uint64_t address; // sampled instruction
-    uint32_t cpu, res;
-  };
+  RingBuffer m_ring;
 };
 
 class ChannelSet {
@@ -354,36 +343,44 @@ private:
   int m_epollfd;
 };
 
+// pages looked at for demotion after each poll
+constexpr size_t SWEEP_BUDGET = 4096;
+// capacity of the fast tier the hot pages are selected for
+constexpr size_t FAST_TIER_BYTES = 1UL << 30;
+// how often the hot set is selected, in ms
+constexpr uint64_t SELECT_INTERVAL = 1000;
+
+uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+void on_cold(uint64_t pfn) {
+  std::cout << "Page cold: " << std::hex << (pfn << 12) << std::dec
+            << std::endl;
+}
+
+// what on_sample() accounts samples to
+struct Monitor {
+  HotnessTracker tracker;
+  Topology topology; // to find the node of the cpu of a sample
+};
+
 void on_sample(void *privdata, Channel::Sample *sample) {
+  Monitor *monitor = static_cast<Monitor *>(privdata);
+  if (monitor->tracker.record(sample->address >> 12, now_ms(), 1, 0,
+                              HotnessTracker::ACCESS_LOAD,
+                              monitor->topology.getNode(sample->cpu),
+                              sample->tid) > 0)
+    std::cout << "Page hot: " << std::hex << (sample->address & ~0xFFFUL)
+              << std::dec << std::endl;
   std::cout << "Sample received: type = " << sample->type
             << ", CPU = " << sample->cpu << ", PID = " << sample->pid
             << ", TID = " << sample->tid << ", Address = " << std::hex
             << sample->address << std::dec << std::endl;
 }
 
-struct PageInfo {
-  unsigned long address;
-  unsigned int accessCount;
-  time_t lastAccessTime;
-  bool isHot;
-};
-
-const unsigned int HOT_ACCESS_THRESHOLD = 1;
-const time_t CLASSIFICATION_PERIOD = 60;
-
-void classifyPages(std::unordered_map<unsigned long, PageInfo> &pages) {
-  for (auto &it : pages) {
-    PageInfo &page = it.second;
-    if (page.accessCount > HOT_ACCESS_THRESHOLD) {
-      page.isHot = true;
-    } else {
-      page.isHot = false;
-    }
-    // Reset access count after classification
-    page.accessCount = 0;
-  }
-}
-
 int main(int argc, char *argv[]) {
   if (argc < 3) {
     std::cerr << "Usage: " << argv[0] << " <period> <pid1> <pid2> ..."
@@ -424,14 +421,47 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  Monitor monitor;
+  HotnessTracker &tracker = monitor.tracker;
+  HotnessTracker::Config config;
+  if (tracker.init(config, 1 << 16) != 0) {
+    std::cerr << "Failed to initialize HotnessTracker." << std::endl;
+    return 1;
+  }
+  if (monitor.topology.init() != 0) {
+    std::cerr << "Failed to read the topology." << std::endl;
+    return 1;
+  }
+  std::vector<uint64_t> shared_pages, local_pages;
+
   size_t total = 0;
+  uint64_t select_time = now_ms();
   while (true) {
-    ssize_t ret = cs.pollSamples(100, nullptr, on_sample);
+    ssize_t ret = cs.pollSamples(100, &monitor, on_sample);
     if (ret < 0) {
       std::cerr << "Error polling samples." << std::endl;
       return 1;
     }
     total += ret;
+    tracker.sweep(now_ms(), SWEEP_BUDGET, on_cold);
+    if (now_ms() - select_time >= SELECT_INTERVAL) {
+      select_time = now_ms();
+      HotnessTracker::Selection selection;
+      tracker.select(select_time, FAST_TIER_BYTES / PAGE_SIZE, &selection);
+      std::cout << "Hot pages: " << selection.pages << "/"
+                << selection.candidates << ", cutoff: " << selection.cutoff
+                << ", access mass: "
+                << (selection.total_mass > 0
+                        ? selection.mass / selection.total_mass
+                        : 0)
+                << std::endl;
+      tracker.sharedPages(&shared_pages);
+      // the nodes of the pages are not known, any single node counts
+      tracker.remotePages(-1, &local_pages, nullptr);
+      std::cout << "Hot pages shared across nodes: " << shared_pages.size()
+                << ", used by a single node: " << local_pages.size()
+                << std::endl;
+    }
     std::cout << "Count: " << ret << ", Total: " << total << std::endl;
   }
 
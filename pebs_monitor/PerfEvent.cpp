@@ -1,5 +1,7 @@
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <chrono>
 #include <condition_variable>
 #include <cstddef>
 #include <cstdint>
@@ -11,10 +13,11 @@
 #include <system_error>
 #include <thread>
 #include <unistd.h>
-#include <unordered_map>
-#include <unordered_set>
 #include <vector>
 
+#include "../chanel_ref/pidfilter.h"
+#include "../chanel_ref/sampleaggregator.h"
+
 extern "C" {
 #include <asm/unistd.h>
 #include <linux/perf_event.h>
@@ -23,9 +26,12 @@ extern "C" {
 constexpr int PEBS_NPROCS = 4;
 constexpr int PERF_PAGES = 1;
 constexpr size_t PAGE_SIZE = 4096;
+constexpr size_t TOP_PAGES = 100;
+constexpr int MERGES = 10;
+constexpr auto MERGE_INTERVAL = std::chrono::milliseconds(100);
 
-std::mutex pid_set_mutex;
-std::unordered_set<uint32_t> monitored_pids;
+// read on every sample, never locked there
+PidFilter monitored_pids;
 
 class PerfEvent {
 public:
@@ -74,33 +80,25 @@ struct Event {
   uint64_t addr;
 };
 
-bool is_pid_monitored(uint32_t pid) {
-  std::lock_guard<std::mutex> lock(pid_set_mutex);
-  return monitored_pids.find(pid) != monitored_pids.end();
-}
+void add_pid_to_monitor(uint32_t pid) { monitored_pids.insert(pid); }
 
-void add_pid_to_monitor(uint32_t pid) {
-  std::lock_guard<std::mutex> lock(pid_set_mutex);
-  monitored_pids.insert(pid);
-}
-
-void remove_pid_from_monitor(uint32_t pid) {
-  std::lock_guard<std::mutex> lock(pid_set_mutex);
-  monitored_pids.erase(pid);
-}
+void remove_pid_from_monitor(uint32_t pid) { monitored_pids.erase(pid); }
 
-void process_perf_event(const Event &event,
-                        std::unordered_map<size_t, size_t> &pageAccessCounts) {
-  if (is_pid_monitored(event.pid)) {
+void process_perf_event(const Event &event, const PidFilter::Reader &pids,
+                        SampleAggregator::Local *pageAccessCounts) {
+  if (pids.contains(event.pid)) {
     size_t page_number = event.addr / PAGE_SIZE;
-    pageAccessCounts[page_number]++;
+    pageAccessCounts->record(page_number);
   }
 }
 
 void pebs_scan_thread(int cpu, std::atomic<bool> &running,
                       perf_event_mmap_page *page, std::condition_variable &cv,
-                      std::mutex &mutex) {
-  std::unordered_map<size_t, size_t> pageAccessCounts;
+                      std::mutex &mutex, SampleAggregator &aggregator) {
+  // counts of this thread, merged into <aggregator> by the main thread
+  SampleAggregator::Local *pageAccessCounts = aggregator.attach();
+  if (pageAccessCounts == NULL)
+    return;
 
   while (running) {
     std::unique_lock<std::mutex> lock(mutex);
@@ -116,23 +114,23 @@ void pebs_scan_thread(int cpu, std::atomic<bool> &running,
     char *pbuf = reinterpret_cast<char *>(page) + page->data_offset;
     std::atomic_thread_fence(std::memory_order_acquire);
 
+    // one snapshot of the pids for the batch
+    PidFilter::Reader pids(monitored_pids);
     while (page->data_head != page->data_tail) {
       struct perf_event_header *header = reinterpret_cast<perf_event_header *>(
           pbuf + (page->data_tail % page->data_size));
       if (header->type == PERF_RECORD_SAMPLE) {
         Event *event = reinterpret_cast<Event *>(
             reinterpret_cast<char *>(header) + sizeof(*header));
-        process_perf_event(*event, pageAccessCounts);
+        process_perf_event(*event, pids, pageAccessCounts);
       }
 
       page->data_tail += sizeof(*header);
     }
+    pageAccessCounts->flush();
   }
 
-  // hot/cold pages
-  for (const auto &pair : pageAccessCounts) {
-    printf("Page %zu accessed %zu times\n", pair.first, pair.second);
-  }
+  aggregator.detach(pageAccessCounts);
 }
 
 int main() {
@@ -141,6 +139,9 @@ int main() {
   std::atomic<bool> running{true};
   std::condition_variable cv;
   std::mutex mutex;
+  SampleAggregator aggregator;
+  if (aggregator.init(SampleAggregator::Config()) != 0)
+    return 1;
 
   perfEvents.reserve(PEBS_NPROCS);
   threads.reserve(PEBS_NPROCS);
@@ -152,7 +153,7 @@ int main() {
   for (int i = 0; i < PEBS_NPROCS; ++i) {
     threads.emplace_back(pebs_scan_thread, i, std::ref(running),
                          perfEvents[i].getPage(), std::ref(cv),
-                         std::ref(mutex));
+                         std::ref(mutex), std::ref(aggregator));
   }
 
   // add PIDs to monitor
@@ -161,6 +162,11 @@ int main() {
 
   remove_pid_from_monitor(1234);
 
+  for (int i = 0; i < MERGES; ++i) {
+    std::this_thread::sleep_for(MERGE_INTERVAL);
+    aggregator.merge();
+  }
+
   running = false;
   cv.notify_all();
 
@@ -168,5 +174,14 @@ int main() {
     thread.join();
   }
 
+  // hot/cold pages, the last counts of the threads included
+  aggregator.merge();
+  auto snapshot = aggregator.snapshot();
+  size_t count = std::min(snapshot->pages.size(), TOP_PAGES);
+  for (size_t i = 0; i < count; ++i) {
+    printf("Page %lu accessed %u times\n", snapshot->pages[i].pfn,
+           snapshot->pages[i].count);
+  }
+
   return 0;
 }
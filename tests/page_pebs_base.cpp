@@ -14,8 +14,13 @@
 #include <unistd.h>
 #include <vector>
 
+#include "../chanel_ref/ringbuffer.h"
+#include "../chanel_ref/sampledecoder.h"
+
 constexpr int PERF_PAGES = 2;
 constexpr __u64 SAMPLE_PERIOD = 1000;
+constexpr __u64 SAMPLE_TYPE =
+    PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_WEIGHT | PERF_SAMPLE_ADDR;
 
 class PerfEvent {
 public:
@@ -27,8 +32,7 @@ public:
     attr.config = config;
     attr.config1 = config1;
     attr.sample_period = SAMPLE_PERIOD;
-    attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_WEIGHT |
-                       PERF_SAMPLE_ADDR;
+    attr.sample_type = SAMPLE_TYPE;
     attr.disabled = 1;
     attr.exclude_kernel = 1;
     attr.exclude_hv = 1;
@@ -48,6 +52,8 @@ public:
     if (metadata_page == MAP_FAILED) {
       throw std::runtime_error("mmap failed: " + std::string(strerror(errno)));
     }
+    // the first page is the metadata page, the rest is the ring
+    ring.attach(metadata_page, sysconf(_SC_PAGESIZE) * (PERF_PAGES - 1));
   }
 
   ~PerfEvent() {
@@ -63,58 +69,34 @@ public:
   void stop() { ioctl(fd, PERF_EVENT_IOC_DISABLE, 0); }
 
   void read() {
-    uint64_t head = metadata_page->data_head;
-    uint64_t tail = metadata_page->data_tail;
-    uint64_t size = head - tail;
-    std::cout << "head: " << head << ", tail: " << tail << ", size: " << size
-              << std::endl;
-    if (size == 0) {
-      return;
-    }
-
-    std::vector<struct perf_event_header> headers(size);
-    std::vector<char> data(size);
-    uint64_t data_offset = tail % (sysconf(_SC_PAGESIZE) * PERF_PAGES);
-    uint64_t data_size = size * sizeof(struct perf_event_header);
-    memcpy(headers.data(), ((char *)metadata_page) + data_offset, data_size);
-    data_offset =
-        (data_offset + data_size) % (sysconf(_SC_PAGESIZE) * PERF_PAGES);
-    data_size = size * sizeof(char);
-    memcpy(data.data(), ((char *)metadata_page) + data_offset, data_size);
-
-    for (size_t i = 0; i < size; i++) {
-      std::cout << "i: " << i << std::endl;
-      struct perf_event_header *header = &headers[i];
-      char *event = &data[i];
+    size_t count = ring.drain([](const struct perf_event_header *header) {
       if (header->type == PERF_RECORD_SAMPLE) {
-        struct perf_event_sample *sample = (struct perf_event_sample *)event;
-        uint64_t ip = sample->ip;
-        uint64_t pid = sample->pid;
-        uint64_t tid = sample->tid;
-        uint64_t addr = sample->addr;
-        uint64_t weight = sample->weight;
+        uint64_t ip = Decoder::get<PERF_SAMPLE_IP>(header);
+        uint64_t pid = Decoder::pid(header);
+        uint64_t tid = Decoder::tid(header);
+        uint64_t addr = Decoder::get<PERF_SAMPLE_ADDR>(header);
+        uint64_t weight = Decoder::get<PERF_SAMPLE_WEIGHT>(header);
         std::cout << "ip: " << ip << ", pid: " << pid << ", tid: " << tid
                   << ", addr: " << addr << ", weight: " << weight << std::endl;
       }
-    }
-
-    metadata_page->data_tail += size;
+      return true;
+    });
+    const RingBuffer::Stats &stats = ring.getStats();
+    std::cout << "records: " << count << ", lost: " << stats.lost
+              << ", throttles: " << stats.throttles << std::endl;
   }
 
 private:
+  using Decoder = SampleDecoder<SAMPLE_TYPE>;
+
   int fd;
   struct perf_event_mmap_page *metadata_page;
+  RingBuffer ring;
 
   static long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
                               int cpu, int group_fd, unsigned long flags) {
     return syscall(__NR_perf_event_open, hw_event, pid, cpu, group_fd, flags);
   }
-  struct perf_event_sample {
-    __u64 ip;
-    __u32 pid, tid;
-    __u64 addr;
-    __u64 weight;
-  };
 };
 
 int main() {